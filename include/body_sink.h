@@ -0,0 +1,90 @@
+#ifndef BODY_SINK_H
+#define BODY_SINK_H
+
+#include <sys/types.h>
+#include <string>
+
+/*
+    请求体消费者。http_conn把请求体按读缓冲区大小的窗口分段交给它，
+    消费者处理完一段之前连接不会继续读取，慢消费者因此自然形成TCP背压。
+*/
+class body_sink
+{
+public:
+    virtual ~body_sink() {}
+    // 消费一段请求体，返回false表示出错，请求以500结束；too_large()为true时以413结束
+    virtual bool write(const char *data, size_t len) = 0;
+    // 上一次write()失败是因为请求体超过了上限
+    virtual bool too_large() const { return false; }
+    // 请求体接收完毕
+    virtual bool finish() { return true; }
+    // 请求被中止（出错或连接关闭）时释放资源
+    virtual void abort() {}
+    // 可以直接splice写入的文件fd，-1表示只能通过write()消费
+    virtual int splice_fd() const { return -1; }
+};
+
+// 丢弃请求体，用于不关心请求体的请求
+class discard_sink : public body_sink
+{
+public:
+    bool write(const char *, size_t) { return true; }
+};
+
+// 把请求体保存在内存中，超过上限时write()失败
+class memory_sink : public body_sink
+{
+public:
+    memory_sink() : m_limit(0), m_too_large(false) {}
+
+    void open(size_t limit)
+    {
+        m_data.clear();
+        m_limit = limit;
+        m_too_large = false;
+    }
+    bool write(const char *data, size_t len)
+    {
+        if (m_data.size() + len > m_limit)
+        {
+            m_too_large = true;
+            return false;
+        }
+        m_data.append(data, len);
+        return true;
+    }
+    bool too_large() const { return m_too_large; }
+    void abort() { std::string().swap(m_data); }
+    const std::string &data() const { return m_data; }
+
+private:
+    std::string m_data;
+    size_t m_limit;
+    bool m_too_large;
+};
+
+/*
+    把请求体写入文件。先写到 path.part，完整接收后再rename到目标路径，
+    中止的上传不会留下不完整的文件。
+*/
+class file_sink : public body_sink
+{
+public:
+    file_sink() : m_fd(-1) {}
+    ~file_sink() { abort(); }
+
+    bool open(const char *path);
+    bool write(const char *data, size_t len);
+    bool finish();
+    void abort();
+    int splice_fd() const { return m_fd; }
+
+private:
+    static constexpr int PATH_LEN = 256;
+
+    int m_fd;
+    char m_path[PATH_LEN];
+    char m_tmp_path[PATH_LEN];
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef BODY_SOURCE_H
+#define BODY_SOURCE_H
+
+#include <cstddef>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <dirent.h>
+
+/*
+    应答体生产者，用于长度事先未知的动态应答。http_conn以
+    Transfer-Encoding: chunked 发出它产生的数据：数据段直接作为writev的iovec，
+    分块框架放在相邻的iovec里，不拷贝数据；多次produce()的结果合并成一块一次发出。
+    套接字不可写时不会向生产者要更多数据，生产速度因此受对端接收速度约束。
+*/
+class body_source
+{
+public:
+    virtual ~body_source() {}
+    /*
+        产生至多max个数据段，指向生产者自己的内存，在下一次consumed()之前保持有效。
+        返回填入的段数，-1表示出错；数据产生完时把eof置为true。
+        返回0且eof为false表示consumed()之前无法再产生数据，本批就此发出；
+        刚consumed()过仍然如此则视为出错：生产者必须同步地产生数据。
+    */
+    virtual int produce(struct iovec *iov, int max, bool &eof) = 0;
+    // 之前产生的所有数据段都已发出，相应内存可以复用
+    virtual void consumed() = 0;
+};
+
+// 以HTML列出目录内容
+class dir_listing_source : public body_source
+{
+public:
+    dir_listing_source() : m_dir(NULL), m_used(0), m_state(HEAD) {}
+    ~dir_listing_source();
+
+    bool open(const char *path, const char *url);
+    int produce(struct iovec *iov, int max, bool &eof);
+    void consumed() { m_used = 0; }
+
+private:
+    static constexpr int BUFFER_SIZE = 16384;
+    static constexpr int ENTRY_MAX = 4096; // 一个目录项转义后的最大长度
+    static constexpr int URL_LEN = 256;
+    enum STATE
+    {
+        HEAD,
+        ENTRIES,
+        TAIL,
+        DONE
+    };
+
+    bool append(const char *format, ...);
+    void append_escaped(const char *text, bool in_url);
+
+    DIR *m_dir;
+    char m_url[URL_LEN];
+    char m_buf[BUFFER_SIZE];
+    int m_used;
+    STATE m_state;
+};
+
+#endif
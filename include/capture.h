@@ -0,0 +1,138 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include "sync.h"
+
+/*
+    流量录制文件。服务器记录每个连接的建立、读到的原始请求字节和关闭，
+    tools/replay按原来的连接和时间间隔回放。
+
+    文件布局：capture_header | 记录……
+    每条记录为 类型(1字节) | 连接号(varint) | 距上一条记录的微秒数(varint)，
+    CAP_DATA之后再跟 长度(varint) | 数据。连接号在一次录制中不重复。
+*/
+
+#define CAPTURE_MAGIC "HTTPCAP1"
+
+struct capture_header
+{
+    char magic[8];
+    uint64_t start_us; // 开始录制时的墙上时间，只用于显示
+};
+
+enum CAPTURE_TYPE
+{
+    CAP_OPEN = 1,
+    CAP_DATA = 2,
+    CAP_CLOSE = 3,
+    CAP_LOST = 4 // 写盘跟不上时丢弃了这个连接的数据，回放时跳过整个连接
+};
+
+struct capture_record
+{
+    int type;
+    uint64_t conn;
+    uint64_t time_us; // 距录制开始的微秒数
+    const char *data;
+    size_t len;
+};
+
+inline void capture_put_varint(std::string &out, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        out += (char)(v | 0x80);
+        v >>= 7;
+    }
+    out += (char)v;
+}
+
+inline bool capture_get_varint(const char *&p, const char *end, uint64_t &v)
+{
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        unsigned char c = *p++;
+        v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 从p解析一条记录，time_us在调用之间累加；数据不完整或者格式错误时返回false
+inline bool capture_next(const char *&p, const char *end, capture_record &r)
+{
+    if (p >= end)
+    {
+        return false;
+    }
+    r.type = (unsigned char)*p++;
+    uint64_t delta, len = 0;
+    if (!capture_get_varint(p, end, r.conn) || !capture_get_varint(p, end, delta))
+    {
+        return false;
+    }
+    r.time_us += delta;
+    r.data = NULL;
+    r.len = 0;
+    if (r.type == CAP_DATA)
+    {
+        if (!capture_get_varint(p, end, len) || len > (uint64_t)(end - p))
+        {
+            return false;
+        }
+        r.data = p;
+        r.len = len;
+        p += len;
+    }
+    return r.type >= CAP_OPEN && r.type <= CAP_LOST;
+}
+
+/*
+    服务器端的录制器。reactor和工作线程都会调用，记录在锁内追加到内存缓冲区并取时间，
+    保证文件中的时间单调；后台线程每秒或者攒够FLUSH_BYTES时写盘，调用者不做磁盘I/O。
+    缓冲区超过MAX_BUFFER时丢弃新数据，并给受影响的连接写一条CAP_LOST。
+*/
+class traffic_capture
+{
+public:
+    static constexpr size_t FLUSH_BYTES = 256 * 1024;
+    static constexpr size_t MAX_BUFFER = 64 * 1024 * 1024;
+
+    explicit traffic_capture(const char *path); // 创建文件和写盘线程，失败时抛出异常
+    ~traffic_capture();
+    traffic_capture(const traffic_capture &) = delete;
+    traffic_capture &operator=(const traffic_capture &) = delete;
+
+    // 为新连接分配连接号并记录CAP_OPEN
+    uint64_t open_connection();
+    void data(uint64_t conn, const char *buf, size_t len);
+    void close_connection(uint64_t conn);
+    // 写完已缓冲的数据并关闭文件，之后的记录被丢弃
+    void stop();
+
+private:
+    static void *worker(void *arg);
+    void run();
+    void append(int type, uint64_t conn, const char *buf, size_t len);
+    uint64_t now_us() const;
+
+    int m_fd;
+    pthread_t m_thread;
+    cond m_cond; // 保护以下成员
+    std::string m_buf;
+    uint64_t m_last_us;
+    bool m_stop;
+    std::atomic<uint64_t> m_next_conn;
+    uint64_t m_start_us;
+};
+
+#endif
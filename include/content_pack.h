@@ -0,0 +1,99 @@
+#ifndef CONTENT_PACK_H
+#define CONTENT_PACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    预先打包的静态站点。tools/pack_site把一个目录打成一个文件：
+    每个url带有预先生成的应答头部行和ETag，可选的gzip变体，
+    以及一张最小完美哈希索引（hash-and-displace），查找只需两次哈希和一次比较。
+    服务器启动时mmap整个文件，应答体用sendfile从打包文件的偏移处直接发出。
+
+    文件布局（本机字节序）：pack_header | pack_entry[entry_count]（按槽位排列）|
+    uint32_t seeds[bucket_count] | url、头部、ETag字符串 | 应答体。
+*/
+
+#define PACK_MAGIC "HTTPPACK"
+static constexpr uint32_t PACK_VERSION = 1;
+
+struct pack_variant
+{
+    uint64_t body_off;
+    uint64_t body_len;
+    uint64_t head_off; // 预先生成的头部行，不含状态行、Connection和空行
+    uint64_t etag_off; // 带引号的ETag
+    uint32_t head_len;
+    uint32_t etag_len;
+};
+
+struct pack_entry
+{
+    uint64_t url_off;
+    uint32_t url_len;
+    uint32_t variant_count; // 1或者2，第二个变体是gzip压缩的
+    pack_variant variants[2];
+};
+
+struct pack_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t bucket_count;
+    uint32_t reserved;
+    uint64_t entries_off;
+    uint64_t seeds_off;
+    uint64_t file_size;
+};
+
+// 打包工具和服务器共用的带种子哈希，种子0决定桶，桶的种子决定槽位
+inline uint64_t pack_hash(const char *key, size_t len, uint32_t seed)
+{
+    uint64_t h = 14695981039346656037ULL ^ (seed * 0x9E3779B97F4A7C15ULL);
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+    只读的打包文件映射。open()时校验全部偏移，之后的查找不再做边界检查；
+    多个线程可以不加锁地并发find()。
+*/
+class content_pack
+{
+public:
+    content_pack() : m_fd(-1), m_base(NULL), m_size(0), m_locked(false), m_header(NULL), m_entries(NULL), m_seeds(NULL) {}
+    ~content_pack();
+    content_pack(const content_pack &) = delete;
+    content_pack &operator=(const content_pack &) = delete;
+
+    // 映射打包文件，lock为true时预读全部页面并锁在内存中；文件损坏返回false
+    bool open(const char *path, bool lock);
+    const pack_entry *find(const char *url, size_t len) const;
+
+    int fd() const { return m_fd; }
+    // 全部页面已锁在内存中，sendfile不会等磁盘
+    bool locked() const { return m_locked; }
+    const char *at(uint64_t off) const { return m_base + off; }
+    size_t entry_count() const { return m_header != NULL ? m_header->entry_count : 0; }
+
+private:
+    bool validate() const;
+
+    int m_fd;
+    char *m_base;
+    size_t m_size;
+    bool m_locked;
+    const pack_header *m_header;
+    const pack_entry *m_entries;
+    const uint32_t *m_seeds;
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <pthread.h>
+#include <vector>
+
+/*
+    CPU亲和性与NUMA拓扑辅助函数。
+    拓扑信息读取自 /sys/devices/system，不依赖libnuma。
+*/
+
+// 当前进程可用的CPU集合（sched_getaffinity），按编号升序
+std::vector<int> online_cpus();
+
+// 解析形如 "0-3,8,10-11" 的CPU列表，格式错误返回false
+bool parse_cpu_list(const char *list, std::vector<int> &cpus);
+
+// CPU所在的NUMA节点，拓扑不可知时返回0
+int cpu_numa_node(int cpu);
+
+// 按NUMA节点对CPU分组，nodes[i]为第i组所在节点，groups[i]为该节点上的CPU
+void group_cpus_by_node(const std::vector<int> &cpus, std::vector<int> &nodes,
+                        std::vector<std::vector<int> > &groups);
+
+// 把线程绑定到给定CPU集合，cpus为空时不做任何事
+bool pin_thread(pthread_t thread, const std::vector<int> &cpus);
+
+// 把尚未创建的线程的属性设置为绑定到给定CPU集合
+bool set_attr_affinity(pthread_attr_t *attr, const std::vector<int> &cpus);
+
+#endif
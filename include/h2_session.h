@@ -0,0 +1,181 @@
+#ifndef H2_SESSION_H
+#define H2_SESSION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include "hpack.h"
+
+class http_conn;
+class body_source;
+class tls_conn;
+
+/*
+    HTTP/2明文连接（h2c），由http_conn在收到连接前言或者完成Upgrade后创建。
+    每个流用一个独立的http_conn作为请求上下文，复用HTTP/1.1的路由、处理器和应答构造，
+    生成的应答头转换成HPACK编码的HEADERS帧，应答体按流量控制窗口切成DATA帧，
+    文件内容以sendfile发出。所有流共享一个套接字、一个输入缓冲区和一个输出队列。
+*/
+class h2_session
+{
+public:
+    static constexpr int FRAME_HEADER_LEN = 9;
+    static constexpr int DEFAULT_FRAME_SIZE = 16384;
+    static constexpr int INPUT_BUFFER_SIZE = 2 * (DEFAULT_FRAME_SIZE + FRAME_HEADER_LEN);
+    static constexpr int MAX_CONCURRENT_STREAMS = 256;
+    static constexpr int DEFAULT_WINDOW = 65535;
+    static constexpr size_t OUTPUT_HIGH_WATER = 256 * 1024; // 输出队列超过此值就暂停生成DATA帧
+    static constexpr size_t MAX_HEADER_BLOCK = 65536;
+    static constexpr int SOURCE_IOV_MAX = 16;
+
+    // limit_key是连接的rate_limiter键，每个新流按一个请求计费
+    explicit h2_session(int sockfd, tls_conn *tls = NULL, uint64_t limit_key = 0);
+    ~h2_session();
+
+    // 以prior knowledge方式开始，data是已经读到的字节，从连接前言开始
+    bool start(const char *data, size_t len);
+    // 以Upgrade方式开始：req是发起升级的请求，成为流1；rest是请求之后已经读到的字节
+    bool start_upgrade(const http_conn &req, const char *settings, const char *rest, size_t rest_len);
+
+    bool read();    // 读套接字到输入缓冲区，返回false表示对端关闭或出错
+    bool process(); // 处理输入缓冲区中的完整帧并执行请求，返回false表示连接必须关闭
+    bool write();   // 生成并发送输出，遇到EAGAIN返回true，返回false表示连接必须关闭
+    bool want_write() const { return !m_out.empty(); }
+    bool finished() const;
+
+private:
+    enum FRAME_TYPE
+    {
+        FRAME_DATA = 0,
+        FRAME_HEADERS = 1,
+        FRAME_PRIORITY = 2,
+        FRAME_RST_STREAM = 3,
+        FRAME_SETTINGS = 4,
+        FRAME_PUSH_PROMISE = 5,
+        FRAME_PING = 6,
+        FRAME_GOAWAY = 7,
+        FRAME_WINDOW_UPDATE = 8,
+        FRAME_CONTINUATION = 9
+    };
+    enum FRAME_FLAG
+    {
+        FLAG_END_STREAM = 0x1,
+        FLAG_ACK = 0x1,
+        FLAG_END_HEADERS = 0x4,
+        FLAG_PADDED = 0x8,
+        FLAG_PRIORITY = 0x20
+    };
+    enum ERROR_CODE
+    {
+        NO_ERROR = 0,
+        PROTOCOL_ERROR = 1,
+        INTERNAL_ERROR = 2,
+        FLOW_CONTROL_ERROR = 3,
+        STREAM_CLOSED = 5,
+        FRAME_SIZE_ERROR = 6,
+        REFUSED_STREAM = 7,
+        COMPRESSION_ERROR = 9
+    };
+    enum BODY_KIND
+    {
+        BODY_NONE,
+        BODY_MEMORY,
+        BODY_FILE,
+        BODY_SOURCE
+    };
+
+    struct stream
+    {
+        unsigned id;
+        http_conn *ctx;        // 请求上下文
+        int error;             // 请求头阶段的错误应答（http_conn::HTTP_CODE），0表示没有
+        bool recv_closed;      // 对端已经发送END_STREAM
+        bool responded;        // 已经生成应答头
+        bool end_sent;         // 已经生成带END_STREAM的帧
+        bool reset;            // 已被RST_STREAM关闭
+        long long send_window;
+        long long recv_window; // 对端还可以发送的DATA字节数
+        size_t recv_consumed;  // 已交给消费者但尚未通过WINDOW_UPDATE归还的字节数
+        BODY_KIND body;
+        std::string mem;       // 内存应答体，或者从生产者拷出的数据
+        size_t mem_off;
+        int file_fd;
+        bool file_shared;      // 打包文件的描述符，不由流关闭
+        off_t file_off;
+        long long file_left;
+        body_source *source;
+        bool source_eof;
+        int inflight;          // 输出队列中引用本流文件的段数
+    };
+
+    // 输出队列中的一段：内存字节，或者sendfile的一段文件
+    struct out_seg
+    {
+        std::string data;
+        size_t off;
+        int fd;
+        off_t file_off;
+        size_t file_len;
+        stream *owner;
+    };
+
+    bool handle_frame(int type, int flags, unsigned sid, const unsigned char *payload, size_t len);
+    bool on_data(int flags, unsigned sid, const unsigned char *payload, size_t len);
+    bool on_headers(int flags, unsigned sid, const unsigned char *payload, size_t len);
+    bool on_continuation(int flags, unsigned sid, const unsigned char *payload, size_t len);
+    bool on_header_block();
+    bool on_settings(int flags, const unsigned char *payload, size_t len, bool ack_needed);
+    bool on_window_update(unsigned sid, const unsigned char *payload, size_t len);
+    bool on_rst_stream(unsigned sid, size_t len);
+
+    stream *new_stream(unsigned id);
+    stream *find_stream(unsigned id);
+    void finish_request(stream *s);
+    void respond(stream *s);
+    void release_stream(stream *s);
+    void close_stream(stream *s);
+    bool fill_source(stream *s, size_t want);
+    void pump();
+
+    void queue_frame(int type, int flags, unsigned sid, const char *payload, size_t len);
+    void queue_settings();
+    void reset_stream(unsigned sid, ERROR_CODE code);
+    bool goaway(ERROR_CODE code);
+
+    int m_sockfd;
+    tls_conn *m_tls;
+    uint64_t m_limit_key;
+    bool m_expect_preface;
+    bool m_peer_closed;
+    bool m_upgrade_pending;      // 升级请求（流1）还没有生成应答
+    bool m_goaway_sent;
+    bool m_goaway_received;
+
+    unsigned char m_in[INPUT_BUFFER_SIZE];
+    size_t m_in_len;
+
+    hpack_decoder m_decoder;
+    hpack_encoder m_encoder;
+    std::string m_header_block;  // 正在拼接的头部块（HEADERS + CONTINUATION）
+    unsigned m_header_sid;       // 非0表示正在等待CONTINUATION
+    bool m_header_end_stream;
+
+    std::map<unsigned, stream *> m_streams;
+    unsigned m_last_stream_id;
+    unsigned m_cursor;           // DATA帧轮转调度的位置
+    int m_open_streams;
+
+    long long m_send_window;     // 连接级发送窗口
+    long long m_initial_window;  // 对端SETTINGS_INITIAL_WINDOW_SIZE
+    size_t m_peer_frame_size;    // 对端SETTINGS_MAX_FRAME_SIZE
+    long long m_recv_window;     // 连接级接收窗口的剩余量，DATA帧超过它是FLOW_CONTROL_ERROR
+    size_t m_recv_consumed;      // 已消费但尚未通过WINDOW_UPDATE归还的连接级接收窗口
+
+    std::deque<out_seg> m_out;
+    size_t m_out_bytes;
+};
+
+#endif
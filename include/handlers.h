@@ -0,0 +1,35 @@
+#ifndef HANDLERS_H
+#define HANDLERS_H
+
+#include "http_conn.h"
+
+/*
+    内置的路由处理器，由main.cpp中的路由表挂到路径上。
+*/
+
+extern const char *doc_root;
+extern upstream_pool *proxy_upstream; // 反向代理的后端组，未配置时为NULL
+extern content_pack *site_pack;       // 预先打包的静态站点，未配置时为NULL
+
+// 从doc_root发送静态文件，路径取自通配参数"path"
+http_conn::HTTP_CODE serve_static(http_conn &conn, const route_params &params);
+// 从site_pack发送静态文件，不在包中的url回退到serve_static
+http_conn::HTTP_CODE serve_packed(http_conn &conn, const route_params &params);
+// 健康检查，以JSON返回当前连接数
+http_conn::HTTP_CODE serve_health(http_conn &conn, const route_params &params);
+// PUT上传：请求头解析完后打开目标文件接收请求体
+http_conn::HTTP_CODE accept_upload(http_conn &conn, const route_params &params);
+// PUT上传：请求体接收完毕
+http_conn::HTTP_CODE finish_upload(http_conn &conn, const route_params &params);
+// 反向代理：请求头解析完后在内存中暂存请求体
+http_conn::HTTP_CODE accept_proxy_body(http_conn &conn, const route_params &params);
+// 反向代理：把请求转发给proxy_upstream
+http_conn::HTTP_CODE proxy_pass(http_conn &conn, const route_params &params);
+// WebSocket：升级连接并订阅路径参数"topic"
+http_conn::HTTP_CODE serve_websocket(http_conn &conn, const route_params &params);
+// 发布：请求头解析完后在内存中暂存消息
+http_conn::HTTP_CODE accept_publish(http_conn &conn, const route_params &params);
+// 发布：把请求体作为一条文本消息发给主题的全部订阅者
+http_conn::HTTP_CODE publish_message(http_conn &conn, const route_params &params);
+
+#endif
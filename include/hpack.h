@@ -0,0 +1,56 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstddef>
+
+/*
+    HPACK（RFC 7541）头部压缩。
+    解码器支持静态表、动态表和Huffman编码；
+    编码器只输出不进入动态表的字面量，因此无需跟踪对端的动态表。
+*/
+
+struct hpack_header
+{
+    std::string name;
+    std::string value;
+};
+
+class hpack_decoder
+{
+public:
+    static constexpr size_t DEFAULT_TABLE_SIZE = 4096;
+    static constexpr size_t MAX_STRING_LEN = 16384;
+
+    hpack_decoder() : m_size(0), m_max_size(DEFAULT_TABLE_SIZE), m_limit(DEFAULT_TABLE_SIZE) {}
+
+    // 解码一个完整的头部块，追加到headers；返回false表示压缩错误，连接必须关闭
+    bool decode(const unsigned char *data, size_t len, std::vector<hpack_header> &headers);
+
+private:
+    bool get(size_t index, const hpack_header *&header) const;
+    void insert(const std::string &name, const std::string &value);
+    void evict(size_t max_size);
+
+    std::deque<hpack_header> m_dynamic; // 最新的表项在前
+    size_t m_size;                      // 动态表当前大小，每项为名字+值+32
+    size_t m_max_size;                  // 对端通过表大小更新指令设置的上限
+    size_t m_limit;                     // 我方SETTINGS_HEADER_TABLE_SIZE
+};
+
+class hpack_encoder
+{
+public:
+    void encode_status(int status, std::string &out);
+    // name必须是小写
+    void encode(const char *name, size_t name_len, const char *value, size_t value_len, std::string &out);
+};
+
+// 解码HPACK整数，prefix为前缀位数；返回false表示数据不足或溢出
+bool hpack_decode_int(const unsigned char *&p, const unsigned char *end, int prefix, size_t &value);
+void hpack_encode_int(size_t value, int prefix, unsigned char first, std::string &out);
+bool hpack_huffman_decode(const unsigned char *data, size_t len, std::string &out);
+
+#endif
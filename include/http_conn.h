@@ -13,19 +13,49 @@
 #include <sys/epoll.h>
 #include <sys/stat.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstring>
 #include <cstdlib>
 #include <cstdarg>
 #include <cstdio>
+#include <ctime>
+#include <atomic>
+#include "body_sink.h"
+#include "body_source.h"
+#include "router.h"
+#include "threadpool.h"
 
-class http_conn
+struct route;
+class h2_session;
+class tls_conn;
+class proxy_exchange;
+class upstream_pool;
+class content_pack;
+class rate_limiter;
+class ws_session;
+class ws_hub;
+class traffic_capture;
+class io_pool;
+
+/*
+    每个连接一个槽位，users[]按fd索引。槽位按缓存行对齐，相邻的连接由不同线程处理时不会争用同一缓存行。
+    epoll事件和线程池任务都带有槽位代数，连接关闭后遗留的事件和任务在使用前被丢弃。
+*/
+class alignas(64) http_conn
 {
 public:
     static constexpr int FILENAME_LEN = 200;
     static constexpr int READ_BUFFER_SIZE = 2048;
     static constexpr int WRITE_BUFFER_SIZE = 1024;
+    static constexpr int INLINE_FILE_LIMIT = 64 * 1024; // 不超过此大小的热文件可在reactor上就地处理
+    static constexpr int HOT_FILE_SLOTS = 4096;         // 热文件预测表槽数，必须是2的幂
+    static constexpr int HOT_FILE_TTL = 8;              // 热文件记录的有效秒数
+    static constexpr int MIN_BODY_WINDOW = 256;         // 请求头之后至少要留给请求体的缓冲区大小
+    static constexpr int MAX_CHUNK_LINE = 128;          // 分块编码中块大小行的最大长度
+    static constexpr int STREAM_IOV_MAX = 16;           // 流式应答每批最多合并的数据段数
+    static constexpr int STREAM_FLUSH_BYTES = 16384;    // 流式应答攒够这么多数据就发出一批
     //解析http请求，主状态机状态
     enum CHECK_STATE
     {
@@ -42,8 +72,17 @@ public:
         NO_RESOURCE,//
         FORBIDDEN_REQUEST,//
         FILE_REQUEST,//
+        CREATED_REQUEST,// 上传完成
+        STREAM_REQUEST, // 由m_source产生的流式应答
+        RESPONSE_READY, // 处理器已在写缓冲区中构造好应答
+        BAD_METHOD,     // 路径存在但不支持该方法
         INTERNAL_ERROR,//
-        CLOSED_CONNECTION
+        PROXY_REQUEST,     // 请求转发给上游，应答由proxy_exchange产生
+        BAD_GATEWAY,       // 上游不可用或者应答无效
+        PAYLOAD_TOO_LARGE, // 请求体超过处理器允许的大小
+        CLOSED_CONNECTION,
+        UPGRADE_H2,     // 连接转为HTTP/2（连接前言或者Upgrade: h2c）
+        WEBSOCKET_REQUEST // 以101应答升级为WebSocket
     };
     //解析http请求时行的状态，从状态机状态
     enum LINE_STATE
@@ -66,65 +105,266 @@ public:
         PATCH,
         UNKOWN
     };
+    static constexpr int METHOD_NUM = UNKOWN;
+    //分块编码请求体的解码状态
+    enum CHUNK_STATE
+    {
+        CHUNK_SIZE,     //块大小行
+        CHUNK_DATA,     //块数据
+        CHUNK_DATA_END, //块数据后的CRLF
+        CHUNK_TRAILER,  //末尾的trailer头部
+        CHUNK_DONE
+    };
+    //在reactor线程上就地处理的结果
+    enum INLINE_RESULT
+    {
+        INLINE_DONE,  //已处理完毕，连接保持
+        INLINE_CLOSE, //已处理完毕，需要关闭连接
+        INLINE_DEFER  //预测会阻塞，交给线程池
+    };
 
 public:
-    http_conn() {}
-    ~http_conn() {}
+    http_conn() : m_generation(0), m_sockfd(-1), m_cold(NULL), m_h2(NULL), m_tls(NULL), m_proxy(NULL), m_ws(NULL), m_source(NULL), m_file_fd(-1), m_limit_key(0) {}
+    ~http_conn() { delete m_cold; }
 
 public:
-    void init(int sockfd, const sockaddr_in &addr);
+    void init(int sockfd, const sockaddr *addr, socklen_t addr_len);
     bool read();    // 对外接口，读http请求
     void process(); // 对外接口，读完http请求之后由线程池调用处理http请求，构造http回答
+    INLINE_RESULT process_inline(bool adaptive); // 对外接口，由reactor就地解析、处理并尝试第一次写
     bool write();   // 对外接口，写http回答
     void close_conn();
+    // 槽位代数，和epoll事件、线程池任务中记录的代数不同时说明它们属于已关闭的连接
+    uint32_t generation() const { return m_generation.load(std::memory_order_acquire); }
+    // 重新注册本连接的事件（EPOLLONESHOT），事件中带有槽位代数
+    void arm(int ev);
+    // 每个HTTP/1.1请求第一次读到数据后返回一次true，供reactor在处理前做限速检查
+    bool begin_request();
+    // 发出预先构造的应答后关闭连接，返回false表示已可关闭
+    bool reject(const char *response, int len);
+    // 对端地址，可能是IPv4、IPv6或者AF_UNIX
+    const sockaddr *get_address() const { return (const sockaddr *)&m_cold->peer; }
+    // 对端的IP地址文本，AF_UNIX等没有IP的连接返回false
+    bool peer_ip(char *buf, size_t len) const;
+    // 对端在限速表中的键，0表示不受限
+    uint64_t limit_key() const { return m_limit_key; }
+    // 由reactor在交给线程池前调用，按请求行预测处理代价
+    TASK_PRIORITY priority();
+    // 还没开始应答的HTTP/1.1请求可以以503放弃；HTTP/2、转发中和握手中的连接不能
+    bool can_shed() const;
+    // 以503应答并关闭连接，线程池排队过久或者队列满时调用
+    void shed();
+
+    // 预先构造好的429应答
+    static constexpr char TOO_MANY_REQUESTS[] =
+        "HTTP/1.1 429 Too Many Requests\r\nContent-Type: text/plain\r\nContent-Length: 18\r\n"
+        "Retry-After: 1\r\nConnection: close\r\n\r\nToo many requests\n";
+    // 预先构造好的503应答
+    static constexpr char SERVICE_UNAVAILABLE[] =
+        "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/plain\r\nContent-Length: 18\r\n"
+        "Retry-After: 1\r\nConnection: close\r\n\r\nServer overloaded\n";
+
+    /*
+        供路由处理器使用的接口。处理器在process()所在线程上被调用，
+        返回RESPONSE_READY、FILE_REQUEST、STREAM_REQUEST或者错误码。
+    */
+    METHOD get_method() const { return m_method; }
+    const char *get_url() const { return m_url; }     // 不含查询串
+    const char *get_query() const { return m_query; } // 没有查询串时为NULL
+    const char *get_host() const { return m_host; }
+    long long get_content_length() const { return m_content_length; }
+    // 构造完整的小应答，body拷贝进写缓冲区，放不下时返回false
+    bool respond(int status, const char *content_type, const char *body, int len);
+    bool redirect(int status, const char *location);
+    // 发送文件，目录在开启列表时以流式应答列出
+    HTTP_CODE serve_file(const char *path);
+    // 从打包文件中发送当前url，可能时选择gzip变体，ETag匹配时以304应答；url不在包中返回NO_RESOURCE
+    HTTP_CODE serve_packed(const content_pack &pack);
+    // 以分块编码发送source产生的数据，连接接管source并在结束后delete
+    HTTP_CODE stream(const char *content_type, body_source *source);
+    // 在请求体回调中设置请求体消费者，sink的生命期由调用者保证
+    void set_body_sink(body_sink *sink) { m_body_sink = sink; }
+    // 在请求体回调中把请求体写入文件
+    bool receive_to_file(const char *path);
+    // 在请求体回调中把请求体暂存在内存中，超过limit字节时请求以500结束
+    void receive_to_memory(size_t limit);
+    // receive_to_memory()接收到的请求体
+    const std::string &get_body() const { return m_cold->memory.data(); }
+    // 把请求转发给上游后端组，应答头和应答体由上游产生
+    HTTP_CODE proxy(upstream_pool *pool);
+    // 把连接升级为WebSocket并订阅topic，不是合法的升级请求时返回BAD_REQUEST
+    HTTP_CODE websocket(std::string_view topic);
+    // 非NULL时连接已升级为WebSocket，由reactor直接驱动
+    ws_session *websocket_session() const { return m_ws; }
+
+    // 方法名区分大小写，不认识的返回UNKOWN
+    static METHOD parse_method(const char *text);
+    static const char *method_name(METHOD method);
 
 private:
+    // h2_session为每个流创建一个http_conn作为请求上下文，直接使用其解析和应答构造
+    friend class h2_session;
+    // 转发期间由proxy_exchange直接读取请求并向客户端套接字写应答
+    friend class proxy_exchange;
+
     void init();
+    void init_request(); // 重置请求状态，不重新注册事件
 
-    HTTP_CODE process_read();      //解析请求
+    HTTP_CODE process_read(bool stop_before_body = false); //解析请求
     bool process_write(HTTP_CODE); //构造应答
 
     LINE_STATE parse_line();
     HTTP_CODE parse_request_line(char *text);
     HTTP_CODE parse_header(char *text);
-    HTTP_CODE parse_content(char *text);
+    HTTP_CODE parse_content();
+    HTTP_CODE parse_chunked();
+    HTTP_CODE splice_body();
+    bool consume_body(int len);
+    HTTP_CODE route_request();
     HTTP_CODE do_request();
+    bool predict_blocking();
+    bool predict_body_blocking();
+    void remember_hot_file();
+    bool continue_handshake();
+    bool can_splice_body() const;
+    bool start_h2(bool upgrade);
+    bool write_proxy();
+    bool run_h2();
+    bool start_websocket();
+    void release_file();
+    static bool accepts_gzip(const char *value);
 
     bool add_status_line(int status,const char*title);
     bool add_headers(int content_len);
     bool add_content_length(int length);
+    bool add_content_type(const char *type);
+    bool add_chunked();
     bool add_content(const char* content);
     bool add_linger();
     bool add_blank_line();
     bool add_response(const char* format,...);
+
+    bool fill_stream_batch();
+    bool write_stream();
+    bool finish_response();
     
 public:
     static int m_epollfd;
-    static int m_user_count;
+    static std::atomic<int> m_user_count; // 工作线程也会关闭连接
+    static std::atomic<long> m_shed_count; // 因过载以503放弃的请求数
+    static const char *m_upload_root;     // PUT上传的目标目录，NULL表示不接受上传
+    static bool m_dir_listing;            // 是否为目录生成文件列表
+    static const router<route, METHOD_NUM> *m_router; // 启动时建好，之后只读
+    static rate_limiter *m_limiter;       // 按IP限制连接数，NULL表示不限制
+    static ws_hub *m_ws_hub;              // WebSocket主题表，NULL表示不接受升级
+    static traffic_capture *m_capture;    // 录制读到的请求字节，NULL表示不录制
+    static io_pool *m_io_pool;            // 冷文件读盘线程池，NULL表示sendfile直接读盘
 
 private:
-    int m_sockfd;
-    sockaddr_in m_addr;
+    /*
+        体积大或者只在部分请求中用到的状态。每个槽位第一次使用时分配，之后随槽位复用，
+        users[]中只剩下紧凑的热状态，也不会为从未使用过的fd占用内存。
+    */
+    struct cold_state
+    {
+        cold_state() { pipe[0] = pipe[1] = -1; peer.ss_family = AF_UNSPEC; }
+
+        char read_buf[READ_BUFFER_SIZE];
+        char write_buf[WRITE_BUFFER_SIZE];
+        struct stat file_stat;
+        route_params params;  // 路径参数指向读缓冲区中的url
+        discard_sink discard;
+        file_sink file;
+        memory_sink memory;
+        int pipe[2];          // splice请求体用的管道，按需创建，连接关闭时释放
+        struct iovec stream_iov[STREAM_IOV_MAX + 4];
+        char chunk_head[20];
+        sockaddr_storage peer;
+    };
 
-    char m_read_buf[READ_BUFFER_SIZE];
+    // 热状态：reactor分派和每次读写都要访问的字段放在最前面
+    std::atomic<uint32_t> m_generation; // 槽位代数，连接关闭时加一
+    int m_sockfd;
+    CHECK_STATE m_check_state;
     int m_read_idx;
     int m_checked_idx;
+    int m_write_idx;
+    int m_sent_idx;
+    bool m_linger;
+    bool m_request_parsed; // 请求已在reactor上解析完，线程池无需再解析
+    bool m_request_begun;  // 本请求已经过begin_request()
+    bool m_ws_pending;     // 101应答已构造，发完后在reactor上切换为WebSocket
+    cold_state *m_cold;
+    h2_session *m_h2; // 非NULL时连接已转为HTTP/2，读写都交给它
+    tls_conn *m_tls;  // 非NULL时连接在TLS上，套接字读写都经过它
+    proxy_exchange *m_proxy; // 非NULL时请求正在转发，读写事件交给它
+    ws_session *m_ws; // 非NULL时连接已升级为WebSocket，读写都交给它
+    body_source *m_source;
+    body_sink *m_body_sink;
+    int m_file_fd;
+
     int m_line_start;
-    CHECK_STATE m_check_state;
+    int m_headers_start; // 请求头部行在读缓冲区中的范围，各行以'\0'结尾
+    int m_headers_end;
+    uint64_t m_limit_key;  // rate_limiter::key_of(对端地址)
+    uint64_t m_capture_id; // 录制文件中的连接号
+
+    // 请求头解析完时匹配的路由
+    const route *m_route;
+    HTTP_CODE m_route_result;
 
     METHOD m_method;
     char *m_url;
+    char *m_query;
     char *m_version;
     char *m_host;
-    int m_content_length;
-    bool m_linger;
+    long long m_content_length;
+    bool m_upgrade_h2;      // 请求带有Upgrade: h2c
+    bool m_accept_gzip;     // Accept-Encoding允许gzip
+    bool m_upgrade_ws;      // 请求带有Upgrade: websocket
+    bool m_ws_version_ok;   // Sec-WebSocket-Version为13
+    char *m_h2_settings;    // HTTP2-Settings头部的值
+    char *m_if_none_match;  // If-None-Match头部的值
+    char *m_ws_key;         // Sec-WebSocket-Key头部的值
+    const char *m_ws_topic; // 升级后订阅的主题，指向读缓冲区中的url
+    int m_ws_topic_len;
 
-    char m_write_buf[WRITE_BUFFER_SIZE];
-    int m_write_idx;
-    int m_sent_idx;
-    struct stat m_file_stat;
-    int m_file_fd;
+    // 请求体以流的方式经过读缓冲区中请求头之后的窗口交给m_body_sink
+    bool m_chunked;
+    bool m_expect_continue;
+    int m_body_start;            // 请求体窗口在读缓冲区中的起点
+    long long m_body_remaining;  // Content-Length请求体尚未消费的字节数
+    CHUNK_STATE m_chunk_state;
+    long long m_chunk_remaining; // 当前块尚未消费的字节数
+
+    int m_headers_len; // 写缓冲区中应答头的长度，HEAD请求只发这部分
     int m_file_sent_sz;
+    off_t m_file_offset;            // 下一次sendfile的文件偏移
+    off_t m_file_ready;             // 已确认在页缓存中的数据的结束偏移
+    bool m_file_shared;             // m_file_fd属于打包文件，不能关闭
+    const char *m_packed_head;      // 非NULL时应答头部行取自打包文件
+    int m_packed_head_len;
+
+    // 流式应答：writev的iovec依次为未发出的应答头、块大小行、数据段、块尾CRLF、结束块
+    const char *m_content_type;
+    bool m_source_eof;
+    bool m_stream_pending;  // 本批含有生产者的数据，发完后要通知consumed()
+    int m_stream_iov_cnt;
+    int m_stream_iov_idx;
+};
+
+/*
+    路由表项。handler在请求完整接收后生成应答；
+    on_body在请求头解析完后调用，为请求体选择消费者，为NULL时请求体被丢弃；
+    may_block表示处理器可能阻塞，自适应模式下据此决定是否交给线程池。
+*/
+struct route
+{
+    http_conn::HTTP_CODE (*handler)(http_conn &conn, const route_params &params);
+    http_conn::HTTP_CODE (*on_body)(http_conn &conn, const route_params &params);
+    bool may_block;
 };
 
-#endif
\ No newline at end of file
+typedef router<route, http_conn::METHOD_NUM> http_router;
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include "sync.h"
+
+class http_conn;
+
+/*
+    冷文件的读盘线程池。reactor和工作线程在sendfile之前用resident()检查下一段数据
+    是否已在页缓存中，不在时把连接交给这里：I/O线程把这段数据读进页缓存，
+    并对后面一段发起预读，然后重新注册连接的EPOLLOUT，之后的sendfile不再阻塞在磁盘上。
+    交出去的连接在重新注册之前没有任何事件，也就不会被其他线程访问或者关闭。
+*/
+class io_pool
+{
+public:
+    static constexpr size_t WINDOW = 256 * 1024;  // 每次检查和读入的范围
+    static constexpr int DEFAULT_THREADS = 4;
+    static constexpr int DEFAULT_JOBS = 256;
+
+    io_pool(int thread_num, int max_jobs); // 创建I/O线程，失败时抛出异常
+    ~io_pool();
+    io_pool(const io_pool &) = delete;
+    io_pool &operator=(const io_pool &) = delete;
+
+    static long page_size();
+    // [off, off+len)全部在页缓存中；无法判断时返回true，按热数据处理
+    static bool resident(int fd, off_t off, size_t len);
+    // 读入[off, off+len)后重新注册conn的EPOLLOUT，队列满时返回false，调用者只能同步发送
+    bool prefetch(http_conn *conn, int fd, off_t off, size_t len);
+
+private:
+    struct job
+    {
+        http_conn *conn;
+        uint32_t generation;
+        int fd;
+        off_t off;
+        size_t len;
+    };
+
+    static void *worker(void *arg);
+    void run();
+    void join_threads(int count);
+
+    int m_thread_num;
+    size_t m_max_jobs;
+    pthread_t *m_threads;
+    std::deque<job> m_jobs;
+    locker m_lock; // 保护m_jobs和m_stop
+    sem m_pending;
+    bool m_stop;
+};
+
+#endif
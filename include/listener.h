@@ -0,0 +1,40 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <string>
+
+/*
+    监听地址，由命令行的-b给出，格式为：
+      port 或者 host:port    IPv4，省略host时为0.0.0.0
+      [addr]:port            IPv6，只接受IPv6连接（IPV6_V6ONLY），可以和IPv4监听同一端口
+      unix:/path             AF_UNIX流式套接字，本机的前置代理不必经过TCP协议栈
+    后面可以跟逗号分隔的选项，设置在监听套接字上，接受的连接继承这些设置：
+      backlog=N  reuseport  nodelay  rcvbuf=N  sndbuf=N  mode=0660（只用于unix）
+*/
+struct listen_spec
+{
+    static constexpr int DEFAULT_BACKLOG = 5;
+
+    int family;       // AF_INET、AF_INET6或者AF_UNIX
+    std::string host; // 数字地址
+    int port;
+    std::string path; // AF_UNIX的套接字文件
+    int backlog;
+    bool reuseport;
+    bool nodelay;
+    int rcvbuf;       // 0表示使用系统默认值
+    int sndbuf;
+    int mode;         // 套接字文件的权限，-1表示不修改
+};
+
+// 格式错误返回false
+bool parse_listen_spec(const char *text, listen_spec &spec);
+
+// 创建、绑定并开始监听，失败时返回-1并保留errno；
+// AF_UNIX会先删除遗留的同名套接字文件，但不会删除其他类型的文件
+int open_listener(const listen_spec &spec);
+
+// 用于日志和错误信息，如"0.0.0.0:80"、"[::1]:80"、"unix:/run/web.sock"
+std::string listen_name(const listen_spec &spec);
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <sys/types.h>
+#include <string>
+
+class http_conn;
+class upstream_pool;
+
+/*
+    一次反向代理转发。处理器线程构造转发请求并取得上游连接，之后由reactor驱动：
+    客户端连接和上游连接任何时刻只有一个注册了事件，状态机因此不需要加锁。
+    应答头在用户态改写，定长和以关闭结束的应答体用splice经管道从上游套接字
+    直接搬到客户端套接字；分块编码的应答体需要跟踪块边界，经用户态缓冲区转发。
+*/
+class proxy_exchange
+{
+public:
+    static constexpr int HEAD_BUFFER_SIZE = 8192;   // 上游应答头的最大长度
+    static constexpr int COPY_BUFFER_SIZE = 16384;  // 用户态转发时每次读取的字节数
+    static constexpr int SPLICE_CHUNK = 65536;      // 每次splice进管道的最大字节数
+    static constexpr int MAX_UPSTREAM_FD = 65536;
+    static constexpr size_t MAX_BODY = 1024 * 1024; // 转发的请求体在内存中暂存，超过此大小以413拒绝
+
+    enum RESULT
+    {
+        PROXY_PENDING,     // 已注册了某一端的事件，等待继续
+        PROXY_DONE,        // 应答已完整转发
+        PROXY_BAD_GATEWAY, // 应答头发出前失败，由连接以502应答
+        PROXY_ABORT        // 应答已部分发出后失败，只能关闭连接
+    };
+
+    proxy_exchange(http_conn &client, upstream_pool &pool);
+    ~proxy_exchange();
+
+    // 在处理器中调用：构造转发请求并取得上游连接，失败返回false
+    bool prepare();
+    // 任一端就绪时推进转发
+    RESULT drive();
+
+    // 上游套接字对应的客户端连接，不是上游套接字时返回NULL；只在reactor上调用
+    static http_conn *client_of(int fd);
+
+private:
+    enum STATE
+    {
+        CONNECTING,
+        SEND_REQUEST,
+        READ_HEAD,
+        SEND_HEAD,
+        RELAY_BODY
+    };
+    enum BODY_MODE
+    {
+        BODY_NONE,
+        BODY_LENGTH,
+        BODY_CHUNKED,
+        BODY_UNTIL_CLOSE
+    };
+    // 只观察不修改的分块编码边界跟踪
+    enum CHUNK_STATE
+    {
+        CHUNK_SIZE,
+        CHUNK_EXT,
+        CHUNK_DATA,
+        CHUNK_DATA_END,
+        CHUNK_TRAILER_START,
+        CHUNK_TRAILER_LINE,
+        CHUNK_DONE
+    };
+
+    bool attach_upstream(bool fresh);
+    void detach_upstream(bool reusable);
+    RESULT upstream_failed();
+    void arm_upstream(int ev);
+    void arm_client(int ev);
+    bool parse_head(size_t head_len);
+    ssize_t scan_chunked(const char *data, size_t len);
+    bool body_complete() const;
+    RESULT relay_splice();
+    RESULT relay_copy();
+    RESULT finish();
+
+    http_conn &m_client;
+    upstream_pool &m_pool;
+    int m_backend;
+    int m_fd;
+    bool m_registered;  // 上游套接字已加入epoll
+    bool m_reused;      // 上游连接取自空闲池
+    bool m_retried;
+    bool m_reusable;    // 应答结束后上游连接可以归还连接池
+    bool m_can_splice;  // 客户端套接字可以直接splice写入
+
+    STATE m_state;
+    std::string m_request;
+    size_t m_request_sent;
+
+    char m_head[HEAD_BUFFER_SIZE];
+    size_t m_head_len;
+    std::string m_out;  // 待发给客户端的数据：改写后的应答头或者用户态转发的应答体
+    size_t m_out_sent;
+
+    BODY_MODE m_body_mode;
+    long long m_body_left;
+    CHUNK_STATE m_chunk_state;
+    long long m_chunk_left;
+    size_t m_pipe_bytes; // 已进入管道尚未发出的字节数
+
+    static http_conn *m_clients[MAX_UPSTREAM_FD];
+};
+
+#endif
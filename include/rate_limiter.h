@@ -0,0 +1,62 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <atomic>
+
+/*
+    按客户端IP的连接数上限和令牌桶请求限速。
+    表是固定大小的开放寻址哈希表，按IP哈希的高位分成若干分片，探测只在分片内进行；
+    槽位用CAS占用，令牌桶把上次补充的时间和令牌数压在一个64位原子量里，
+    补充和取令牌是同一次CAS，不需要任何锁。
+    表满时对新IP放行（总连接数仍受MAX_FD限制）；计数为0且长时间没有请求的槽位可以被新IP接管。
+*/
+class rate_limiter
+{
+public:
+    static constexpr int SHARD_BITS = 6;
+    static constexpr int SLOTS_PER_SHARD = 1024;
+    static constexpr int MAX_PROBE = 16;
+    static constexpr uint64_t IDLE_MS = 60000; // 空闲超过这么久的槽位可以被接管
+
+    // max_conns为0表示不限连接数，rate为0表示不限请求速率；burst是桶容量，不超过65535
+    rate_limiter(int max_conns, double rate, double burst);
+    ~rate_limiter();
+    rate_limiter(const rate_limiter &) = delete;
+    rate_limiter &operator=(const rate_limiter &) = delete;
+
+    static constexpr uint64_t IPV6_KEY = 1ULL << 63;
+
+    // 对端地址在表中的键：IPv4地址，IPv6按/64前缀哈希后带上IPV6_KEY标记；
+    // AF_UNIX等本机连接返回0，键为0的连接不受限制
+    static uint64_t key_of(const sockaddr *addr);
+
+    // 接受连接前调用，超过上限返回false；返回true的连接关闭时必须调用close_connection()
+    bool open_connection(uint64_t ip);
+    void close_connection(uint64_t ip);
+    // 开始处理一个请求前调用，桶中没有令牌时返回false
+    bool allow_request(uint64_t ip);
+
+    bool limits_connections() const { return m_max_conns > 0; }
+    bool limits_requests() const { return m_rate_fp > 0; }
+
+private:
+    struct slot
+    {
+        std::atomic<uint64_t> ip;      // key_of()的键，0表示空槽
+        std::atomic<int> conns;
+        std::atomic<uint64_t> bucket;  // 高40位为补充时间（毫秒），低24位为令牌数（1/256个）
+    };
+
+    slot *find(uint64_t ip, bool create);
+    uint64_t now_ms() const;
+
+    slot *m_slots;
+    int m_max_conns;
+    uint64_t m_rate_fp;  // 每秒补充的令牌数（1/256个）
+    uint64_t m_burst_fp; // 桶容量（1/256个）
+    uint64_t m_start_ms;
+};
+
+#endif
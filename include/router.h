@@ -0,0 +1,287 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdexcept>
+
+// 路由匹配时提取的路径参数，值是指向请求url的视图，不拷贝
+struct route_params
+{
+    static constexpr int MAX_PARAMS = 8;
+    int count = 0;
+    std::string_view names[MAX_PARAMS];
+    std::string_view values[MAX_PARAMS];
+
+    std::string_view get(std::string_view name) const
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (names[i] == name)
+            {
+                return values[i];
+            }
+        }
+        return std::string_view();
+    }
+};
+
+/*
+    基数树路由。路径模式支持静态段、":name"（匹配一个路径段）和
+    "*name"（匹配剩余全部路径，只能出现在末尾）；匹配优先级为静态 > 参数 > 通配。
+    启动时用add()建树，之后只读，多个线程可以不加锁地并发match()。
+    H是每个(路径,方法)上挂的处理器，方法用不超过METHOD_NUM的整数表示。
+*/
+template <typename H, int METHOD_NUM>
+class router
+{
+public:
+    enum MATCH_RESULT
+    {
+        MATCH_OK,
+        MATCH_NOT_FOUND,
+        MATCH_BAD_METHOD // 路径存在但不支持该方法
+    };
+
+    router() : m_root(new node) {}
+    ~router() { delete m_root; }
+    router(const router &) = delete;
+    router &operator=(const router &) = delete;
+
+    // 注册路由，模式不合法或重复注册时抛出异常
+    void add(int method, const char *pattern, const H &handler);
+    MATCH_RESULT match(int method, std::string_view path, const H *&handler, route_params &params) const;
+
+private:
+    struct node
+    {
+        std::string prefix;           // 压缩后的静态路径片段
+        std::vector<node *> children; // 静态子节点，首字符互不相同
+        node *param_child = nullptr;  // ":name"子节点
+        node *wildcard_child = nullptr;
+        std::string param_name;       // 本节点为参数或通配节点时的参数名
+        bool has[METHOD_NUM] = {};
+        H handlers[METHOD_NUM] = {};
+
+        ~node()
+        {
+            for (size_t i = 0; i < children.size(); ++i)
+            {
+                delete children[i];
+            }
+            delete param_child;
+            delete wildcard_child;
+        }
+        bool has_any() const
+        {
+            for (int i = 0; i < METHOD_NUM; ++i)
+            {
+                if (has[i])
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    node *insert_static(node *n, std::string_view text);
+    bool match_node(const node *n, std::string_view path, int method, const H *&handler,
+                    route_params &params, bool &path_found) const;
+
+    node *m_root;
+};
+
+// 把静态片段插入n的子树，必要时拆分已有的压缩边，返回片段末尾对应的节点
+template <typename H, int METHOD_NUM>
+typename router<H, METHOD_NUM>::node *router<H, METHOD_NUM>::insert_static(node *n, std::string_view text)
+{
+    while (!text.empty())
+    {
+        node *child = nullptr;
+        for (size_t i = 0; i < n->children.size(); ++i)
+        {
+            if (n->children[i]->prefix[0] == text[0])
+            {
+                child = n->children[i];
+                break;
+            }
+        }
+        if (child == nullptr)
+        {
+            child = new node;
+            child->prefix.assign(text.data(), text.size());
+            n->children.push_back(child);
+            return child;
+        }
+        size_t common = 0;
+        while (common < child->prefix.size() && common < text.size() && child->prefix[common] == text[common])
+        {
+            ++common;
+        }
+        if (common < child->prefix.size())
+        {
+            // 拆分：child保留公共前缀，原有内容下移到新节点
+            node *rest = new node;
+            rest->prefix = child->prefix.substr(common);
+            rest->children.swap(child->children);
+            rest->param_child = child->param_child;
+            rest->wildcard_child = child->wildcard_child;
+            for (int i = 0; i < METHOD_NUM; ++i)
+            {
+                rest->has[i] = child->has[i];
+                rest->handlers[i] = child->handlers[i];
+                child->has[i] = false;
+                child->handlers[i] = H();
+            }
+            child->prefix.resize(common);
+            child->param_child = nullptr;
+            child->wildcard_child = nullptr;
+            child->children.push_back(rest);
+        }
+        n = child;
+        text.remove_prefix(common);
+    }
+    return n;
+}
+
+template <typename H, int METHOD_NUM>
+void router<H, METHOD_NUM>::add(int method, const char *pattern, const H &handler)
+{
+    if (method < 0 || method >= METHOD_NUM || pattern == nullptr || pattern[0] != '/')
+    {
+        throw std::runtime_error("router::add() error: bad method or pattern.");
+    }
+    std::string_view rest(pattern);
+    node *n = m_root;
+    int param_num = 0;
+    while (!rest.empty())
+    {
+        size_t special = rest.find_first_of(":*");
+        if (special != 0)
+        {
+            std::string_view text = rest.substr(0, special);
+            n = insert_static(n, text);
+            rest.remove_prefix(text.size());
+            continue;
+        }
+        if (++param_num > route_params::MAX_PARAMS)
+        {
+            throw std::runtime_error("router::add() error: too many parameters.");
+        }
+        bool wildcard = rest[0] == '*';
+        size_t end = rest.find('/');
+        if (end == std::string_view::npos)
+        {
+            end = rest.size();
+        }
+        std::string name(rest.substr(1, end - 1));
+        if (name.empty() || (wildcard && end != rest.size()))
+        {
+            throw std::runtime_error("router::add() error: bad parameter in pattern.");
+        }
+        node *&slot = wildcard ? n->wildcard_child : n->param_child;
+        if (slot == nullptr)
+        {
+            slot = new node;
+            slot->param_name = name;
+        }
+        else if (slot->param_name != name)
+        {
+            throw std::runtime_error("router::add() error: conflicting parameter names.");
+        }
+        n = slot;
+        rest.remove_prefix(end);
+    }
+    if (n->has[method])
+    {
+        throw std::runtime_error("router::add() error: duplicate route.");
+    }
+    n->has[method] = true;
+    n->handlers[method] = handler;
+}
+
+template <typename H, int METHOD_NUM>
+bool router<H, METHOD_NUM>::match_node(const node *n, std::string_view path, int method, const H *&handler,
+                                       route_params &params, bool &path_found) const
+{
+    if (path.empty())
+    {
+        if (n->has[method])
+        {
+            handler = &n->handlers[method];
+            return true;
+        }
+        path_found = path_found || n->has_any();
+        // 末尾的通配参数可以匹配空串
+        if (n->wildcard_child == nullptr)
+        {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < n->children.size() && !path.empty(); ++i)
+    {
+        const node *child = n->children[i];
+        if (child->prefix[0] != path[0])
+        {
+            continue;
+        }
+        if (path.compare(0, child->prefix.size(), child->prefix) == 0 &&
+            match_node(child, path.substr(child->prefix.size()), method, handler, params, path_found))
+        {
+            return true;
+        }
+        break;
+    }
+    if (n->param_child != nullptr && !path.empty() && path[0] != '/')
+    {
+        size_t end = path.find('/');
+        if (end == std::string_view::npos)
+        {
+            end = path.size();
+        }
+        int saved = params.count;
+        params.names[params.count] = n->param_child->param_name;
+        params.values[params.count++] = path.substr(0, end);
+        if (match_node(n->param_child, path.substr(end), method, handler, params, path_found))
+        {
+            return true;
+        }
+        params.count = saved;
+    }
+    if (n->wildcard_child != nullptr)
+    {
+        const node *w = n->wildcard_child;
+        if (w->has[method])
+        {
+            params.names[params.count] = w->param_name;
+            params.values[params.count++] = path;
+            handler = &w->handlers[method];
+            return true;
+        }
+        path_found = path_found || w->has_any();
+    }
+    return false;
+}
+
+template <typename H, int METHOD_NUM>
+typename router<H, METHOD_NUM>::MATCH_RESULT router<H, METHOD_NUM>::match(int method, std::string_view path, const H *&handler,
+                                                                           route_params &params) const
+{
+    params.count = 0;
+    handler = nullptr;
+    if (method < 0 || method >= METHOD_NUM)
+    {
+        return MATCH_NOT_FOUND;
+    }
+    bool path_found = false;
+    if (match_node(m_root, path, method, handler, params, path_found))
+    {
+        return MATCH_OK;
+    }
+    params.count = 0;
+    return path_found ? MATCH_BAD_METHOD : MATCH_NOT_FOUND;
+}
+
+#endif
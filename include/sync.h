@@ -4,6 +4,8 @@
 #include<stdexcept>
 #include<pthread.h>
 #include<semaphore.h>
+#include<errno.h>
+#include<time.h>
 
 /*信号量*/
 class sem
@@ -93,6 +95,12 @@ public:
     {
         return pthread_cond_wait(&m_cond,&m_mutex)==0;
     }
+    //等到abstime（CLOCK_REALTIME）为止，超时也返回true
+    bool timewait(const struct timespec &abstime)
+    {
+        int ret=pthread_cond_timedwait(&m_cond,&m_mutex,&abstime);
+        return ret==0||ret==ETIMEDOUT;
+    }
     bool signal()
     {
         return pthread_cond_signal(&m_cond)==0;
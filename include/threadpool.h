@@ -2,41 +2,110 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
-#include <queue>
+#include <stdint.h>
+#include <time.h>
+#include <cmath>
+#include <deque>
 #include <stdexcept>
+#include <vector>
 #include "sync.h"
+#include "cpu_affinity.h"
 
+// 任务优先级，高优先级的队列非空时先出队
+enum TASK_PRIORITY
+{
+    PRIORITY_HIGH,   // 健康检查、热的小文件等很快就能完成的请求
+    PRIORITY_NORMAL,
+    PRIORITY_LOW,    // 冷文件等可能阻塞在磁盘上的请求
+    PRIORITY_NUM
+};
+
+/*
+    T需要提供：
+    uint32_t generation() const; 槽位代数，和入队时不同说明任务已经失效
+    void process();              处理任务
+    bool can_shed() const;       任务是否可以被放弃
+    void shed();                 放弃任务（比如回503），只在can_shed()为true时调用
+    出队时按CoDel控制排队时延：排队时延持续超过target一个interval后进入丢弃状态，
+    丢弃间隔按interval/sqrt(丢弃次数)缩短，直到时延回落到target以下；
+    排队超过deadline的任务总是丢弃。高优先级任务只受deadline约束。
+*/
 template <typename T>
 class threadpool
 {
 public:
-    threadpool(int thread_num = 8, int max_requests = 10000);
+    static constexpr int DEFAULT_TARGET_MS = 10;
+    static constexpr int DEFAULT_INTERVAL_MS = 100;
+    static constexpr int DEFAULT_DEADLINE_MS = 1000;
+
+    // thread_num为0时按可用CPU数创建线程，max_requests为0时按线程数确定队列长度；
+    // cpus非空时第i个线程绑定到cpus[i % cpus.size()]
+    threadpool(int thread_num = 0, int max_requests = 0, const std::vector<int> &cpus = std::vector<int>());
+    // 等正在处理的任务结束后回收全部线程，队列中剩下的任务不再处理
     ~threadpool();
-    bool push(T *request);
+    // 队列满时返回false，任务没有入队
+    bool push(T *request, int priority = PRIORITY_NORMAL);
+    // 设置排队时延的控制参数，target_ms为0时不做CoDel丢弃，deadline_ms为0时不限制排队时间
+    void set_queue_delay(int target_ms, int interval_ms, int deadline_ms);
+    int thread_num() const { return m_thread_num; }
 
 private:
+    static constexpr int DEFAULT_REQUESTS_PER_THREAD = 1250;
+
+    struct task
+    {
+        T *request;
+        uint32_t generation; // 入队时的槽位代数
+        int64_t enqueued;    // 入队时间，纳秒
+    };
+
     // 静态函数，线程入口
     static void *worker(void *arg);
     void run();
+    void join_threads(int count);
+    static int64_t now_ns();
+    // 持有队列锁时调用，决定刚出队的任务是否丢弃
+    bool should_drop(const task &t, int priority, int64_t now);
+    int64_t control_law(int64_t t) const { return t + (int64_t)(m_interval / std::sqrt((double)m_drop_count)); }
 
 private:
     int m_thread_num;            // 线程数
     int m_max_requests;          // 最大请求
     pthread_t *m_threads;        // 线程数组
-    std::queue<T *> m_workqueue; // 工作队列
+    std::deque<task> m_workqueue[PRIORITY_NUM]; // 每个优先级一个工作队列
+    size_t m_queued;             // 各队列中的任务总数
     locker m_queuelocker;        // 队列互斥量
     sem m_queuestat;             // 队列信号量
-    bool m_stop;                 // 线程池停止工作
+    bool m_stop;                 // 线程池停止工作，受队列锁保护
+
+    // CoDel状态，受队列锁保护
+    int64_t m_target;
+    int64_t m_interval;
+    int64_t m_deadline;
+    int64_t m_first_above;       // 时延超过target后，持续到这个时刻才进入丢弃状态；0表示时延正常
+    int64_t m_drop_next;         // 丢弃状态下下一次丢弃的时刻
+    uint32_t m_drop_count;
+    bool m_dropping;
 };
 
 // 线程池构造函数
 template <typename T>
-threadpool<T>::threadpool(int thread_num, int max_requests) : m_thread_num(thread_num), m_max_requests(max_requests), m_threads(NULL), m_stop(false)
+threadpool<T>::threadpool(int thread_num, int max_requests, const std::vector<int> &cpus) : m_thread_num(thread_num), m_max_requests(max_requests), m_threads(NULL), m_queued(0), m_stop(false),
+    m_target(0), m_interval(0), m_deadline(0), m_first_above(0), m_drop_next(0), m_drop_count(0), m_dropping(false)
 {
-    if (thread_num <= 0 || max_requests <= 0)
+    if (thread_num < 0 || max_requests < 0)
+    {
+        throw std::runtime_error("the constructor threadpool() error: thread_num<0||max_requests<0.");
+    }
+    if (thread_num == 0)
+    {
+        thread_num = m_thread_num = cpus.empty() ? (int)online_cpus().size() : (int)cpus.size();
+    }
+    if (max_requests == 0)
     {
-        throw std::runtime_error("the constructor threadpool() error: thread_num<=0||max_requests<=0.");
+        m_max_requests = thread_num * DEFAULT_REQUESTS_PER_THREAD;
     }
+    set_queue_delay(DEFAULT_TARGET_MS, DEFAULT_INTERVAL_MS, DEFAULT_DEADLINE_MS);
     if ((m_threads = new pthread_t[thread_num]) == NULL)
     {
         throw std::runtime_error("the constructor threadpool() error: (m_threads=new pthread_t[thread_num])==NULL.");
@@ -45,23 +114,26 @@ threadpool<T>::threadpool(int thread_num, int max_requests) : m_thread_num(threa
     pthread_attr_t attr;
     if (pthread_attr_init(&attr) != 0)
     {
+        delete[] m_threads;
         throw std::runtime_error("the constructor threadpool() error: pthread_attr_init(&attr)!=0.");
     }
-    // 设置线程分离属性
-    if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0)
-    {
-        throw std::runtime_error("the constructor threadpool() error: pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED)!=0.");
-    }
 
     for (int i = 0; i < thread_num; ++i)
     {
 #ifdef DEBUG
         printf("create the %dth thread\n", i);
 #endif
+        if (!cpus.empty() && !set_attr_affinity(&attr, std::vector<int>(1, cpus[i % cpus.size()])))
+        {
+            pthread_attr_destroy(&attr);
+            join_threads(i);
+            throw std::runtime_error("the constructor threadpool() error: set_attr_affinity(&attr, cpus) failed.");
+        }
         // 创建线程
         if (pthread_create(m_threads + i, &attr, worker, (void *)this) != 0)
         {
-            delete[] m_threads;
+            pthread_attr_destroy(&attr);
+            join_threads(i);
             throw std::runtime_error("the constructor threadpool() error: pthread_create(m_threads + i, &attr, worker, (void *)this) != 0.");
         }
     }
@@ -70,8 +142,25 @@ threadpool<T>::threadpool(int thread_num, int max_requests) : m_thread_num(threa
 template <typename T>
 threadpool<T>::~threadpool()
 {
-    m_stop=true;
+    join_threads(m_thread_num);
+}
+//让前count个线程退出并回收
+template <typename T>
+void threadpool<T>::join_threads(int count)
+{
+    m_queuelocker.lock();
+    m_stop = true;
+    m_queuelocker.unlock();
+    for (int i = 0; i < count; ++i)
+    {
+        m_queuestat.post();
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        pthread_join(m_threads[i], NULL);
+    }
     delete[] m_threads;
+    m_threads = NULL;
 }
 template <typename T>
 void *threadpool<T>::worker(void *arg)
@@ -84,41 +173,137 @@ void *threadpool<T>::worker(void *arg)
 template <typename T>
 void threadpool<T>::run()
 {
-    while (!m_stop)
+    while (true)
     {
         while (m_queuestat.wait() == false)
             ;
         while (m_queuelocker.lock() == false)
             ;
-        if (m_workqueue.empty())
+        if (m_stop)
+        {
+            m_queuelocker.unlock();
+            break;
+        }
+        int priority = 0;
+        while (priority < PRIORITY_NUM && m_workqueue[priority].empty())
+        {
+            ++priority;
+        }
+        if (priority == PRIORITY_NUM)
         {
             m_queuelocker.unlock();
             continue;
             //throw std::runtime_error("run() error: m_workqueue.empty().");
         }
 
-        T *request = m_workqueue.front();
-        m_workqueue.pop();
+        task t = m_workqueue[priority].front();
+        m_workqueue[priority].pop_front();
+        --m_queued;
+        bool drop = should_drop(t, priority, now_ns());
         m_queuelocker.unlock();
-        if (request == NULL)
+        //排队期间连接已被关闭，槽位可能已属于复用同一fd的新连接
+        if (t.request == NULL || t.request->generation() != t.generation)
+        {
+            continue;
+        }
+        //客户端多半已经放弃等待，不再花时间处理；不能放弃的任务照常处理
+        if (drop && t.request->can_shed())
         {
+            t.request->shed();
             continue;
         }
-        request->process();
+        t.request->process();
     }
 }
+
+template <typename T>
+int64_t threadpool<T>::now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+template <typename T>
+void threadpool<T>::set_queue_delay(int target_ms, int interval_ms, int deadline_ms)
+{
+    while (m_queuelocker.lock() == false)
+        ;
+    m_target = (int64_t)target_ms * 1000000;
+    m_interval = (int64_t)(interval_ms > 0 ? interval_ms : DEFAULT_INTERVAL_MS) * 1000000;
+    m_deadline = (int64_t)deadline_ms * 1000000;
+    m_first_above = 0;
+    m_dropping = false;
+    m_drop_count = 0;
+    m_queuelocker.unlock();
+}
+
+template <typename T>
+bool threadpool<T>::should_drop(const task &t, int priority, int64_t now)
+{
+    int64_t sojourn = now - t.enqueued;
+    if (m_deadline > 0 && sojourn >= m_deadline)
+    {
+        return true;
+    }
+    if (m_target == 0 || priority == PRIORITY_HIGH)
+    {
+        return false;
+    }
+    //时延低于target或者队列已经排空，说明没有持续的拥塞
+    if (sojourn < m_target || m_queued == 0)
+    {
+        m_first_above = 0;
+        m_dropping = false;
+        return false;
+    }
+    if (m_first_above == 0)
+    {
+        m_first_above = now + m_interval;
+        return false;
+    }
+    if (!m_dropping)
+    {
+        if (now < m_first_above)
+        {
+            return false;
+        }
+        m_dropping = true;
+        //刚退出丢弃状态不久又拥塞时，从接近上次的丢弃频率开始
+        m_drop_count = m_drop_count > 2 && now - m_drop_next < 16 * m_interval ? m_drop_count - 2 : 1;
+        m_drop_next = control_law(now);
+        return true;
+    }
+    if (now < m_drop_next)
+    {
+        return false;
+    }
+    ++m_drop_count;
+    m_drop_next = control_law(m_drop_next);
+    return true;
+}
+
 // 向队列加任务
 template <typename T>
-bool threadpool<T>::push(T *request)
+bool threadpool<T>::push(T *request, int priority)
 {
+    if (priority < 0 || priority >= PRIORITY_NUM)
+    {
+        priority = PRIORITY_NORMAL;
+    }
+    task t;
+    t.request = request;
+    t.generation = request->generation();
+    t.enqueued = now_ns();
     while (m_queuelocker.lock() == false)
         ;
-    if (m_workqueue.size() >= m_max_requests)
+    if (m_queued >= (size_t)m_max_requests)
     {
         m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push(request);
+    m_workqueue[priority].push_back(t);
+    ++m_queued;
     m_queuelocker.unlock();
     m_queuestat.post();
     return true;
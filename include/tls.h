@@ -0,0 +1,73 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <cstddef>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+/*
+    监听套接字上的TLS。握手由OpenSSL在用户态完成，之后会话密钥交给内核TLS
+    （TCP_ULP "tls"），发送方向卸载成功时应答头和文件直接用send/writev/sendfile
+    写到套接字上，文件数据不经过用户态；内核不支持时退回SSL_write，先读文件再加密。
+    OpenSSL 1.1.1没有内核TLS的接口，总是使用用户态路径。
+    编译时没有OpenSSL（未定义HAVE_OPENSSL）则init_context()总是失败。
+*/
+class tls_conn
+{
+public:
+    enum HANDSHAKE_RESULT
+    {
+        HANDSHAKE_DONE,
+        HANDSHAKE_WANT_READ,
+        HANDSHAKE_WANT_WRITE,
+        HANDSHAKE_ERROR
+    };
+
+    // 加载证书和私钥，启动时调用一次，之后所有连接共享；ktls为false时不卸载到内核
+    static bool init_context(const char *cert_file, const char *key_file, bool ktls = true);
+    static bool enabled() { return m_ctx != NULL; }
+
+    tls_conn() : m_ssl(NULL), m_sockfd(-1), m_ktls_send(false), m_ktls_recv(false), m_established(false) {}
+    ~tls_conn();
+
+    bool start(int sockfd);
+    HANDSHAKE_RESULT handshake();
+    bool established() const { return m_established; }
+    bool ktls_send() const { return m_ktls_send; }
+    bool ktls_recv() const { return m_ktls_recv; }
+    bool pending() const; // TLS库中还有已解密未读出的数据，内核不会再为它们触发EPOLLIN
+    void shutdown();
+
+    /*
+        与同名系统调用的返回值一致：出错返回-1并设置errno，
+        套接字暂时不可读写时errno为EAGAIN，对端关闭时recv返回0。
+        sendfile的offset为NULL时使用并推进文件自身的偏移。
+    */
+    ssize_t recv(void *buf, size_t len);
+    ssize_t send(const void *buf, size_t len);
+    ssize_t writev(const struct iovec *iov, int cnt);
+    ssize_t sendfile(int file_fd, off_t *offset, size_t len);
+
+private:
+    static constexpr int COPY_BUFFER_SIZE = 16384; // 没有内核TLS时每次加密的最大字节数
+
+    ssize_t ssl_result(int ret);
+
+    static ssl_ctx_st *m_ctx;
+    ssl_st *m_ssl;
+    int m_sockfd;
+    bool m_ktls_send;
+    bool m_ktls_recv;
+    bool m_established;
+};
+
+// 套接字读写，tls为NULL时就是明文的系统调用；flags只对明文send有效（如MSG_MORE）
+ssize_t sock_recv(int sockfd, tls_conn *tls, void *buf, size_t len);
+ssize_t sock_send(int sockfd, tls_conn *tls, const void *buf, size_t len, int flags = 0);
+ssize_t sock_writev(int sockfd, tls_conn *tls, const struct iovec *iov, int cnt);
+ssize_t sock_sendfile(int sockfd, tls_conn *tls, int file_fd, off_t *offset, size_t len);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <ctime>
+#include <atomic>
+#include <vector>
+#include "sync.h"
+
+/*
+    反向代理的上游后端组。每个后端维护一组保持连接的空闲套接字，
+    请求按未完成请求数最少的原则分到健康的后端上。
+    健康检查线程定期对每个后端做TCP连接探测；转发中连接失败也会立即把后端标记为不可用，
+    之后由检查线程恢复。
+*/
+class upstream_pool
+{
+public:
+    static constexpr int MAX_BACKENDS = 16;
+    static constexpr int MAX_IDLE = 32;                 // 每个后端最多保留的空闲连接数
+    static constexpr int IDLE_TIMEOUT = 30;             // 空闲连接的最长保留秒数
+    static constexpr int CHECK_INTERVAL = 2;            // 健康检查间隔（秒）
+    static constexpr int CHECK_CONNECT_TIMEOUT = 500;   // 健康检查的连接超时（毫秒）
+
+    upstream_pool();
+    ~upstream_pool();
+    upstream_pool(const upstream_pool &) = delete;
+    upstream_pool &operator=(const upstream_pool &) = delete;
+
+    // 解析逗号分隔的"host:port"列表，格式错误或无法解析返回false
+    bool add_backends(const char *list);
+    int size() const { return m_count; }
+    // 启动健康检查线程，失败时抛出异常；析构时停止并回收这个线程
+    void start_health_checks();
+
+    /*
+        选择后端并取出一个连接，返回非阻塞套接字，-1表示没有可用的后端。
+        fresh为true时不复用空闲连接。connecting为true表示非阻塞connect尚未完成，
+        应等待可写后检查SO_ERROR。取出的连接必须用release()归还。
+    */
+    int acquire(int &backend, bool &reused, bool &connecting, bool fresh = false);
+    // 归还连接，reusable为false时关闭它
+    void release(int backend, int fd, bool reusable);
+    // 连接后端失败，在下次健康检查成功前不再向它分配请求
+    void mark_down(int backend);
+
+private:
+    struct idle_conn
+    {
+        int fd;
+        time_t since;
+    };
+    struct backend
+    {
+        sockaddr_in addr;
+        std::atomic<int> outstanding; // 已取出但尚未归还的连接数
+        std::atomic<bool> healthy;
+        std::vector<idle_conn> idle;  // 由m_lock保护，末尾是最近归还的
+    };
+
+    int pick_backend();
+    int take_idle(int backend);
+    int connect_backend(int backend, bool &connecting);
+    void drop_idle(int backend);
+    bool probe(int backend);
+    static void *checker(void *arg);
+
+    backend m_backends[MAX_BACKENDS];
+    int m_count;
+    std::atomic<unsigned> m_rotate; // 未完成请求数相同时轮转起点，避免总是选中第一个
+    locker m_lock;
+    std::atomic<bool> m_stop;
+    cond m_wakeup;      // 析构时唤醒在检查间隔中等待的检查线程
+    pthread_t m_checker;
+    bool m_checking;    // 检查线程已启动
+};
+
+#endif
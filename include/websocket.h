@@ -0,0 +1,152 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <ctime>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "sync.h"
+
+class http_conn;
+class tls_conn;
+class ws_hub;
+
+/*
+    编码好的一个服务器帧。发布到主题时只编码一次，
+    所有订阅者的发送队列引用同一块内存，引用计数归零时释放。
+*/
+class ws_frame
+{
+public:
+    enum OPCODE
+    {
+        CONTINUATION = 0x0,
+        TEXT = 0x1,
+        BINARY = 0x2,
+        CLOSE = 0x8,
+        PING = 0x9,
+        PONG = 0xA
+    };
+
+    static ws_frame *encode(int opcode, const void *payload, size_t len);
+    void ref() { m_refs.fetch_add(1, std::memory_order_relaxed); }
+    void unref();
+    const char *data() const { return reinterpret_cast<const char *>(this + 1); }
+    size_t size() const { return m_size; }
+
+private:
+    explicit ws_frame(size_t size) : m_refs(1), m_size(size) {}
+
+    std::atomic<int> m_refs;
+    size_t m_size;
+};
+
+/*
+    升级后的WebSocket连接。WebSocket连接只由reactor驱动，从不交给线程池，
+    因此会话、发送队列和主题表都不需要加锁。
+    客户端只订阅主题，收到的文本和二进制消息只检查格式后丢弃；
+    发布只能经过服务器端的ws_hub::publish()（POST /prefix/topic）。
+*/
+class ws_session
+{
+public:
+    static constexpr size_t READ_CHUNK = 4096;
+    static constexpr size_t MAX_MESSAGE = 65536;        // 单条消息（含分片）的最大长度
+    static constexpr size_t MAX_QUEUE_BYTES = 1 << 20;  // 发送队列上限，慢订阅者超过后被断开
+    static constexpr int IOV_BATCH = 64;
+
+    // initial是握手请求之后已经读入的数据
+    ws_session(http_conn &conn, int sockfd, tls_conn *tls, ws_hub &hub, const std::string &topic,
+               const char *initial, size_t initial_len);
+    ~ws_session();
+
+    // 读出并处理全部已到达的帧，返回false表示应关闭连接
+    bool read();
+    // 尽量发出发送队列并按需注册EPOLLOUT，返回false表示应关闭连接
+    bool write();
+    // 把帧加入发送队列（增加引用），超过队列上限返回false
+    bool enqueue(ws_frame *frame);
+
+    http_conn &conn() { return m_conn; }
+    const std::string &topic() const { return m_topic; }
+    time_t last_seen() const { return m_last_seen; }
+    void kill() { m_dead = true; }
+
+    // 握手应答中的Sec-WebSocket-Accept
+    static std::string accept_key(const char *client_key);
+
+private:
+    friend class ws_hub;
+
+    void process_input();
+    bool handle_frame(int opcode, bool fin, char *payload, size_t len);
+    bool send_control(int opcode, const char *payload, size_t len);
+
+    http_conn &m_conn;
+    int m_sockfd;
+    tls_conn *m_tls;
+    ws_hub &m_hub;
+    std::string m_topic;
+    size_t m_topic_slot;   // 在主题订阅者数组中的下标
+    size_t m_session_slot; // 在全部会话数组中的下标
+
+    std::string m_in;      // 未处理完的输入
+    size_t m_message_len;  // 正在接收的分片消息已收到的长度
+    int m_message_opcode;
+
+    std::deque<ws_frame *> m_queue;
+    size_t m_head_off;     // 队首帧已发出的字节数
+    size_t m_queued_bytes;
+    time_t m_last_seen;
+    bool m_closing;        // 已发出关闭帧，队列发完后关闭连接
+    bool m_dead;           // 发送队列溢出或者写失败，等待关闭
+};
+
+/*
+    主题表和跨线程发布的入口。工作线程调用publish()只把编码好的帧放进收件箱并写eventfd，
+    由reactor分发给订阅者：每个订阅者一次writev，帧不按订阅者复制。
+    定时器周期性地向所有连接发送ping，长时间没有任何数据的连接被关闭。
+*/
+class ws_hub
+{
+public:
+    static constexpr int PING_INTERVAL = 30; // 秒
+
+    ws_hub();  // 创建eventfd和timerfd，失败时抛出异常
+    ~ws_hub();
+    ws_hub(const ws_hub &) = delete;
+    ws_hub &operator=(const ws_hub &) = delete;
+
+    // 把eventfd和timerfd注册到reactor
+    void register_events(int epollfd);
+    bool owns(int fd) const { return fd == m_event_fd || fd == m_timer_fd; }
+    // reactor上处理eventfd或者timerfd的事件
+    void handle(int fd);
+
+    // 任意线程：向主题发布一条消息
+    void publish(const std::string &topic, const char *data, size_t len, bool binary = false);
+
+    // 以下只在reactor上调用
+    void attach(ws_session *session);
+    void detach(ws_session *session);
+    // 把帧交给主题的全部订阅者
+    void deliver(const std::string &topic, ws_frame *frame);
+
+private:
+    void drain();
+    void keepalive();
+    void close_dead(std::vector<ws_session *> &dead);
+
+    int m_event_fd;
+    int m_timer_fd;
+    locker m_lock; // 保护收件箱
+    std::vector<std::pair<std::string, ws_frame *> > m_inbox;
+    std::unordered_map<std::string, std::vector<ws_session *> > m_topics;
+    std::vector<ws_session *> m_sessions;
+};
+
+#endif
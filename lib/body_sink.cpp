@@ -0,0 +1,64 @@
+#include "body_sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+
+bool file_sink::open(const char *path)
+{
+    abort();
+    if (snprintf(m_path, PATH_LEN, "%s", path) >= PATH_LEN ||
+        snprintf(m_tmp_path, PATH_LEN, "%s.part", path) >= PATH_LEN)
+    {
+        return false;
+    }
+    m_fd = ::open(m_tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return m_fd >= 0;
+}
+
+bool file_sink::write(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = ::write(m_fd, data, len);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+bool file_sink::finish()
+{
+    if (m_fd < 0)
+    {
+        return false;
+    }
+    close(m_fd);
+    m_fd = -1;
+    if (rename(m_tmp_path, m_path) != 0)
+    {
+        unlink(m_tmp_path);
+        return false;
+    }
+    return true;
+}
+
+void file_sink::abort()
+{
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+        unlink(m_tmp_path);
+    }
+}
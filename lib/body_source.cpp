@@ -0,0 +1,118 @@
+#include "body_source.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+
+dir_listing_source::~dir_listing_source()
+{
+    if (m_dir != NULL)
+    {
+        closedir(m_dir);
+    }
+}
+
+bool dir_listing_source::open(const char *path, const char *url)
+{
+    if (snprintf(m_url, URL_LEN, "%s", url) >= URL_LEN)
+    {
+        return false;
+    }
+    m_dir = opendir(path);
+    return m_dir != NULL;
+}
+
+bool dir_listing_source::append(const char *format, ...)
+{
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(m_buf + m_used, BUFFER_SIZE - m_used, format, arg_list);
+    va_end(arg_list);
+    if (len < 0 || len >= BUFFER_SIZE - m_used)
+    {
+        return false;
+    }
+    m_used += len;
+    return true;
+}
+
+//HTML转义，in_url为true时额外对url中有特殊含义的字符做百分号编码
+void dir_listing_source::append_escaped(const char *text, bool in_url)
+{
+    for (; *text && m_used < BUFFER_SIZE - 8; ++text)
+    {
+        unsigned char c = *text;
+        if (c == '<')
+            append("&lt;");
+        else if (c == '>')
+            append("&gt;");
+        else if (c == '&')
+            append("&amp;");
+        else if (c == '"')
+            append("&quot;");
+        else if (in_url && (c == '%' || c == '?' || c == '#' || c <= ' ' || c >= 0x7f))
+            append("%%%02X", c);
+        else
+            m_buf[m_used++] = c;
+    }
+}
+
+int dir_listing_source::produce(struct iovec *iov, int max, bool &eof)
+{
+    eof = false;
+    if (max <= 0)
+    {
+        return 0;
+    }
+    int start = m_used;
+    bool slash = m_url[0] != '\0' && m_url[strlen(m_url) - 1] == '/';
+    while (m_state != DONE && BUFFER_SIZE - m_used >= ENTRY_MAX)
+    {
+        if (m_state == HEAD)
+        {
+            append("<html><head><title>Index of ");
+            append_escaped(m_url, false);
+            append("</title></head><body><h1>Index of ");
+            append_escaped(m_url, false);
+            append("</h1><ul>\n");
+            m_state = ENTRIES;
+        }
+        else if (m_state == ENTRIES)
+        {
+            struct dirent *ent = readdir(m_dir);
+            if (ent == NULL)
+            {
+                m_state = TAIL;
+                continue;
+            }
+            if (strcmp(ent->d_name, ".") == 0)
+            {
+                continue;
+            }
+            bool is_dir = ent->d_type == DT_DIR;
+            append("<li><a href=\"");
+            append_escaped(m_url, true);
+            if (!slash)
+            {
+                append("/");
+            }
+            append_escaped(ent->d_name, true);
+            append(is_dir ? "/\">" : "\">");
+            append_escaped(ent->d_name, false);
+            append(is_dir ? "/</a></li>\n" : "</a></li>\n");
+        }
+        else
+        {
+            append("</ul></body></html>\n");
+            m_state = DONE;
+        }
+    }
+    eof = (m_state == DONE);
+    if (m_used == start)
+    {
+        return 0;
+    }
+    iov[0].iov_base = m_buf + start;
+    iov[0].iov_len = m_used - start;
+    return 1;
+}
@@ -0,0 +1,152 @@
+#include "capture.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <cstring>
+#include <stdexcept>
+
+traffic_capture::traffic_capture(const char *path) : m_fd(-1), m_last_us(0), m_stop(false), m_next_conn(1), m_start_us(0)
+{
+    m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+    {
+        throw std::runtime_error("traffic_capture::traffic_capture() error: cannot create capture file.");
+    }
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    capture_header header;
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.start_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    m_start_us = now_us();
+    if (::write(m_fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+    {
+        close(m_fd);
+        throw std::runtime_error("traffic_capture::traffic_capture() error: cannot write capture header.");
+    }
+    if (pthread_create(&m_thread, NULL, worker, this) != 0)
+    {
+        close(m_fd);
+        throw std::runtime_error("traffic_capture::traffic_capture() error: pthread_create failed.");
+    }
+}
+
+traffic_capture::~traffic_capture()
+{
+    stop();
+}
+
+void traffic_capture::stop()
+{
+    m_cond.lock();
+    bool stopped = m_stop;
+    m_stop = true;
+    m_cond.signal();
+    m_cond.unlock();
+    if (!stopped)
+    {
+        pthread_join(m_thread, NULL);
+        close(m_fd);
+    }
+}
+
+uint64_t traffic_capture::now_us() const
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - m_start_us;
+}
+
+uint64_t traffic_capture::open_connection()
+{
+    uint64_t conn = m_next_conn.fetch_add(1, std::memory_order_relaxed);
+    append(CAP_OPEN, conn, NULL, 0);
+    return conn;
+}
+
+void traffic_capture::data(uint64_t conn, const char *buf, size_t len)
+{
+    append(CAP_DATA, conn, buf, len);
+}
+
+void traffic_capture::close_connection(uint64_t conn)
+{
+    append(CAP_CLOSE, conn, NULL, 0);
+}
+
+//时间在锁内读取，文件中的时间差不会为负
+void traffic_capture::append(int type, uint64_t conn, const char *buf, size_t len)
+{
+    m_cond.lock();
+    if (m_stop)
+    {
+        m_cond.unlock();
+        return;
+    }
+    if (type == CAP_DATA && m_buf.size() + len > MAX_BUFFER)
+    {
+        type = CAP_LOST;
+    }
+    uint64_t now = now_us();
+    if (now < m_last_us)
+    {
+        now = m_last_us;
+    }
+    m_buf += (char)type;
+    capture_put_varint(m_buf, conn);
+    capture_put_varint(m_buf, now - m_last_us);
+    m_last_us = now;
+    if (type == CAP_DATA)
+    {
+        capture_put_varint(m_buf, len);
+        m_buf.append(buf, len);
+    }
+    if (m_buf.size() >= FLUSH_BYTES)
+    {
+        m_cond.signal();
+    }
+    m_cond.unlock();
+}
+
+void *traffic_capture::worker(void *arg)
+{
+    static_cast<traffic_capture *>(arg)->run();
+    return NULL;
+}
+
+void traffic_capture::run()
+{
+    std::string out;
+    bool stop = false;
+    while (!stop)
+    {
+        m_cond.lock();
+        if (!m_stop && m_buf.size() < FLUSH_BYTES)
+        {
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            m_cond.timewait(deadline);
+        }
+        out.swap(m_buf);
+        stop = m_stop;
+        m_cond.unlock();
+
+        size_t off = 0;
+        while (off < out.size())
+        {
+            ssize_t n = ::write(m_fd, out.data() + off, out.size() - off);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+            off += n;
+        }
+        out.clear();
+    }
+}
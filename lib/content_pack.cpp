@@ -0,0 +1,125 @@
+#include "content_pack.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstring>
+
+content_pack::~content_pack()
+{
+    if (m_base != NULL)
+    {
+        munmap(m_base, m_size);
+    }
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+    }
+}
+
+bool content_pack::open(const char *path, bool lock)
+{
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(pack_header))
+    {
+        close(fd);
+        return false;
+    }
+    //MAP_POPULATE在映射时就读入全部页面，部署后的第一批请求不再缺页
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | (lock ? MAP_POPULATE : 0), fd, 0);
+    if (base == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+    m_fd = fd;
+    m_base = (char *)base;
+    m_size = st.st_size;
+    m_header = (const pack_header *)m_base;
+    if (!validate())
+    {
+        munmap(m_base, m_size);
+        close(m_fd);
+        m_fd = -1;
+        m_base = NULL;
+        m_header = NULL;
+        return false;
+    }
+    m_entries = (const pack_entry *)(m_base + m_header->entries_off);
+    m_seeds = (const uint32_t *)(m_base + m_header->seeds_off);
+    if (lock && mlock(m_base, m_size) < 0)
+    {
+        //锁定失败（通常是RLIMIT_MEMLOCK不够）不影响正确性，页面仍可能被换出
+        fprintf(stderr, "mlock %s failed: %s\n", path, strerror(errno));
+    }
+    else
+    {
+        m_locked = lock;
+    }
+    return true;
+}
+
+static bool in_range(uint64_t off, uint64_t len, size_t size)
+{
+    return off <= size && len <= size - off;
+}
+
+bool content_pack::validate() const
+{
+    const pack_header &h = *m_header;
+    if (memcmp(h.magic, PACK_MAGIC, sizeof(h.magic)) != 0 || h.version != PACK_VERSION || h.file_size != m_size)
+    {
+        return false;
+    }
+    if ((h.entry_count == 0) != (h.bucket_count == 0) ||
+        h.entries_off % alignof(pack_entry) != 0 || h.seeds_off % alignof(uint32_t) != 0 ||
+        !in_range(h.entries_off, (uint64_t)h.entry_count * sizeof(pack_entry), m_size) ||
+        !in_range(h.seeds_off, (uint64_t)h.bucket_count * sizeof(uint32_t), m_size))
+    {
+        return false;
+    }
+    const pack_entry *entries = (const pack_entry *)(m_base + h.entries_off);
+    for (uint32_t i = 0; i < h.entry_count; ++i)
+    {
+        const pack_entry &e = entries[i];
+        if (!in_range(e.url_off, e.url_len, m_size) || e.variant_count < 1 || e.variant_count > 2)
+        {
+            return false;
+        }
+        for (uint32_t j = 0; j < e.variant_count; ++j)
+        {
+            const pack_variant &v = e.variants[j];
+            if (!in_range(v.body_off, v.body_len, m_size) || !in_range(v.head_off, v.head_len, m_size) ||
+                !in_range(v.etag_off, v.etag_len, m_size))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+const pack_entry *content_pack::find(const char *url, size_t len) const
+{
+    if (m_header == NULL || m_header->entry_count == 0)
+    {
+        return NULL;
+    }
+    uint32_t bucket = pack_hash(url, len, 0) % m_header->bucket_count;
+    uint32_t slot = pack_hash(url, len, m_seeds[bucket]) % m_header->entry_count;
+    const pack_entry *e = m_entries + slot;
+    //不在集合中的url也会落到某个槽位上，必须比较
+    if (e->url_len != len || memcmp(m_base + e->url_off, url, len) != 0)
+    {
+        return NULL;
+    }
+    return e;
+}
@@ -0,0 +1,145 @@
+#include "cpu_affinity.h"
+
+#include <sched.h>
+#include <dirent.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+std::vector<int> online_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int i = 0; i < CPU_SETSIZE; ++i)
+        {
+            if (CPU_ISSET(i, &set))
+            {
+                cpus.push_back(i);
+            }
+        }
+    }
+    if (cpus.empty())
+    {
+        cpus.push_back(0);
+    }
+    return cpus;
+}
+
+bool parse_cpu_list(const char *list, std::vector<int> &cpus)
+{
+    cpus.clear();
+    const char *p = list;
+    while (*p != '\0')
+    {
+        char *end = NULL;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+        {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-')
+        {
+            ++p;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+            {
+                return false;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back((int)cpu);
+        }
+        if (*p == ',')
+        {
+            ++p;
+        }
+        else if (*p != '\0')
+        {
+            return false;
+        }
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return !cpus.empty();
+}
+
+int cpu_numa_node(int cpu)
+{
+    // 内核在 cpuN 目录下为其所属节点放置 nodeM 链接
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+    int node = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9')
+        {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+void group_cpus_by_node(const std::vector<int> &cpus, std::vector<int> &nodes,
+                        std::vector<std::vector<int> > &groups)
+{
+    nodes.clear();
+    groups.clear();
+    for (size_t i = 0; i < cpus.size(); ++i)
+    {
+        int node = cpu_numa_node(cpus[i]);
+        size_t g = std::find(nodes.begin(), nodes.end(), node) - nodes.begin();
+        if (g == nodes.size())
+        {
+            nodes.push_back(node);
+            groups.push_back(std::vector<int>());
+        }
+        groups[g].push_back(cpus[i]);
+    }
+}
+
+static void fill_cpu_set(const std::vector<int> &cpus, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    for (size_t i = 0; i < cpus.size(); ++i)
+    {
+        CPU_SET(cpus[i], set);
+    }
+}
+
+bool pin_thread(pthread_t thread, const std::vector<int> &cpus)
+{
+    if (cpus.empty())
+    {
+        return true;
+    }
+    cpu_set_t set;
+    fill_cpu_set(cpus, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+bool set_attr_affinity(pthread_attr_t *attr, const std::vector<int> &cpus)
+{
+    if (cpus.empty())
+    {
+        return true;
+    }
+    cpu_set_t set;
+    fill_cpu_set(cpus, &set);
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0;
+}
@@ -0,0 +1,1081 @@
+#include "h2_session.h"
+#include "http_conn.h"
+#include "rate_limiter.h"
+#include "tls.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <cstring>
+#include <cctype>
+
+static const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t CLIENT_PREFACE_LEN = sizeof(client_preface) - 1;
+
+static unsigned get_u32(const unsigned char *p)
+{
+    return ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | p[3];
+}
+
+static void put_u32(char *p, unsigned v)
+{
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+static void frame_header(char *p, size_t len, int type, int flags, unsigned sid)
+{
+    p[0] = (char)(len >> 16);
+    p[1] = (char)(len >> 8);
+    p[2] = (char)len;
+    p[3] = (char)type;
+    p[4] = (char)flags;
+    put_u32(p + 5, sid & 0x7fffffff);
+}
+
+//HTTP2-Settings头部使用不带填充的base64url编码
+static bool base64url_decode(const char *in, std::string &out)
+{
+    unsigned acc = 0;
+    int bits = 0;
+    for (; *in && *in != ' ' && *in != '\t'; ++in)
+    {
+        char c = *in;
+        int v;
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '-' || c == '+')
+            v = 62;
+        else if (c == '_' || c == '/')
+            v = 63;
+        else if (c == '=')
+            break;
+        else
+            return false;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    return true;
+}
+
+h2_session::h2_session(int sockfd, tls_conn *tls, uint64_t limit_key)
+    : m_sockfd(sockfd), m_tls(tls), m_limit_key(limit_key), m_expect_preface(true), m_peer_closed(false), m_upgrade_pending(false), m_goaway_sent(false),
+      m_goaway_received(false), m_in_len(0), m_header_sid(0), m_header_end_stream(false),
+      m_last_stream_id(0), m_cursor(0), m_open_streams(0), m_send_window(DEFAULT_WINDOW),
+      m_initial_window(DEFAULT_WINDOW), m_peer_frame_size(DEFAULT_FRAME_SIZE), m_recv_window(DEFAULT_WINDOW), m_recv_consumed(0),
+      m_out_bytes(0)
+{
+}
+
+h2_session::~h2_session()
+{
+    while (!m_streams.empty())
+    {
+        stream *s = m_streams.begin()->second;
+        s->inflight = 0;
+        release_stream(s);
+    }
+}
+
+bool h2_session::start(const char *data, size_t len)
+{
+    if (len > sizeof(m_in))
+    {
+        return false;
+    }
+    memcpy(m_in, data, len);
+    m_in_len = len;
+    queue_settings();
+    return true;
+}
+
+bool h2_session::start_upgrade(const http_conn &req, const char *settings, const char *rest, size_t rest_len)
+{
+    std::string payload;
+    if (settings == NULL || !base64url_decode(settings, payload) || !on_settings(0, (const unsigned char *)payload.data(), payload.size(), false))
+    {
+        return false;
+    }
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    out_seg seg;
+    seg.data.assign(switching, sizeof(switching) - 1);
+    seg.off = 0;
+    seg.fd = -1;
+    seg.file_off = 0;
+    seg.file_len = 0;
+    seg.owner = NULL;
+    m_out_bytes += seg.data.size();
+    m_out.push_back(seg);
+    if (!start(rest, rest_len))
+    {
+        return false;
+    }
+
+    //发起升级的请求成为半关闭的流1
+    stream *s = new_stream(1);
+    m_last_stream_id = 1;
+    http_conn *ctx = s->ctx;
+    int url_len = strlen(req.m_url);
+    int host_len = req.m_host ? strlen(req.m_host) : 0;
+    int query_len = req.m_query ? strlen(req.m_query) : 0;
+    if (url_len + host_len + query_len + 3 > http_conn::READ_BUFFER_SIZE)
+    {
+        return false;
+    }
+    char *p = ctx->m_cold->read_buf;
+    ctx->m_method = req.m_method;
+    memcpy(p, req.m_url, url_len + 1);
+    ctx->m_url = p;
+    p += url_len + 1;
+    if (req.m_query)
+    {
+        memcpy(p, req.m_query, query_len + 1);
+        ctx->m_query = p;
+        p += query_len + 1;
+    }
+    if (req.m_host)
+    {
+        memcpy(p, req.m_host, host_len + 1);
+        ctx->m_host = p;
+    }
+    ctx->m_accept_gzip = req.m_accept_gzip;
+    s->error = ctx->route_request();
+    s->recv_closed = true;
+    //处理器留到process()里执行，自适应模式下它可能要在线程池上运行
+    m_upgrade_pending = true;
+    return true;
+}
+
+bool h2_session::read()
+{
+    while (m_in_len < sizeof(m_in))
+    {
+        ssize_t n = sock_recv(m_sockfd, m_tls, m_in + m_in_len, sizeof(m_in) - m_in_len);
+        if (n > 0)
+        {
+            m_in_len += n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        m_peer_closed = true;
+        return false;
+    }
+    return true;
+}
+
+bool h2_session::finished() const
+{
+    if (!m_out.empty())
+    {
+        return false;
+    }
+    return m_goaway_sent || m_peer_closed || (m_goaway_received && m_open_streams == 0);
+}
+
+bool h2_session::process()
+{
+    if (m_upgrade_pending)
+    {
+        m_upgrade_pending = false;
+        stream *s = find_stream(1);
+        if (s != NULL)
+        {
+            if (s->error == 0 && !s->ctx->m_body_sink->finish())
+            {
+                s->error = http_conn::INTERNAL_ERROR;
+            }
+            finish_request(s);
+        }
+    }
+    size_t pos = 0;
+    if (m_expect_preface)
+    {
+        if (m_in_len < CLIENT_PREFACE_LEN)
+        {
+            return memcmp(m_in, client_preface, m_in_len) == 0;
+        }
+        if (memcmp(m_in, client_preface, CLIENT_PREFACE_LEN) != 0)
+        {
+            return false;
+        }
+        pos = CLIENT_PREFACE_LEN;
+        m_expect_preface = false;
+    }
+    while (!m_goaway_sent && m_in_len - pos >= (size_t)FRAME_HEADER_LEN)
+    {
+        const unsigned char *h = m_in + pos;
+        size_t len = ((size_t)h[0] << 16) | ((size_t)h[1] << 8) | h[2];
+        if (len > (size_t)DEFAULT_FRAME_SIZE)
+        {
+            goaway(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (m_in_len - pos < FRAME_HEADER_LEN + len)
+        {
+            break;
+        }
+        int type = h[3];
+        int flags = h[4];
+        unsigned sid = get_u32(h + 5) & 0x7fffffff;
+        pos += FRAME_HEADER_LEN + len;
+        if (!handle_frame(type, flags, sid, h + FRAME_HEADER_LEN, len))
+        {
+            break;
+        }
+    }
+    memmove(m_in, m_in + pos, m_in_len - pos);
+    m_in_len -= pos;
+
+    //批量归还连接级接收窗口
+    if (m_recv_consumed > 0 && !m_goaway_sent)
+    {
+        char inc[4];
+        put_u32(inc, (unsigned)m_recv_consumed);
+        queue_frame(FRAME_WINDOW_UPDATE, 0, 0, inc, 4);
+        m_recv_window += m_recv_consumed;
+        m_recv_consumed = 0;
+    }
+    return true;
+}
+
+bool h2_session::handle_frame(int type, int flags, unsigned sid, const unsigned char *payload, size_t len)
+{
+    //头部块必须连续，中间不能插入其他帧
+    if (m_header_sid != 0 && type != FRAME_CONTINUATION)
+    {
+        return goaway(PROTOCOL_ERROR);
+    }
+    switch (type)
+    {
+    case FRAME_DATA:
+        return on_data(flags, sid, payload, len);
+    case FRAME_HEADERS:
+        return on_headers(flags, sid, payload, len);
+    case FRAME_CONTINUATION:
+        return on_continuation(flags, sid, payload, len);
+    case FRAME_PRIORITY:
+        if (sid == 0 || len != 5)
+        {
+            return goaway(PROTOCOL_ERROR);
+        }
+        return true;
+    case FRAME_RST_STREAM:
+        return on_rst_stream(sid, len);
+    case FRAME_SETTINGS:
+        if (sid != 0)
+        {
+            return goaway(PROTOCOL_ERROR);
+        }
+        return on_settings(flags, payload, len, true);
+    case FRAME_PUSH_PROMISE:
+        //客户端不能推送
+        return goaway(PROTOCOL_ERROR);
+    case FRAME_PING:
+        if (sid != 0 || len != 8)
+        {
+            return goaway(len != 8 ? FRAME_SIZE_ERROR : PROTOCOL_ERROR);
+        }
+        if (!(flags & FLAG_ACK))
+        {
+            queue_frame(FRAME_PING, FLAG_ACK, 0, (const char *)payload, 8);
+        }
+        return true;
+    case FRAME_GOAWAY:
+        m_goaway_received = true;
+        return true;
+    case FRAME_WINDOW_UPDATE:
+        return on_window_update(sid, payload, len);
+    default:
+        //未知类型的帧必须忽略
+        return true;
+    }
+}
+
+/*
+    接收方向的流量控制：对端只能在我们通告的连接级和流级窗口内发送DATA帧，超出即为
+    FLOW_CONTROL_ERROR。窗口在数据交给消费者之后才归还，消费者写得慢时对端随之停下；
+    流级窗口攒够一半再发WINDOW_UPDATE，连接级窗口在process()末尾批量归还。
+*/
+bool h2_session::on_data(int flags, unsigned sid, const unsigned char *payload, size_t len)
+{
+    if (sid == 0)
+    {
+        return goaway(PROTOCOL_ERROR);
+    }
+    //整个帧（含填充）都计入流量控制
+    size_t frame_len = len;
+    if ((long long)frame_len > m_recv_window)
+    {
+        return goaway(FLOW_CONTROL_ERROR);
+    }
+    m_recv_window -= frame_len;
+    m_recv_consumed += frame_len;
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1 || payload[0] >= len)
+        {
+            return goaway(PROTOCOL_ERROR);
+        }
+        len -= 1 + payload[0];
+        ++payload;
+    }
+    stream *s = find_stream(sid);
+    if (s == NULL || s->recv_closed)
+    {
+        if (sid > m_last_stream_id)
+        {
+            return goaway(PROTOCOL_ERROR);
+        }
+        reset_stream(sid, STREAM_CLOSED);
+        return true;
+    }
+    if ((long long)frame_len > s->recv_window)
+    {
+        reset_stream(sid, FLOW_CONTROL_ERROR);
+        close_stream(s);
+        return true;
+    }
+    s->recv_window -= frame_len;
+    if (s->error == 0 && len > 0 && !s->ctx->m_body_sink->write((const char *)payload, len))
+    {
+        s->error = s->ctx->m_body_sink->too_large() ? http_conn::PAYLOAD_TOO_LARGE : http_conn::INTERNAL_ERROR;
+        s->ctx->m_body_sink->abort();
+    }
+    if (flags & FLAG_END_STREAM)
+    {
+        s->recv_closed = true;
+        if (s->error == 0 && !s->ctx->m_body_sink->finish())
+        {
+            s->error = http_conn::INTERNAL_ERROR;
+        }
+        finish_request(s);
+        return true;
+    }
+    //出错的流仍然归还窗口，让对端把请求体发完，收到END_STREAM后才能应答
+    s->recv_consumed += frame_len;
+    if (s->recv_consumed >= (size_t)DEFAULT_WINDOW / 2)
+    {
+        char inc[4];
+        put_u32(inc, (unsigned)s->recv_consumed);
+        queue_frame(FRAME_WINDOW_UPDATE, 0, sid, inc, 4);
+        s->recv_window += s->recv_consumed;
+        s->recv_consumed = 0;
+    }
+    return true;
+}
+
+bool h2_session::on_headers(int flags, unsigned sid, const unsigned char *payload, size_t len)
+{
+    if (sid == 0)
+    {
+        return goaway(PROTOCOL_ERROR);
+    }
+    size_t pad = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1)
+        {
+            return goaway(PROTOCOL_ERROR);
+        }
+        pad = payload[0];
+        ++payload;
+        --len;
+    }
+    if (flags & FLAG_PRIORITY)
+    {
+        if (len < 5)
+        {
+            return goaway(PROTOCOL_ERROR);
+        }
+        payload += 5;
+        len -= 5;
+    }
+    if (pad > len)
+    {
+        return goaway(PROTOCOL_ERROR);
+    }
+    len -= pad;
+    m_header_block.assign((const char *)payload, len);
+    m_header_sid = sid;
+    m_header_end_stream = (flags & FLAG_END_STREAM) != 0;
+    if (flags & FLAG_END_HEADERS)
+    {
+        return on_header_block();
+    }
+    return true;
+}
+
+bool h2_session::on_continuation(int flags, unsigned sid, const unsigned char *payload, size_t len)
+{
+    if (m_header_sid == 0 || sid != m_header_sid || m_header_block.size() + len > MAX_HEADER_BLOCK)
+    {
+        return goaway(PROTOCOL_ERROR);
+    }
+    m_header_block.append((const char *)payload, len);
+    if (flags & FLAG_END_HEADERS)
+    {
+        return on_header_block();
+    }
+    return true;
+}
+
+/*
+    头部块完整后解码并建立请求。新流的请求上下文是一个独立的http_conn，
+    路径和authority拷贝到它的读缓冲区，之后与HTTP/1.1请求走同样的路由。
+*/
+bool h2_session::on_header_block()
+{
+    unsigned sid = m_header_sid;
+    m_header_sid = 0;
+    std::vector<hpack_header> headers;
+    //即使流要被拒绝也必须解码，保持与对端的动态表一致
+    if (!m_decoder.decode((const unsigned char *)m_header_block.data(), m_header_block.size(), headers))
+    {
+        return goaway(COMPRESSION_ERROR);
+    }
+    m_header_block.clear();
+
+    stream *s = find_stream(sid);
+    if (s != NULL)
+    {
+        //已有流上的HEADERS只能是trailer，必须结束流
+        if (s->recv_closed || !m_header_end_stream)
+        {
+            return goaway(PROTOCOL_ERROR);
+        }
+        s->recv_closed = true;
+        if (s->error == 0 && !s->ctx->m_body_sink->finish())
+        {
+            s->error = http_conn::INTERNAL_ERROR;
+        }
+        finish_request(s);
+        return true;
+    }
+    if ((sid & 1) == 0)
+    {
+        return goaway(PROTOCOL_ERROR);
+    }
+    if (sid <= m_last_stream_id)
+    {
+        //已重置、被拒绝或已结束的流上迟到的HEADERS（如trailer）只重置这个流，不影响其他流
+        reset_stream(sid, STREAM_CLOSED);
+        return true;
+    }
+    m_last_stream_id = sid;
+    if (m_goaway_received)
+    {
+        return true;
+    }
+    if (m_open_streams >= MAX_CONCURRENT_STREAMS)
+    {
+        reset_stream(sid, REFUSED_STREAM);
+        return true;
+    }
+
+    const std::string *method = NULL, *path = NULL, *authority = NULL, *if_none_match = NULL;
+    bool accept_gzip = false;
+    long long content_length = -1;
+    for (size_t i = 0; i < headers.size(); ++i)
+    {
+        const hpack_header &h = headers[i];
+        if (h.name == ":method")
+            method = &h.value;
+        else if (h.name == ":path")
+            path = &h.value;
+        else if (h.name == ":authority" || (h.name == "host" && authority == NULL))
+            authority = &h.value;
+        else if (h.name == "content-length")
+            content_length = atoll(h.value.c_str());
+        else if (h.name == "accept-encoding")
+            accept_gzip = http_conn::accepts_gzip(h.value.c_str());
+        else if (h.name == "if-none-match")
+            if_none_match = &h.value;
+    }
+    http_conn::METHOD m = method ? http_conn::parse_method(method->c_str()) : http_conn::UNKOWN;
+    size_t need = (path ? path->size() : 0) + (authority ? authority->size() : 0) +
+                  (if_none_match ? if_none_match->size() : 0) + 3;
+    if (m == http_conn::UNKOWN || path == NULL || path->empty() || (*path)[0] != '/' || need > (size_t)http_conn::READ_BUFFER_SIZE)
+    {
+        reset_stream(sid, PROTOCOL_ERROR);
+        return true;
+    }
+
+    s = new_stream(sid);
+    http_conn *ctx = s->ctx;
+    rate_limiter *limiter = http_conn::m_limiter;
+    if (limiter != NULL && limiter->limits_requests() && !limiter->allow_request(m_limit_key))
+    {
+        //每个流都是一个请求，和HTTP/1.1一样从令牌桶中扣除；超速的流直接以429结束，不执行处理器，
+        //之后到达的请求体以STREAM_CLOSED拒绝
+        const char *resp = http_conn::TOO_MANY_REQUESTS;
+        int len = sizeof(http_conn::TOO_MANY_REQUESTS) - 1;
+        memcpy(ctx->m_cold->write_buf, resp, len);
+        ctx->m_write_idx = len;
+        ctx->m_headers_len = strstr(resp, "\r\n\r\n") + 4 - resp;
+        s->recv_closed = true;
+        respond(s);
+        return true;
+    }
+    char *p = ctx->m_cold->read_buf;
+    ctx->m_method = m;
+    memcpy(p, path->c_str(), path->size() + 1);
+    ctx->m_url = p;
+    ctx->m_query = strchr(p, '?');
+    if (ctx->m_query != NULL)
+    {
+        *ctx->m_query++ = '\0';
+    }
+    p += path->size() + 1;
+    if (authority != NULL)
+    {
+        memcpy(p, authority->c_str(), authority->size() + 1);
+        ctx->m_host = p;
+        p += authority->size() + 1;
+    }
+    if (if_none_match != NULL)
+    {
+        memcpy(p, if_none_match->c_str(), if_none_match->size() + 1);
+        ctx->m_if_none_match = p;
+    }
+    ctx->m_accept_gzip = accept_gzip;
+    ctx->m_content_length = content_length > 0 ? content_length : 0;
+    s->error = ctx->route_request();
+    if (m_header_end_stream)
+    {
+        s->recv_closed = true;
+        if (s->error == 0 && !ctx->m_body_sink->finish())
+        {
+            s->error = http_conn::INTERNAL_ERROR;
+        }
+        finish_request(s);
+    }
+    return true;
+}
+
+bool h2_session::on_settings(int flags, const unsigned char *payload, size_t len, bool ack_needed)
+{
+    if (flags & FLAG_ACK)
+    {
+        return len == 0 ? true : goaway(FRAME_SIZE_ERROR);
+    }
+    if (len % 6 != 0)
+    {
+        return goaway(FRAME_SIZE_ERROR);
+    }
+    for (size_t i = 0; i < len; i += 6)
+    {
+        int id = (payload[i] << 8) | payload[i + 1];
+        unsigned value = get_u32(payload + i + 2);
+        if (id == 4)
+        {
+            //SETTINGS_INITIAL_WINDOW_SIZE的变化作用于所有已有流
+            if (value > 0x7fffffff)
+            {
+                return goaway(FLOW_CONTROL_ERROR);
+            }
+            long long delta = (long long)value - m_initial_window;
+            m_initial_window = value;
+            for (std::map<unsigned, stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+            {
+                it->second->send_window += delta;
+            }
+        }
+        else if (id == 5)
+        {
+            if (value < (unsigned)DEFAULT_FRAME_SIZE || value > 0xffffff)
+            {
+                return goaway(PROTOCOL_ERROR);
+            }
+            m_peer_frame_size = value;
+        }
+        else if (id == 2 && value > 1)
+        {
+            return goaway(PROTOCOL_ERROR);
+        }
+    }
+    if (ack_needed)
+    {
+        queue_frame(FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+    }
+    return true;
+}
+
+bool h2_session::on_window_update(unsigned sid, const unsigned char *payload, size_t len)
+{
+    if (len != 4)
+    {
+        return goaway(FRAME_SIZE_ERROR);
+    }
+    unsigned inc = get_u32(payload) & 0x7fffffff;
+    if (sid == 0)
+    {
+        if (inc == 0 || m_send_window + inc > 0x7fffffff)
+        {
+            return goaway(inc == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        }
+        m_send_window += inc;
+        return true;
+    }
+    stream *s = find_stream(sid);
+    if (s == NULL)
+    {
+        return true;
+    }
+    if (inc == 0 || s->send_window + inc > 0x7fffffff)
+    {
+        reset_stream(sid, inc == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        close_stream(s);
+        return true;
+    }
+    s->send_window += inc;
+    return true;
+}
+
+//错误码只用于诊断，这里不区分
+bool h2_session::on_rst_stream(unsigned sid, size_t len)
+{
+    if (sid == 0)
+    {
+        return goaway(PROTOCOL_ERROR);
+    }
+    if (len != 4)
+    {
+        return goaway(FRAME_SIZE_ERROR);
+    }
+    stream *s = find_stream(sid);
+    if (s != NULL)
+    {
+        //对端发出RST_STREAM后会忽略已在途的帧，只需停止继续生成
+        close_stream(s);
+    }
+    return true;
+}
+
+h2_session::stream *h2_session::new_stream(unsigned id)
+{
+    stream *s = new stream;
+    s->id = id;
+    s->ctx = new http_conn;
+    s->ctx->init_request();
+    s->ctx->m_linger = true;
+    s->error = 0;
+    s->recv_closed = false;
+    s->responded = false;
+    s->end_sent = false;
+    s->reset = false;
+    s->send_window = m_initial_window;
+    s->recv_window = DEFAULT_WINDOW;
+    s->recv_consumed = 0;
+    s->body = BODY_NONE;
+    s->mem_off = 0;
+    s->file_fd = -1;
+    s->file_shared = false;
+    s->file_off = 0;
+    s->file_left = 0;
+    s->source = NULL;
+    s->source_eof = false;
+    s->inflight = 0;
+    m_streams[id] = s;
+    ++m_open_streams;
+    return s;
+}
+
+h2_session::stream *h2_session::find_stream(unsigned id)
+{
+    std::map<unsigned, stream *>::iterator it = m_streams.find(id);
+    return it == m_streams.end() || it->second->reset ? NULL : it->second;
+}
+
+//请求完整接收后执行处理器并生成应答头
+void h2_session::finish_request(stream *s)
+{
+    http_conn *ctx = s->ctx;
+    http_conn::HTTP_CODE code = s->error != 0 ? (http_conn::HTTP_CODE)s->error : ctx->do_request();
+    if (!ctx->process_write(code))
+    {
+        ctx->m_write_idx = 0;
+        ctx->process_write(http_conn::INTERNAL_ERROR);
+    }
+    respond(s);
+}
+
+/*
+    把http_conn生成的HTTP/1.1应答头转换成HEADERS帧：
+    状态码取自状态行，头部名字转为小写，去掉HTTP/2中不允许的逐跳头部。
+*/
+void h2_session::respond(stream *s)
+{
+    http_conn *ctx = s->ctx;
+    const char *buf = ctx->m_cold->write_buf;
+    int headers_len = ctx->m_headers_len;
+    int status = 500;
+    if (headers_len > 12 && strncmp(buf, "HTTP/1.1 ", 9) == 0)
+    {
+        status = atoi(buf + 9);
+    }
+
+    std::string block;
+    m_encoder.encode_status(status, block);
+    const char *line = headers_len > 0 ? (const char *)memchr(buf, '\n', headers_len) : NULL;
+    while (line != NULL && line + 1 < buf + headers_len)
+    {
+        const char *start = line + 1;
+        const char *end = (const char *)memchr(start, '\n', buf + headers_len - start);
+        if (end == NULL)
+        {
+            break;
+        }
+        line = end;
+        size_t n = end - start;
+        if (n > 0 && start[n - 1] == '\r')
+        {
+            --n;
+        }
+        const char *colon = (const char *)memchr(start, ':', n);
+        if (colon == NULL)
+        {
+            continue;
+        }
+        std::string name(start, colon - start);
+        for (size_t i = 0; i < name.size(); ++i)
+        {
+            name[i] = (char)tolower((unsigned char)name[i]);
+        }
+        if (name == "connection" || name == "transfer-encoding" || name == "keep-alive")
+        {
+            continue;
+        }
+        const char *value = colon + 1;
+        while (value < start + n && (*value == ' ' || *value == '\t'))
+        {
+            ++value;
+        }
+        m_encoder.encode(name.data(), name.size(), value, start + n - value, block);
+    }
+
+    if (ctx->m_source != NULL)
+    {
+        s->body = BODY_SOURCE;
+        s->source = ctx->m_source;
+        ctx->m_source = NULL;
+    }
+    else if (ctx->m_file_fd >= 0 && ctx->m_cold->file_stat.st_size > 0)
+    {
+        s->body = BODY_FILE;
+        s->file_fd = ctx->m_file_fd;
+        s->file_shared = ctx->m_file_shared;
+        s->file_off = ctx->m_file_offset;
+        s->file_left = ctx->m_cold->file_stat.st_size;
+        ctx->m_file_fd = -1;
+        ctx->m_file_shared = false;
+    }
+    else if (ctx->m_write_idx > headers_len)
+    {
+        s->body = BODY_MEMORY;
+        s->mem.assign(buf + headers_len, ctx->m_write_idx - headers_len);
+    }
+    ctx->release_file();
+
+    //头部块超过对端的帧大小时拆成HEADERS + CONTINUATION
+    int end_stream = s->body == BODY_NONE ? FLAG_END_STREAM : 0;
+    size_t off = 0;
+    int type = FRAME_HEADERS;
+    do
+    {
+        size_t n = block.size() - off;
+        if (n > m_peer_frame_size)
+        {
+            n = m_peer_frame_size;
+        }
+        int flags = (type == FRAME_HEADERS ? end_stream : 0) | (off + n == block.size() ? FLAG_END_HEADERS : 0);
+        queue_frame(type, flags, s->id, block.data() + off, n);
+        off += n;
+        type = FRAME_CONTINUATION;
+    } while (off < block.size());
+    s->responded = true;
+    if (end_stream)
+    {
+        s->end_sent = true;
+        close_stream(s);
+    }
+}
+
+//流不再生成帧；还有文件段在输出队列中时推迟释放
+void h2_session::close_stream(stream *s)
+{
+    if (!s->reset)
+    {
+        s->reset = true;
+        --m_open_streams;
+    }
+    if (s->inflight == 0)
+    {
+        release_stream(s);
+    }
+}
+
+void h2_session::release_stream(stream *s)
+{
+    m_streams.erase(s->id);
+    if (s->file_fd >= 0 && !s->file_shared)
+    {
+        close(s->file_fd);
+    }
+    delete s->source;
+    s->ctx->m_body_sink->abort();
+    delete s->ctx;
+    delete s;
+}
+
+//从生产者拷出数据，直到缓冲的数据够want字节或者生产结束
+bool h2_session::fill_source(stream *s, size_t want)
+{
+    if (s->mem_off > 0 && s->mem_off == s->mem.size())
+    {
+        s->mem.clear();
+        s->mem_off = 0;
+    }
+    bool retried = false;
+    while (!s->source_eof && s->mem.size() - s->mem_off < want)
+    {
+        struct iovec iov[SOURCE_IOV_MAX];
+        int n = s->source->produce(iov, SOURCE_IOV_MAX, s->source_eof);
+        if (n < 0)
+        {
+            return false;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            s->mem.append((const char *)iov[i].iov_base, iov[i].iov_len);
+        }
+        s->source->consumed();
+        if (n == 0 && !s->source_eof)
+        {
+            if (retried)
+            {
+                return false;
+            }
+            retried = true;
+        }
+    }
+    return true;
+}
+
+/*
+    按轮转顺序为有应答体待发的流生成DATA帧，每帧不超过对端帧大小、
+    流窗口和连接窗口；输出队列积压超过OUTPUT_HIGH_WATER时停止，等套接字可写。
+*/
+void h2_session::pump()
+{
+    //升级后等客户端的连接前言和SETTINGS到达再发应答体，窗口和帧大小以其为准
+    if (m_expect_preface)
+    {
+        return;
+    }
+    while (m_out_bytes < OUTPUT_HIGH_WATER && !m_goaway_sent)
+    {
+        stream *s = NULL;
+        std::map<unsigned, stream *>::iterator it = m_streams.upper_bound(m_cursor);
+        for (size_t i = 0; i < m_streams.size(); ++i, ++it)
+        {
+            if (it == m_streams.end())
+            {
+                it = m_streams.begin();
+            }
+            stream *c = it->second;
+            if (!c->reset && c->responded && !c->end_sent && c->body != BODY_NONE &&
+                ((c->send_window > 0 && m_send_window > 0) || (c->body == BODY_SOURCE && c->source_eof && c->mem_off == c->mem.size())))
+            {
+                s = c;
+                break;
+            }
+        }
+        if (s == NULL)
+        {
+            return;
+        }
+        m_cursor = s->id;
+
+        size_t n = m_peer_frame_size;
+        if ((long long)n > s->send_window)
+            n = s->send_window > 0 ? (size_t)s->send_window : 0;
+        if ((long long)n > m_send_window)
+            n = m_send_window > 0 ? (size_t)m_send_window : 0;
+
+        bool last = false;
+        if (s->body == BODY_FILE)
+        {
+            if ((long long)n > s->file_left)
+                n = s->file_left;
+            last = (long long)n == s->file_left;
+            char head[FRAME_HEADER_LEN];
+            frame_header(head, n, FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id);
+            out_seg seg;
+            seg.data.assign(head, FRAME_HEADER_LEN);
+            seg.off = 0;
+            seg.fd = -1;
+            seg.file_off = 0;
+            seg.file_len = 0;
+            seg.owner = NULL;
+            m_out.push_back(seg);
+            seg.data.clear();
+            seg.fd = s->file_fd;
+            seg.file_off = s->file_off;
+            seg.file_len = n;
+            seg.owner = s;
+            m_out.push_back(seg);
+            m_out_bytes += FRAME_HEADER_LEN + n;
+            ++s->inflight;
+            s->file_off += n;
+            s->file_left -= n;
+        }
+        else
+        {
+            if (s->body == BODY_SOURCE && !fill_source(s, n))
+            {
+                reset_stream(s->id, INTERNAL_ERROR);
+                close_stream(s);
+                continue;
+            }
+            size_t avail = s->mem.size() - s->mem_off;
+            if (n > avail)
+                n = avail;
+            last = n == avail && (s->body == BODY_MEMORY || s->source_eof);
+            queue_frame(FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id, s->mem.data() + s->mem_off, n);
+            s->mem_off += n;
+        }
+        s->send_window -= n;
+        m_send_window -= n;
+        if (last)
+        {
+            s->end_sent = true;
+            close_stream(s);
+        }
+    }
+}
+
+bool h2_session::write()
+{
+    pump();
+    while (!m_out.empty())
+    {
+        out_seg &seg = m_out.front();
+        ssize_t n;
+        size_t left;
+        if (seg.fd < 0)
+        {
+            left = seg.data.size() - seg.off;
+            //后面还有段（比如DATA帧头之后的文件内容）时不立即发出小包，避免Nagle等待对端的延迟确认
+            n = sock_send(m_sockfd, m_tls, seg.data.data() + seg.off, left, m_out.size() > 1 ? MSG_MORE : 0);
+        }
+        else
+        {
+            left = seg.file_len;
+            n = sock_sendfile(m_sockfd, m_tls, seg.fd, &seg.file_off, left);
+            if (n == 0)
+            {
+                //文件被截短，无法按Content-Length发完
+                return false;
+            }
+        }
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return true;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        m_out_bytes -= n;
+        if ((size_t)n < left)
+        {
+            if (seg.fd < 0)
+                seg.off += n;
+            else
+                seg.file_len -= n;
+            continue;
+        }
+        stream *owner = seg.owner;
+        m_out.pop_front();
+        if (owner != NULL && --owner->inflight == 0 && owner->reset)
+        {
+            release_stream(owner);
+        }
+        if (m_out.empty())
+        {
+            pump();
+        }
+    }
+    return !finished();
+}
+
+void h2_session::queue_frame(int type, int flags, unsigned sid, const char *payload, size_t len)
+{
+    out_seg seg;
+    seg.data.resize(FRAME_HEADER_LEN + len);
+    frame_header(&seg.data[0], len, type, flags, sid);
+    if (len > 0)
+    {
+        memcpy(&seg.data[FRAME_HEADER_LEN], payload, len);
+    }
+    seg.off = 0;
+    seg.fd = -1;
+    seg.file_off = 0;
+    seg.file_len = 0;
+    seg.owner = NULL;
+    m_out_bytes += seg.data.size();
+    m_out.push_back(seg);
+}
+
+void h2_session::queue_settings()
+{
+    char payload[6];
+    payload[0] = 0;
+    payload[1] = 3; //SETTINGS_MAX_CONCURRENT_STREAMS
+    put_u32(payload + 2, MAX_CONCURRENT_STREAMS);
+    queue_frame(FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+void h2_session::reset_stream(unsigned sid, ERROR_CODE code)
+{
+    char payload[4];
+    put_u32(payload, code);
+    queue_frame(FRAME_RST_STREAM, 0, sid, payload, 4);
+}
+
+//发送GOAWAY，处理完输出后关闭连接；总是返回false以停止处理后续帧
+bool h2_session::goaway(ERROR_CODE code)
+{
+    if (!m_goaway_sent)
+    {
+        char payload[8];
+        put_u32(payload, m_last_stream_id);
+        put_u32(payload + 4, code);
+        queue_frame(FRAME_GOAWAY, 0, 0, payload, 8);
+        m_goaway_sent = true;
+    }
+    return false;
+}
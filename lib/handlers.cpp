@@ -0,0 +1,126 @@
+#include "handlers.h"
+#include "proxy.h"
+#include "content_pack.h"
+#include "websocket.h"
+
+const char *doc_root = "/home/zpeng/www";
+upstream_pool *proxy_upstream = NULL;
+content_pack *site_pack = NULL;
+
+//路径中不允许出现".."段，防止访问根目录之外的文件
+static bool safe_path(std::string_view path)
+{
+    size_t pos = 0;
+    while (pos <= path.size())
+    {
+        size_t end = path.find('/', pos);
+        if (end == std::string_view::npos)
+        {
+            end = path.size();
+        }
+        if (path.substr(pos, end - pos) == "..")
+        {
+            return false;
+        }
+        pos = end + 1;
+    }
+    return true;
+}
+
+http_conn::HTTP_CODE serve_static(http_conn &conn, const route_params &params)
+{
+    std::string_view path = params.get("path");
+    if (!safe_path(path))
+    {
+        return http_conn::FORBIDDEN_REQUEST;
+    }
+    if (path.empty())
+    {
+        path = "index.html";
+    }
+    char file_path[http_conn::FILENAME_LEN];
+    int len = snprintf(file_path, sizeof(file_path), "%s/%.*s", doc_root, (int)path.size(), path.data());
+    if (len >= (int)sizeof(file_path))
+    {
+        return http_conn::NO_RESOURCE;
+    }
+    return conn.serve_file(file_path);
+}
+
+http_conn::HTTP_CODE serve_packed(http_conn &conn, const route_params &params)
+{
+    http_conn::HTTP_CODE ret = conn.serve_packed(*site_pack);
+    return ret == http_conn::NO_RESOURCE ? serve_static(conn, params) : ret;
+}
+
+http_conn::HTTP_CODE serve_health(http_conn &conn, const route_params &)
+{
+    char body[96];
+    int len = snprintf(body, sizeof(body), "{\"status\":\"ok\",\"connections\":%d,\"shed\":%ld}\n",
+                       http_conn::m_user_count.load(), http_conn::m_shed_count.load());
+    return conn.respond(200, "application/json", body, len) ? http_conn::RESPONSE_READY : http_conn::INTERNAL_ERROR;
+}
+
+http_conn::HTTP_CODE accept_upload(http_conn &conn, const route_params &params)
+{
+    std::string_view path = params.get("path");
+    if (http_conn::m_upload_root == NULL)
+    {
+        return http_conn::FORBIDDEN_REQUEST;
+    }
+    if (path.empty() || path.back() == '/' || !safe_path(path))
+    {
+        return http_conn::FORBIDDEN_REQUEST;
+    }
+    char file_path[http_conn::FILENAME_LEN];
+    int len = snprintf(file_path, sizeof(file_path), "%s/%.*s", http_conn::m_upload_root, (int)path.size(), path.data());
+    if (len >= (int)sizeof(file_path) || !conn.receive_to_file(file_path))
+    {
+        return http_conn::INTERNAL_ERROR;
+    }
+    return http_conn::NO_REQUEST;
+}
+
+http_conn::HTTP_CODE finish_upload(http_conn &, const route_params &)
+{
+    return http_conn::CREATED_REQUEST;
+}
+
+http_conn::HTTP_CODE accept_proxy_body(http_conn &conn, const route_params &)
+{
+    if (conn.get_content_length() > (long long)proxy_exchange::MAX_BODY)
+    {
+        return http_conn::PAYLOAD_TOO_LARGE;
+    }
+    conn.receive_to_memory(proxy_exchange::MAX_BODY);
+    return http_conn::NO_REQUEST;
+}
+
+http_conn::HTTP_CODE proxy_pass(http_conn &conn, const route_params &)
+{
+    return conn.proxy(proxy_upstream);
+}
+
+http_conn::HTTP_CODE serve_websocket(http_conn &conn, const route_params &params)
+{
+    return conn.websocket(params.get("topic"));
+}
+
+http_conn::HTTP_CODE accept_publish(http_conn &conn, const route_params &)
+{
+    if (conn.get_content_length() > (long long)ws_session::MAX_MESSAGE)
+    {
+        return http_conn::PAYLOAD_TOO_LARGE;
+    }
+    conn.receive_to_memory(ws_session::MAX_MESSAGE);
+    return http_conn::NO_REQUEST;
+}
+
+//工作线程上只把消息交给ws_hub，由reactor发给订阅者
+http_conn::HTTP_CODE publish_message(http_conn &conn, const route_params &params)
+{
+    std::string_view topic = params.get("topic");
+    const std::string &body = conn.get_body();
+    http_conn::m_ws_hub->publish(std::string(topic), body.data(), body.size());
+    return conn.respond(202, "text/plain", "Accepted\n", 9) ? http_conn::RESPONSE_READY : http_conn::INTERNAL_ERROR;
+}
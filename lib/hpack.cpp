@@ -0,0 +1,452 @@
+#include "hpack.h"
+
+#include <cstdio>
+#include <cstring>
+
+struct hpack_entry
+{
+    const char *name;
+    const char *value;
+};
+
+static constexpr size_t STATIC_TABLE_SIZE = 61;
+
+static const hpack_entry static_table[STATIC_TABLE_SIZE] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+//RFC 7541 附录B的Huffman编码表，第256项为EOS
+static const unsigned int huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+static const unsigned char huffman_lens[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/*
+    Huffman解码树，首次使用时由编码表构造。
+    每个内部节点有两个子节点下标，叶子节点的sym记录符号。
+*/
+struct huffman_node
+{
+    short child[2];
+    short sym;
+};
+
+static const int HUFFMAN_NODES = 513;
+
+static const huffman_node *huffman_tree()
+{
+    static huffman_node nodes[HUFFMAN_NODES];
+    static bool built = []() {
+        for (int i = 0; i < HUFFMAN_NODES; ++i)
+        {
+            nodes[i].child[0] = nodes[i].child[1] = -1;
+            nodes[i].sym = -1;
+        }
+        int used = 1;
+        for (int sym = 0; sym < 257; ++sym)
+        {
+            int cur = 0;
+            for (int bit = huffman_lens[sym] - 1; bit >= 0; --bit)
+            {
+                int b = (huffman_codes[sym] >> bit) & 1;
+                if (nodes[cur].child[b] < 0)
+                {
+                    nodes[cur].child[b] = used++;
+                }
+                cur = nodes[cur].child[b];
+            }
+            nodes[cur].sym = sym;
+        }
+        return true;
+    }();
+    (void)built;
+    return nodes;
+}
+
+bool hpack_huffman_decode(const unsigned char *data, size_t len, std::string &out)
+{
+    const huffman_node *nodes = huffman_tree();
+    int cur = 0;
+    int depth = 0;   // 自上一个完整符号以来的位数
+    bool all_ones = true;
+    for (size_t i = 0; i < len; ++i)
+    {
+        for (int bit = 7; bit >= 0; --bit)
+        {
+            int b = (data[i] >> bit) & 1;
+            cur = nodes[cur].child[b];
+            if (cur < 0)
+            {
+                return false;
+            }
+            ++depth;
+            all_ones = all_ones && b;
+            if (nodes[cur].sym >= 0)
+            {
+                if (nodes[cur].sym == 256)
+                {
+                    return false; //字符串中不允许出现EOS
+                }
+                out.push_back((char)nodes[cur].sym);
+                cur = 0;
+                depth = 0;
+                all_ones = true;
+            }
+        }
+    }
+    //结尾的填充必须是不超过7位的EOS前缀（全1）
+    return depth <= 7 && all_ones;
+}
+
+bool hpack_decode_int(const unsigned char *&p, const unsigned char *end, int prefix, size_t &value)
+{
+    if (p >= end)
+    {
+        return false;
+    }
+    size_t mask = (1u << prefix) - 1;
+    value = *p++ & mask;
+    if (value < mask)
+    {
+        return true;
+    }
+    int shift = 0;
+    while (p < end)
+    {
+        unsigned char b = *p++;
+        if (shift > 28)
+        {
+            return false;
+        }
+        value += (size_t)(b & 0x7f) << shift;
+        shift += 7;
+        if ((b & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void hpack_encode_int(size_t value, int prefix, unsigned char first, std::string &out)
+{
+    size_t mask = (1u << prefix) - 1;
+    if (value < mask)
+    {
+        out.push_back((char)(first | value));
+        return;
+    }
+    out.push_back((char)(first | mask));
+    value -= mask;
+    while (value >= 0x80)
+    {
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+static bool decode_string(const unsigned char *&p, const unsigned char *end, std::string &out)
+{
+    if (p >= end)
+    {
+        return false;
+    }
+    bool huffman = (*p & 0x80) != 0;
+    size_t len;
+    if (!hpack_decode_int(p, end, 7, len) || len > (size_t)(end - p) || len > hpack_decoder::MAX_STRING_LEN)
+    {
+        return false;
+    }
+    out.clear();
+    if (huffman)
+    {
+        if (!hpack_huffman_decode(p, len, out))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        out.assign((const char *)p, len);
+    }
+    p += len;
+    return true;
+}
+
+bool hpack_decoder::get(size_t index, const hpack_header *&header) const
+{
+    static hpack_header statics[STATIC_TABLE_SIZE];
+    static bool built = []() {
+        for (size_t i = 0; i < STATIC_TABLE_SIZE; ++i)
+        {
+            statics[i].name = static_table[i].name;
+            statics[i].value = static_table[i].value;
+        }
+        return true;
+    }();
+    (void)built;
+    if (index == 0)
+    {
+        return false;
+    }
+    if (index <= STATIC_TABLE_SIZE)
+    {
+        header = &statics[index - 1];
+        return true;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if (index >= m_dynamic.size())
+    {
+        return false;
+    }
+    header = &m_dynamic[index];
+    return true;
+}
+
+void hpack_decoder::evict(size_t max_size)
+{
+    while (m_size > max_size && !m_dynamic.empty())
+    {
+        const hpack_header &last = m_dynamic.back();
+        m_size -= last.name.size() + last.value.size() + 32;
+        m_dynamic.pop_back();
+    }
+}
+
+void hpack_decoder::insert(const std::string &name, const std::string &value)
+{
+    size_t size = name.size() + value.size() + 32;
+    if (size > m_max_size)
+    {
+        //比整个表还大的表项使表清空，自身不入表
+        evict(0);
+        return;
+    }
+    evict(m_max_size - size);
+    hpack_header h;
+    h.name = name;
+    h.value = value;
+    m_dynamic.push_front(h);
+    m_size += size;
+}
+
+bool hpack_decoder::decode(const unsigned char *data, size_t len, std::vector<hpack_header> &headers)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = data + len;
+    bool header_seen = false;
+    while (p < end)
+    {
+        unsigned char b = *p;
+        if (b & 0x80)
+        {
+            //索引表示
+            size_t index;
+            const hpack_header *h;
+            if (!hpack_decode_int(p, end, 7, index) || !get(index, h))
+            {
+                return false;
+            }
+            headers.push_back(*h);
+            header_seen = true;
+        }
+        else if ((b & 0xe0) == 0x20)
+        {
+            //动态表大小更新，只能出现在头部块开头
+            size_t size;
+            if (header_seen || !hpack_decode_int(p, end, 5, size) || size > m_limit)
+            {
+                return false;
+            }
+            m_max_size = size;
+            evict(m_max_size);
+        }
+        else
+        {
+            //字面量：带索引(01)、不索引(0000)、永不索引(0001)
+            bool indexing = (b & 0xc0) == 0x40;
+            int prefix = indexing ? 6 : 4;
+            size_t index;
+            if (!hpack_decode_int(p, end, prefix, index))
+            {
+                return false;
+            }
+            hpack_header h;
+            if (index != 0)
+            {
+                const hpack_header *named;
+                if (!get(index, named))
+                {
+                    return false;
+                }
+                h.name = named->name;
+            }
+            else if (!decode_string(p, end, h.name))
+            {
+                return false;
+            }
+            if (!decode_string(p, end, h.value))
+            {
+                return false;
+            }
+            if (indexing)
+            {
+                insert(h.name, h.value);
+            }
+            headers.push_back(h);
+            header_seen = true;
+        }
+    }
+    return true;
+}
+
+void hpack_encoder::encode_status(int status, std::string &out)
+{
+    static const int indexed[] = {200, 204, 206, 304, 400, 404, 500};
+    for (int i = 0; i < 7; ++i)
+    {
+        if (indexed[i] == status)
+        {
+            hpack_encode_int(8 + i, 7, 0x80, out);
+            return;
+        }
+    }
+    char value[8];
+    snprintf(value, sizeof(value), "%03d", status % 1000);
+    //不索引的字面量，名字取静态表第8项":status"
+    hpack_encode_int(8, 4, 0x00, out);
+    hpack_encode_int(3, 7, 0x00, out);
+    out.append(value, 3);
+}
+
+void hpack_encoder::encode(const char *name, size_t name_len, const char *value, size_t value_len, std::string &out)
+{
+    size_t index = 0;
+    for (size_t i = 0; i < STATIC_TABLE_SIZE; ++i)
+    {
+        if (strlen(static_table[i].name) == name_len && memcmp(static_table[i].name, name, name_len) == 0)
+        {
+            index = i + 1;
+            break;
+        }
+    }
+    hpack_encode_int(index, 4, 0x00, out);
+    if (index == 0)
+    {
+        hpack_encode_int(name_len, 7, 0x00, out);
+        out.append(name, name_len);
+    }
+    hpack_encode_int(value_len, 7, 0x00, out);
+    out.append(value, value_len);
+}
@@ -1,18 +1,158 @@
 #include "http_conn.h"
+#include "h2_session.h"
+#include "tls.h"
+#include "proxy.h"
+#include "content_pack.h"
+#include "rate_limiter.h"
+#include "websocket.h"
+#include "capture.h"
+#include "io_pool.h"
+
+#include <arpa/inet.h>
 
 int http_conn::m_epollfd = -1;
-int http_conn::m_user_count = 0;
+std::atomic<int> http_conn::m_user_count(0);
+std::atomic<long> http_conn::m_shed_count(0);
+const char *http_conn::m_upload_root = NULL;
+bool http_conn::m_dir_listing = false;
+const http_router *http_conn::m_router = NULL;
+rate_limiter *http_conn::m_limiter = NULL;
+ws_hub *http_conn::m_ws_hub = NULL;
+traffic_capture *http_conn::m_capture = NULL;
+io_pool *http_conn::m_io_pool = NULL;
 
 const char* ok_200_title = "OK";
+const char* ok_201_title = "Created";
+const char* ok_201_form = "The uploaded file was stored.\n";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
+const char* redirect_301_title = "Moved Permanently";
+const char* redirect_302_title = "Found";
 const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_405_title = "Method Not Allowed";
+const char* error_405_form = "The requested method is not supported for this resource.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
-const char* doc_root = "/home/zpeng/www";
+const char* error_413_title = "Payload Too Large";
+const char* error_413_form = "The request body is larger than this resource accepts.\n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server is unavailable or sent an invalid response.\n";
+
+/*
+    热文件预测表：记录最近成功服务过的小文件。每个槽是一个原子量，
+    高48位为url哈希，低16位为记录时间，并发读写不需要加锁，
+    偶尔的覆盖只会让预测失准，不影响正确性。
+*/
+static std::atomic<unsigned long long> hot_files[http_conn::HOT_FILE_SLOTS];
+
+static unsigned long long hash_url(std::string_view url)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (char c : url)
+    {
+        h ^= (unsigned char)c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+//url最近作为小文件服务过
+static bool is_hot_file(std::string_view url)
+{
+    unsigned long long h = hash_url(url);
+    unsigned long long slot = hot_files[h & (http_conn::HOT_FILE_SLOTS - 1)].load(std::memory_order_relaxed);
+    if ((slot & ~0xFFFFULL) != (h & ~0xFFFFULL))
+    {
+        return false;
+    }
+    unsigned long long age = ((unsigned long long)time(NULL) - slot) & 0xFFFF;
+    return age <= http_conn::HOT_FILE_TTL;
+}
+
+//Accept-Encoding中出现gzip且q值不为0
+bool http_conn::accepts_gzip(const char *value)
+{
+    const char *p = value;
+    while ((p = strcasestr(p, "gzip")) != NULL)
+    {
+        const char *end = p + 4;
+        bool token_start = p == value || p[-1] == ' ' || p[-1] == ',' || p[-1] == '\t';
+        if (token_start && (*end == '\0' || *end == ',' || *end == ';' || *end == ' '))
+        {
+            const char *q = strstr(end, "q=");
+            const char *next = strchr(end, ',');
+            bool zero = q != NULL && (next == NULL || q < next) && strtod(q + 2, NULL) == 0;
+            return !zero;
+        }
+        p = end;
+    }
+    return false;
+}
+
+//If-None-Match是ETag列表或者"*"，弱比较即可
+static bool etag_matches(const char *header, const char *etag, size_t len)
+{
+    if (header == NULL)
+    {
+        return false;
+    }
+    header += strspn(header, " \t");
+    if (header[0] == '*')
+    {
+        return true;
+    }
+    return memmem(header, strlen(header), etag, len) != NULL;
+}
+
+static const char *status_title(int status)
+{
+    switch (status)
+    {
+    case 101:
+        return "Switching Protocols";
+    case 200:
+        return ok_200_title;
+    case 201:
+        return ok_201_title;
+    case 202:
+        return "Accepted";
+    case 204:
+        return "No Content";
+    case 301:
+        return redirect_301_title;
+    case 302:
+        return redirect_302_title;
+    case 303:
+        return "See Other";
+    case 304:
+        return "Not Modified";
+    case 307:
+        return "Temporary Redirect";
+    case 308:
+        return "Permanent Redirect";
+    case 400:
+        return error_400_title;
+    case 403:
+        return error_403_title;
+    case 404:
+        return error_404_title;
+    case 405:
+        return error_405_title;
+    case 413:
+        return error_413_title;
+    case 500:
+        return error_500_title;
+    case 502:
+        return error_502_title;
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Unknown";
+    }
+}
 
 //设置非阻塞
 int set_nonblocking(int fd)
@@ -21,11 +161,11 @@ int set_nonblocking(int fd)
     fcntl(fd, F_SETFL, old_option | O_NONBLOCK);
     return old_option;
 }
-//向内核epoll注册fd，同时设置fd非阻塞
-void addfd(int epollfd, int fd, bool one_shot)
+//向内核epoll注册fd，同时设置fd非阻塞；事件数据的高32位是连接槽位的代数，其他fd为0
+void addfd(int epollfd, int fd, bool one_shot, uint32_t generation)
 {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = (uint64_t)generation << 32 | (uint32_t)fd;
     event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
     if (one_shot)
     {
@@ -41,13 +181,17 @@ void removefd(int epollfd, int fd)
     close(fd);
 }
 //更改已注册fd的事件，可重置oneshot使之再次可触发
-void modfd(int epollfd, int fd, int ev)
+void modfd(int epollfd, int fd, int ev, uint32_t generation)
 {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = (uint64_t)generation << 32 | (uint32_t)fd;
     event.events = ev | EPOLLET | EPOLLRDHUP | EPOLLONESHOT;
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
+void http_conn::arm(int ev)
+{
+    modfd(m_epollfd, m_sockfd, ev, generation());
+}
 void closefd(int fd)
 {
     if(fd>=0)
@@ -55,51 +199,155 @@ void closefd(int fd)
         close(fd);
     }
 }
-void http_conn::init(int sockfd, const sockaddr_in &addr)
+//打包文件的描述符由所有连接共用，只放下引用
+void http_conn::release_file()
+{
+    if (!m_file_shared)
+    {
+        closefd(m_file_fd);
+    }
+    m_file_fd = -1;
+    m_file_shared = false;
+}
+
+void http_conn::init(int sockfd, const sockaddr *addr, socklen_t addr_len)
 {
     m_sockfd = sockfd;
-    m_addr = addr;
+    if (m_cold == NULL)
+    {
+        m_cold = new cold_state;
+    }
+    memset(&m_cold->peer, 0, sizeof(m_cold->peer));
+    memcpy(&m_cold->peer, addr, addr_len < sizeof(m_cold->peer) ? addr_len : sizeof(m_cold->peer));
+    m_limit_key = rate_limiter::key_of(addr);
     ++m_user_count;
-    addfd(m_epollfd, sockfd, true);
+    if (m_capture != NULL)
+    {
+        m_capture_id = m_capture->open_connection();
+    }
+    if (tls_conn::enabled())
+    {
+        //start失败时握手随之失败，连接在第一次处理时关闭
+        m_tls = new tls_conn;
+        m_tls->start(sockfd);
+    }
+    addfd(m_epollfd, sockfd, true, generation());
     init();
 }
 void http_conn::init()
 {
-    modfd(m_epollfd,m_sockfd,EPOLLIN);
+    init_request();
+    //重新注册EPOLLIN必须放在最后：之后reactor可能立刻把连接交给其他线程
+    arm(EPOLLIN);
+}
+void http_conn::init_request()
+{
+    if (m_cold == NULL)
+    {
+        m_cold = new cold_state;
+    }
     m_read_idx = 0;
     m_checked_idx = 0;
     m_line_start = 0;
 
     m_check_state = CHECK_REQUESTLINE;
+    m_request_parsed = false;
+    m_request_begun = false;
+    m_headers_start = 0;
+    m_headers_end = 0;
+
+    m_route = NULL;
+    m_route_result = NO_RESOURCE;
+    m_cold->params.count = 0;
 
     m_method = UNKOWN;
     m_url = NULL;
+    m_query = NULL;
     m_version = NULL;
     m_host = NULL;
     m_content_length = 0;
     m_linger = false;
+    m_upgrade_h2 = false;
+    m_h2_settings = NULL;
+    m_accept_gzip = false;
+    m_if_none_match = NULL;
+    m_upgrade_ws = false;
+    m_ws_version_ok = false;
+    m_ws_key = NULL;
+    m_ws_topic = NULL;
+    m_ws_topic_len = 0;
+    m_ws_pending = false;
+
+    m_chunked = false;
+    m_expect_continue = false;
+    m_body_start = 0;
+    m_body_remaining = 0;
+    m_chunk_state = CHUNK_SIZE;
+    m_chunk_remaining = 0;
+    m_body_sink = &m_cold->discard;
+    m_cold->memory.abort();
 
     m_write_idx=0;
+    m_headers_len=0;
     m_sent_idx=0;
     m_file_fd=-1;
     m_file_sent_sz=0;
+    m_file_offset=0;
+    m_file_ready=0;
+    m_file_shared=false;
+    m_packed_head=NULL;
+    m_packed_head_len=0;
+
+    m_content_type=NULL;
+    delete m_source;
+    m_source=NULL;
+    m_source_eof=false;
+    m_stream_pending=false;
+    m_stream_iov_cnt=0;
+    m_stream_iov_idx=0;
 }
 
 /* 
     读取非阻塞套接字，读完缓冲区时结束。
     返回true说明读取数据成功
     返回false说明读取出错或者对方关闭套接字
+    接收请求体时读缓冲区写满就停止读取，剩余数据留在内核中形成背压，
+    消费者处理完窗口后重新注册EPOLLIN再继续；能splice的请求体不经过读缓冲区。
 */
 bool http_conn::read()
 {
+    //握手由process()推进，这里不能消费套接字上的握手数据
+    if (m_tls != NULL && !m_tls->established())
+    {
+        return true;
+    }
+    if (m_h2 != NULL)
+    {
+        return m_h2->read();
+    }
+    if (m_ws != NULL)
+    {
+        return m_ws->read();
+    }
+    if (m_check_state == CHECK_CONTENT)
+    {
+        if (can_splice_body() && m_read_idx == m_checked_idx)
+        {
+            return true;
+        }
+        if (m_read_idx >= READ_BUFFER_SIZE)
+        {
+            return true;
+        }
+    }
     if (m_read_idx >= READ_BUFFER_SIZE)
     {
         return false;
     }
     int bytes_read = 0;
-    while (true)
+    while (m_read_idx < READ_BUFFER_SIZE)
     {
-        bytes_read = recv(m_sockfd, m_read_buf, READ_BUFFER_SIZE - m_read_idx, 0);
+        bytes_read = sock_recv(m_sockfd, m_tls, m_cold->read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx);
         if (bytes_read == -1)
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -108,7 +356,7 @@ bool http_conn::read()
             }
 
 #ifdef DEBUG
-            throw std::runtime_error("http_conn::read() error: bytes_read=recv(m_sockfd,m_read_buf,READ_BUFFER_SIZE-m_read_idx,0)");
+            throw std::runtime_error("http_conn::read() error: bytes_read=recv(m_sockfd,m_cold->read_buf,READ_BUFFER_SIZE-m_read_idx,0)");
 #endif
 
             return false;
@@ -117,6 +365,10 @@ bool http_conn::read()
         {
             return false; //对方关闭连接
         }
+        if (m_capture != NULL)
+        {
+            m_capture->data(m_capture_id, m_cold->read_buf + m_read_idx, bytes_read);
+        }
 
         m_read_idx += bytes_read;
     }
@@ -130,27 +382,27 @@ http_conn::LINE_STATE http_conn::parse_line()
 {
     for (m_checked_idx; m_checked_idx < m_read_idx; ++m_checked_idx)
     {
-        char tmp = m_read_buf[m_checked_idx];
+        char tmp = m_cold->read_buf[m_checked_idx];
         if (tmp == '\r')
         {
             if (m_checked_idx + 1 == m_read_idx)
             {
                 return LINE_OPEN;
             }
-            else if (m_read_buf[m_checked_idx + 1] == '\n')
+            else if (m_cold->read_buf[m_checked_idx + 1] == '\n')
             {
-                m_read_buf[m_checked_idx++] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
+                m_cold->read_buf[m_checked_idx++] = '\0';
+                m_cold->read_buf[m_checked_idx++] = '\0';
                 return LINE_OK;
             }
             return LINE_BAD;
         }
         else if (tmp == '\n')
         {
-            if (m_checked_idx - 1 >= 0 && m_read_buf[m_checked_idx - 1] == '\r')
+            if (m_checked_idx - 1 >= 0 && m_cold->read_buf[m_checked_idx - 1] == '\r')
             {
-                m_read_buf[m_checked_idx - 1] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
+                m_cold->read_buf[m_checked_idx - 1] = '\0';
+                m_cold->read_buf[m_checked_idx++] = '\0';
                 return LINE_OK;
             }
             return LINE_BAD;
@@ -159,6 +411,26 @@ http_conn::LINE_STATE http_conn::parse_line()
     return LINE_OPEN;
 }
 
+static const char *const method_names[http_conn::METHOD_NUM] = {
+    "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH"};
+
+http_conn::METHOD http_conn::parse_method(const char *text)
+{
+    for (int i = 0; i < METHOD_NUM; ++i)
+    {
+        if (strcmp(text, method_names[i]) == 0)
+        {
+            return (METHOD)i;
+        }
+    }
+    return UNKOWN;
+}
+
+const char *http_conn::method_name(METHOD method)
+{
+    return method >= 0 && method < METHOD_NUM ? method_names[method] : "UNKOWN";
+}
+
 http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
 {
     m_url = strpbrk(text, " \t");
@@ -167,11 +439,8 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
         return BAD_REQUEST;
     }
     *m_url++ = '\0';
-    if (strcasecmp(text, "GET") == 0)
-    {
-        m_method = GET;
-    }
-    else
+    m_method = parse_method(text);
+    if (m_method == UNKOWN)
     {
         return BAD_REQUEST;
     }
@@ -189,6 +458,11 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     {
         return BAD_REQUEST;
     }
+    m_query = strchr(m_url, '?');
+    if (m_query != NULL)
+    {
+        *m_query++ = '\0';
+    }
 
     m_version += strspn(m_version, " \t");
     if (strcasecmp(m_version, "HTTP/1.1") != 0)
@@ -197,6 +471,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     }
 
     m_check_state = CHECK_HEADER;
+    m_headers_start = m_checked_idx;
     return NO_REQUEST;
 }
 
@@ -204,12 +479,42 @@ http_conn::HTTP_CODE http_conn::parse_header(char *text)
 {
     if (text[0] == '\0')
     {
-        if (m_content_length != 0)
+        m_headers_end = text - m_cold->read_buf;
+        //同时出现两种长度表示时无法确定请求边界，拒绝以防请求走私
+        if (m_chunked && m_content_length != 0)
+        {
+            return BAD_REQUEST;
+        }
+        //带请求体的升级请求按HTTP/1.1处理，RFC 7540允许服务器忽略升级
+        if (m_upgrade_h2 && m_h2_settings != NULL && m_content_length == 0 && !m_chunked)
+        {
+            return UPGRADE_H2;
+        }
+        HTTP_CODE ret = route_request();
+        if (ret != NO_REQUEST)
+        {
+            //请求体不会被读取，应答后必须关闭连接
+            m_linger = m_linger && m_content_length == 0 && !m_chunked;
+            return ret;
+        }
+        if (m_content_length == 0 && !m_chunked)
+        {
+            return m_body_sink->finish() ? GET_REQUEST : INTERNAL_ERROR;
+        }
+        m_body_start = m_checked_idx;
+        if (READ_BUFFER_SIZE - m_body_start < MIN_BODY_WINDOW)
         {
-            m_check_state = CHECK_CONTENT;
-            return NO_REQUEST;
+            return BAD_REQUEST;
         }
-        return GET_REQUEST;
+        m_body_remaining = m_content_length;
+        m_check_state = CHECK_CONTENT;
+        if (m_expect_continue && m_read_idx == m_checked_idx)
+        {
+            //客户端在等待确认，发送缓冲区此时必然为空，短小的中间应答可以直接发出
+            static const char continue_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            sock_send(m_sockfd, m_tls, continue_100, sizeof(continue_100) - 1);
+        }
+        return NO_REQUEST;
     }
     else if (strncasecmp(text, "Connection:", 11) == 0)
     {
@@ -224,7 +529,63 @@ http_conn::HTTP_CODE http_conn::parse_header(char *text)
     {
         text += 15;
         text += strspn(text, " \t");
-        m_content_length = atol(text);
+        char *end = NULL;
+        m_content_length = strtoll(text, &end, 10);
+        if (end == text || m_content_length < 0)
+        {
+            return BAD_REQUEST;
+        }
+    }
+    else if (strncasecmp(text, "Expect:", 7) == 0)
+    {
+        text += 7;
+        text += strspn(text, " \t");
+        m_expect_continue = (strcasecmp(text, "100-continue") == 0);
+    }
+    else if (strncasecmp(text, "Transfer-Encoding:", 18) == 0)
+    {
+        text += 18;
+        text += strspn(text, " \t");
+        if (strcasecmp(text, "chunked") != 0)
+        {
+            return BAD_REQUEST;
+        }
+        m_chunked = true;
+    }
+    else if (strncasecmp(text, "Upgrade:", 8) == 0)
+    {
+        text += 8;
+        text += strspn(text, " \t");
+        m_upgrade_h2 = (strcasecmp(text, "h2c") == 0);
+        m_upgrade_ws = (strcasecmp(text, "websocket") == 0);
+    }
+    else if (strncasecmp(text, "Sec-WebSocket-Key:", 18) == 0)
+    {
+        text += 18;
+        text += strspn(text, " \t");
+        m_ws_key = text;
+    }
+    else if (strncasecmp(text, "Sec-WebSocket-Version:", 22) == 0)
+    {
+        text += 22;
+        text += strspn(text, " \t");
+        m_ws_version_ok = (strcmp(text, "13") == 0);
+    }
+    else if (strncasecmp(text, "HTTP2-Settings:", 15) == 0)
+    {
+        text += 15;
+        text += strspn(text, " \t");
+        m_h2_settings = text;
+    }
+    else if (strncasecmp(text, "Accept-Encoding:", 16) == 0)
+    {
+        m_accept_gzip = accepts_gzip(text + 16);
+    }
+    else if (strncasecmp(text, "If-None-Match:", 14) == 0)
+    {
+        text += 14;
+        text += strspn(text, " \t");
+        m_if_none_match = text;
     }
     else if (strncasecmp(text, "Host:", 5) == 0)
     {
@@ -235,36 +596,175 @@ http_conn::HTTP_CODE http_conn::parse_header(char *text)
 
     return NO_REQUEST;
 }
+/*
+    请求头解析完后匹配路由，并由路由的on_body回调为请求体选择消费者。
+    没有匹配的路由时请求体被丢弃，请求接收完后以404/405应答。
+*/
+http_conn::HTTP_CODE http_conn::route_request()
+{
+    m_body_sink = &m_cold->discard;
+    m_route = NULL;
+    m_route_result = NO_RESOURCE;
+    if (m_router == NULL)
+    {
+        return NO_REQUEST;
+    }
+    const route *r = NULL;
+    switch (m_router->match(m_method, m_url, r, m_cold->params))
+    {
+    case http_router::MATCH_OK:
+        m_route = r;
+        break;
+    case http_router::MATCH_BAD_METHOD:
+        m_route_result = BAD_METHOD;
+        return NO_REQUEST;
+    default:
+        return NO_REQUEST;
+    }
+    if (m_route->on_body != NULL)
+    {
+        return m_route->on_body(*this, m_cold->params);
+    }
+    return NO_REQUEST;
+}
+
 http_conn::HTTP_CODE http_conn::do_request()
 {
-    char file_path[FILENAME_LEN];
-    strcpy(file_path,doc_root);
-    int len=strlen(file_path);
+    if (m_route == NULL)
+    {
+        return m_route_result;
+    }
+    return m_route->handler(*this, m_cold->params);
+}
+
+bool http_conn::receive_to_file(const char *path)
+{
+    if (!m_cold->file.open(path))
+    {
+        return false;
+    }
+    m_body_sink = &m_cold->file;
+    return true;
+}
+
+void http_conn::receive_to_memory(size_t limit)
+{
+    m_cold->memory.open(limit);
+    m_body_sink = &m_cold->memory;
+}
 
-    if(strcmp(m_url,"/")==0)
+//HTTP/2的流没有自己的套接字，无法由proxy_exchange驱动
+http_conn::HTTP_CODE http_conn::proxy(upstream_pool *pool)
+{
+    if (pool == NULL || m_sockfd < 0)
     {
-        strncpy( file_path +len, "/index.html", FILENAME_LEN - len - 1 );
+        return BAD_GATEWAY;
     }
-    else
+    m_proxy = new proxy_exchange(*this, *pool);
+    if (!m_proxy->prepare())
+    {
+        delete m_proxy;
+        m_proxy = NULL;
+        return BAD_GATEWAY;
+    }
+    return PROXY_REQUEST;
+}
+
+//HTTP/2的流不能升级；带请求体的升级请求无法确定帧从哪里开始，一并拒绝
+http_conn::HTTP_CODE http_conn::websocket(std::string_view topic)
+{
+    if (m_ws_hub == NULL || m_sockfd < 0 || m_method != GET || !m_upgrade_ws || !m_ws_version_ok ||
+        m_ws_key == NULL || m_ws_key[0] == '\0' || m_content_length != 0 || m_chunked || topic.empty())
+    {
+        return BAD_REQUEST;
+    }
+    m_ws_topic = topic.data();
+    m_ws_topic_len = topic.size();
+    return WEBSOCKET_REQUEST;
+}
+
+bool http_conn::respond(int status, const char *content_type, const char *body, int len)
+{
+    m_write_idx = 0;
+    if (add_status_line(status, status_title(status)) &&
+        (content_type == NULL || add_content_type(content_type)) &&
+        add_headers(len) &&
+        len < WRITE_BUFFER_SIZE - m_write_idx)
+    {
+        memcpy(m_cold->write_buf + m_write_idx, body, len);
+        m_write_idx += len;
+        return true;
+    }
+    m_write_idx = 0;
+    return false;
+}
+
+bool http_conn::redirect(int status, const char *location)
+{
+    m_write_idx = 0;
+    if (add_status_line(status, status_title(status)) &&
+        add_response("Location: %s\r\n", location) &&
+        add_headers(0))
     {
-        strncpy( file_path +len, m_url, FILENAME_LEN - len - 1 );
+        return true;
     }
-    
+    m_write_idx = 0;
+    return false;
+}
+
+http_conn::HTTP_CODE http_conn::stream(const char *content_type, body_source *source)
+{
+    delete m_source;
+    m_source = source;
+    m_content_type = content_type;
+    return STREAM_REQUEST;
+}
+
+http_conn::HTTP_CODE http_conn::serve_file(const char *file_path)
+{
     #ifdef DEBUG
         printf("url_path:%s\n",file_path);
     #endif
-    if( stat( file_path, &m_file_stat ) < 0 )
+    if( stat( file_path, &m_cold->file_stat ) < 0 )
     {
         return NO_RESOURCE;
     }
 
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) )
+    if ( ! ( m_cold->file_stat.st_mode & S_IROTH ) )
     {
         return FORBIDDEN_REQUEST;
     }
-    if ( S_ISDIR( m_file_stat.st_mode ) )
+    if ( S_ISDIR( m_cold->file_stat.st_mode ) )
     {
-        return BAD_REQUEST;
+        if( !m_dir_listing )
+        {
+            return BAD_REQUEST;
+        }
+        //目录url补上末尾的'/'，列表中的相对链接才能正确解析
+        int url_len = strlen( m_url );
+        if( m_url[url_len - 1] != '/' )
+        {
+            char location[FILENAME_LEN];
+            if( url_len + 2 > FILENAME_LEN )
+            {
+                return BAD_REQUEST;
+            }
+            memcpy( location, m_url, url_len );
+            location[url_len] = '/';
+            location[url_len + 1] = '\0';
+            return redirect( 301, location ) ? RESPONSE_READY : INTERNAL_ERROR;
+        }
+        dir_listing_source *listing = new dir_listing_source;
+        if( !listing->open( file_path, m_url ) )
+        {
+            delete listing;
+            return INTERNAL_ERROR;
+        }
+        return stream( "text/html", listing );
+    }
+    if( m_method == HEAD )
+    {
+        return FILE_REQUEST;
     }
     int fd = open( file_path, O_RDONLY );
     if(fd<0)
@@ -275,61 +775,313 @@ http_conn::HTTP_CODE http_conn::do_request()
     return FILE_REQUEST;
 }
 
-http_conn::HTTP_CODE http_conn::parse_content(char *text)
+http_conn::HTTP_CODE http_conn::serve_packed(const content_pack &pack)
 {
-    if (m_read_idx >= (m_content_length + m_checked_idx))
+    const pack_entry *e = pack.find(m_url, strlen(m_url));
+    if (e == NULL)
     {
-        text[m_content_length] = '\0';
-        return GET_REQUEST;
+        return NO_RESOURCE;
     }
-
-    return NO_REQUEST;
+    const pack_variant *v = &e->variants[e->variant_count > 1 && m_accept_gzip ? 1 : 0];
+    if (etag_matches(m_if_none_match, pack.at(v->etag_off), v->etag_len))
+    {
+        m_write_idx = 0;
+        if (add_status_line(304, status_title(304)) &&
+            add_response("ETag: %.*s\r\n", (int)v->etag_len, pack.at(v->etag_off)) &&
+            (e->variant_count < 2 || add_response("Vary: Accept-Encoding\r\n")) &&
+            add_linger() &&
+            add_blank_line())
+        {
+            return RESPONSE_READY;
+        }
+        m_write_idx = 0;
+        return INTERNAL_ERROR;
+    }
+    m_packed_head = pack.at(v->head_off);
+    m_packed_head_len = v->head_len;
+    m_cold->file_stat.st_size = v->body_len;
+    if (m_method != HEAD && v->body_len > 0)
+    {
+        m_file_fd = pack.fd();
+        m_file_shared = true;
+        m_file_offset = v->body_off;
+        //锁在内存中的打包文件不用探测是否驻留
+        if (pack.locked())
+        {
+            m_file_ready = v->body_off + v->body_len;
+        }
+    }
+    return FILE_REQUEST;
 }
 
-http_conn::HTTP_CODE http_conn::process_read()
+//把窗口中从m_checked_idx开始的len字节交给消费者
+bool http_conn::consume_body(int len)
 {
-    LINE_STATE line_state = LINE_OK;
-    HTTP_CODE ret;
+    if (len <= 0)
+    {
+        return true;
+    }
+    if (!m_body_sink->write(m_cold->read_buf + m_checked_idx, len))
+    {
+        return false;
+    }
+    m_checked_idx += len;
+    return true;
+}
 
-    while (((m_check_state == CHECK_CONTENT) && (line_state == LINE_OK)) ||
-           ((line_state = parse_line()) == LINE_OK))
+/*
+    消费窗口中已读到的请求体，然后把未消费的部分移到窗口起点。
+    返回GET_REQUEST表示请求体已完整接收，NO_REQUEST表示还需要继续读取。
+*/
+http_conn::HTTP_CODE http_conn::parse_content()
+{
+    HTTP_CODE ret = NO_REQUEST;
+    if (m_chunked)
     {
-        char *text = m_read_buf + m_line_start;
-        m_line_start = m_checked_idx;
+        ret = parse_chunked();
+    }
+    else
+    {
+        long long avail = m_read_idx - m_checked_idx;
+        int len = (int)(avail < m_body_remaining ? avail : m_body_remaining);
+        if (!consume_body(len))
+        {
+            return m_body_sink->too_large() ? PAYLOAD_TOO_LARGE : INTERNAL_ERROR;
+        }
+        m_body_remaining -= len;
+        if (m_body_remaining > 0 && can_splice_body())
+        {
+            ret = splice_body();
+        }
+        if (ret == NO_REQUEST && m_body_remaining == 0)
+        {
+            ret = GET_REQUEST;
+        }
+    }
+    if (ret != NO_REQUEST && ret != GET_REQUEST)
+    {
+        return ret;
+    }
 
-#ifdef DEBUG
-        printf("got 1 http line: %s\n", text);
-#endif
+    int left = m_read_idx - m_checked_idx;
+    if (m_checked_idx > m_body_start)
+    {
+        memmove(m_cold->read_buf + m_body_start, m_cold->read_buf + m_checked_idx, left);
+        m_read_idx = m_body_start + left;
+        m_checked_idx = m_body_start;
+    }
+    if (ret == GET_REQUEST)
+    {
+        //请求体之后多出来的数据无法作为下一个请求处理，不保持连接
+        m_linger = m_linger && (left == 0);
+        return m_body_sink->finish() ? GET_REQUEST : INTERNAL_ERROR;
+    }
+    return NO_REQUEST;
+}
 
-        switch (m_check_state)
+/*
+    增量解码分块编码的请求体，窗口中数据不足时保留解码状态，
+    等下一次读到数据后从断点继续。
+*/
+http_conn::HTTP_CODE http_conn::parse_chunked()
+{
+    while (m_chunk_state != CHUNK_DONE)
+    {
+        char *start = m_cold->read_buf + m_checked_idx;
+        int avail = m_read_idx - m_checked_idx;
+        switch (m_chunk_state)
         {
-        case CHECK_REQUESTLINE:
-            ret = parse_request_line(text);
-            if (ret == BAD_REQUEST)
+        case CHUNK_SIZE:
+        case CHUNK_TRAILER:
+        {
+            char *nl = (char *)memchr(start, '\n', avail);
+            if (nl == NULL)
             {
-                return BAD_REQUEST;
+                return avail > MAX_CHUNK_LINE ? BAD_REQUEST : NO_REQUEST;
             }
-            break;
-        case CHECK_HEADER:
-            ret = parse_header(text);
-            if (ret == BAD_REQUEST)
+            if (nl == start || nl[-1] != '\r')
             {
                 return BAD_REQUEST;
             }
-            else if (ret == GET_REQUEST)
+            int line_len = nl - start - 1;
+            m_checked_idx += line_len + 2;
+            if (m_chunk_state == CHUNK_TRAILER)
             {
-                return do_request();
-            }
-            break;
+                //trailer头部忽略，空行表示请求体结束
+                if (line_len == 0)
+                {
+                    m_chunk_state = CHUNK_DONE;
+                }
+                break;
+            }
+            long long size = 0;
+            int i = 0;
+            for (; i < line_len; ++i)
+            {
+                char c = start[i];
+                int digit;
+                if (c >= '0' && c <= '9')
+                    digit = c - '0';
+                else if (c >= 'a' && c <= 'f')
+                    digit = c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F')
+                    digit = c - 'A' + 10;
+                else
+                    break;
+                if (size > (0x7fffffffffffffffLL >> 4))
+                {
+                    return BAD_REQUEST;
+                }
+                size = (size << 4) | digit;
+            }
+            //块扩展（;name=value）忽略
+            if (i == 0 || (i < line_len && start[i] != ';' && start[i] != ' ' && start[i] != '\t'))
+            {
+                return BAD_REQUEST;
+            }
+            m_chunk_remaining = size;
+            m_chunk_state = size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+            break;
+        }
+        case CHUNK_DATA:
+        {
+            int len = (int)(avail < m_chunk_remaining ? avail : m_chunk_remaining);
+            if (len == 0)
+            {
+                return NO_REQUEST;
+            }
+            if (!consume_body(len))
+            {
+                return m_body_sink->too_large() ? PAYLOAD_TOO_LARGE : INTERNAL_ERROR;
+            }
+            m_chunk_remaining -= len;
+            if (m_chunk_remaining == 0)
+            {
+                m_chunk_state = CHUNK_DATA_END;
+            }
+            break;
+        }
+        case CHUNK_DATA_END:
+            if (avail < 2)
+            {
+                return NO_REQUEST;
+            }
+            if (start[0] != '\r' || start[1] != '\n')
+            {
+                return BAD_REQUEST;
+            }
+            m_checked_idx += 2;
+            m_chunk_state = CHUNK_SIZE;
+            break;
+        default:
+            return INTERNAL_ERROR;
+        }
+    }
+    return GET_REQUEST;
+}
 
-        case CHECK_CONTENT:
-            ret = parse_content(text);
-            if (ret == GET_REQUEST)
+/*
+    Content-Length请求体的剩余部分经管道从套接字splice到文件，不经过用户态。
+    写文件是阻塞的，磁盘慢时本线程停在这里，套接字不再被读取，形成背压。
+*/
+http_conn::HTTP_CODE http_conn::splice_body()
+{
+    if (m_cold->pipe[0] < 0 && pipe2(m_cold->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        m_cold->pipe[0] = m_cold->pipe[1] = -1;
+        return INTERNAL_ERROR;
+    }
+    int file_fd = m_body_sink->splice_fd();
+    while (m_body_remaining > 0)
+    {
+        size_t want = m_body_remaining < 65536 ? (size_t)m_body_remaining : 65536;
+        ssize_t n = splice(m_sockfd, NULL, m_cold->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+        {
+            return CLOSED_CONNECTION;
+        }
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return NO_REQUEST;
+            }
+            return CLOSED_CONNECTION;
+        }
+        m_body_remaining -= n;
+        while (n > 0)
+        {
+            ssize_t m = splice(m_cold->pipe[0], NULL, file_fd, NULL, n, SPLICE_F_MOVE);
+            if (m <= 0)
+            {
+                return INTERNAL_ERROR;
+            }
+            n -= m;
+        }
+    }
+    return NO_REQUEST;
+}
+
+/*
+    stop_before_body为true时，请求头解析完且请求体预测会阻塞则先返回NO_REQUEST，
+    由调用者决定在哪个线程上继续消费请求体。
+*/
+http_conn::HTTP_CODE http_conn::process_read(bool stop_before_body)
+{
+    LINE_STATE line_state = LINE_OK;
+    HTTP_CODE ret;
+
+    //以HTTP/2连接前言开头的连接（prior knowledge）
+    if (m_check_state == CHECK_REQUESTLINE && m_checked_idx == 0 && m_read_idx > 0)
+    {
+        static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+        int n = m_read_idx < (int)sizeof(preface) - 1 ? m_read_idx : (int)sizeof(preface) - 1;
+        if (memcmp(m_cold->read_buf, preface, n) == 0)
+        {
+            return n == (int)sizeof(preface) - 1 ? UPGRADE_H2 : NO_REQUEST;
+        }
+    }
+
+    while (((m_check_state == CHECK_CONTENT) && (line_state == LINE_OK)) ||
+           ((line_state = parse_line()) == LINE_OK))
+    {
+        char *text = m_cold->read_buf + m_line_start;
+        m_line_start = m_checked_idx;
+
+#ifdef DEBUG
+        printf("got 1 http line: %s\n", text);
+#endif
+
+        switch (m_check_state)
+        {
+        case CHECK_REQUESTLINE:
+            ret = parse_request_line(text);
+            if (ret == BAD_REQUEST)
+            {
+                return BAD_REQUEST;
+            }
+            break;
+        case CHECK_HEADER:
+            ret = parse_header(text);
+            if (ret != NO_REQUEST)
+            {
+                return ret;
+            }
+            if (stop_before_body && m_check_state == CHECK_CONTENT && predict_body_blocking())
             {
-                return do_request();
+                return NO_REQUEST;
             }
-            line_state = LINE_OPEN;
             break;
+
+        case CHECK_CONTENT:
+            ret = parse_content();
+            if (ret != NO_REQUEST && ret != GET_REQUEST)
+            {
+                //请求体没有读完，连接上的后续数据无法再解析
+                m_body_sink->abort();
+                m_linger = false;
+            }
+            return ret;
         default:
             return INTERNAL_ERROR;
         }
@@ -356,6 +1108,14 @@ bool http_conn::add_content_length(int length)
 {
     return add_response("Content-Length: %d\r\n", length);
 }
+bool http_conn::add_content_type(const char *type)
+{
+    return add_response("Content-Type: %s\r\n", type);
+}
+bool http_conn::add_chunked()
+{
+    return add_response("Transfer-Encoding: chunked\r\n");
+}
 bool http_conn::add_content(const char *content)
 {
     return add_response(content);
@@ -366,7 +1126,12 @@ bool http_conn::add_linger()
 }
 bool http_conn::add_blank_line()
 {
-    return add_response("\r\n");
+    if (!add_response("\r\n"))
+    {
+        return false;
+    }
+    m_headers_len = m_write_idx;
+    return true;
 }
 
 bool http_conn::add_response(const char *format, ...)
@@ -377,7 +1142,7 @@ bool http_conn::add_response(const char *format, ...)
     }
     va_list arg_list;
     va_start(arg_list, format);
-    int len = vsnprintf(m_write_buf + m_write_idx,
+    int len = vsnprintf(m_cold->write_buf + m_write_idx,
                         WRITE_BUFFER_SIZE - m_write_idx, format, arg_list);
     va_end(arg_list);
     if (len < WRITE_BUFFER_SIZE - m_write_idx)
@@ -396,6 +1161,57 @@ bool http_conn::process_write(HTTP_CODE code)
     bool ret;
     switch (code)
     {
+    case RESPONSE_READY:
+        if(m_write_idx==0)
+        {
+            return false;
+        }
+        break;
+    case BAD_METHOD:
+        ret=add_status_line(405,error_405_title)&&
+            add_headers(strlen(error_405_form))&&
+            add_content(error_405_form);
+        if(!ret)
+        {
+            m_write_idx=0;
+            return false;
+        }
+        break;
+    case PROXY_REQUEST:
+        //应答由上游产生，write()把连接交给m_proxy
+        break;
+    case WEBSOCKET_REQUEST:
+        ret=add_status_line(101,status_title(101))&&
+            add_response("Upgrade: websocket\r\nConnection: Upgrade\r\n")&&
+            add_response("Sec-WebSocket-Accept: %s\r\n",ws_session::accept_key(m_ws_key).c_str())&&
+            add_blank_line();
+        if(!ret)
+        {
+            m_write_idx=0;
+            return false;
+        }
+        m_ws_pending=true;
+        break;
+    case BAD_GATEWAY:
+        ret=add_status_line(502,error_502_title)&&
+            add_headers(strlen(error_502_form))&&
+            add_content(error_502_form);
+        if(!ret)
+        {
+            m_write_idx=0;
+            return false;
+        }
+        break;
+    case PAYLOAD_TOO_LARGE:
+        ret=add_status_line(413,error_413_title)&&
+            add_headers(strlen(error_413_form))&&
+            add_content(error_413_form);
+        if(!ret)
+        {
+            m_write_idx=0;
+            return false;
+        }
+        break;
     case INTERNAL_ERROR:
         ret=add_status_line(500,error_500_title)&&
             add_headers(strlen(error_500_form))&&
@@ -437,6 +1253,30 @@ bool http_conn::process_write(HTTP_CODE code)
             return false;
         }
         break;
+    case CREATED_REQUEST:
+        ret=add_status_line(201,ok_201_title)&&
+            add_headers(strlen(ok_201_form))&&
+            add_content(ok_201_form);
+        if(!ret)
+        {
+            m_write_idx=0;
+            return false;
+        }
+        break;
+    case STREAM_REQUEST:
+        ret=add_status_line(200,ok_200_title)&&
+            (m_content_type==NULL||add_content_type(m_content_type))&&
+            add_chunked()&&
+            add_linger()&&
+            add_blank_line();
+        if(!ret)
+        {
+            delete m_source;
+            m_source=NULL;
+            m_write_idx=0;
+            return false;
+        }
+        break;
     case FILE_REQUEST:
         ret=add_status_line( 200, ok_200_title );
         if(!ret)
@@ -444,9 +1284,16 @@ bool http_conn::process_write(HTTP_CODE code)
             m_write_idx=0;
             return false;
         }
-        if(m_file_stat.st_size!=0)
+        if(m_packed_head!=NULL)
+        {
+            //长度、类型和ETag都已预先生成
+            ret=add_response("%.*s",m_packed_head_len,m_packed_head)&&
+                add_linger()&&
+                add_blank_line();
+        }
+        else if(m_cold->file_stat.st_size!=0)
         {
-            ret=add_headers( m_file_stat.st_size );
+            ret=add_headers( m_cold->file_stat.st_size );
         }
         else
         {
@@ -463,40 +1310,566 @@ bool http_conn::process_write(HTTP_CODE code)
         m_write_idx=0;
         return false;
     }
+    //HEAD请求只发送应答头
+    if(m_method==HEAD)
+    {
+        m_write_idx=m_headers_len;
+        release_file();
+        delete m_source;
+        m_source=NULL;
+    }
     return true;
 }
 
+/*
+    预测请求在reactor上处理是否可能阻塞。
+    最近没有作为小文件服务过的url交给线程池；
+    第一次由线程池完成stat/open，之后短时间内的请求即可就地处理。
+*/
+bool http_conn::predict_blocking()
+{
+    return !is_hot_file(m_url);
+}
+
+//较大的、分块的或者要写入文件的请求体在线程池上消费
+bool http_conn::predict_body_blocking()
+{
+    return m_chunked || m_content_length > INLINE_FILE_LIMIT || m_body_sink != &m_cold->discard;
+}
+
+void http_conn::remember_hot_file()
+{
+    if (m_cold->file_stat.st_size > INLINE_FILE_LIMIT)
+    {
+        return;
+    }
+    unsigned long long h = hash_url(m_url);
+    unsigned long long slot = (h & ~0xFFFFULL) | ((unsigned long long)time(NULL) & 0xFFFF);
+    hot_files[h & (HOT_FILE_SLOTS - 1)].store(slot, std::memory_order_relaxed);
+}
+
+/*
+    在reactor线程上完成解析、do_request和第一次写，省去线程池的两次跨线程交接。
+    adaptive为true时，预测会阻塞的请求保留解析结果后交给线程池。
+*/
+http_conn::INLINE_RESULT http_conn::process_inline(bool adaptive)
+{
+    //握手的公钥运算较重，自适应模式下交给线程池
+    if (m_tls != NULL && !m_tls->established())
+    {
+        if (adaptive)
+        {
+            return INLINE_DEFER;
+        }
+        return continue_handshake() ? INLINE_DONE : INLINE_CLOSE;
+    }
+    //HTTP/2连接上的流随时可能命中会阻塞的处理器，自适应模式下一律交给线程池
+    if (m_h2 != NULL)
+    {
+        if (adaptive)
+        {
+            return INLINE_DEFER;
+        }
+        return run_h2() ? INLINE_DONE : INLINE_CLOSE;
+    }
+    if (adaptive && m_check_state == CHECK_CONTENT && predict_body_blocking())
+    {
+        return INLINE_DEFER;
+    }
+    HTTP_CODE read_ret = process_read(adaptive);
+    if (read_ret == CLOSED_CONNECTION)
+    {
+        return INLINE_CLOSE;
+    }
+    if (read_ret == UPGRADE_H2)
+    {
+        if (!start_h2(m_check_state == CHECK_HEADER))
+        {
+            return INLINE_CLOSE;
+        }
+        if (adaptive)
+        {
+            return INLINE_DEFER;
+        }
+        return run_h2() ? INLINE_DONE : INLINE_CLOSE;
+    }
+    if (read_ret == NO_REQUEST)
+    {
+        if (adaptive && m_check_state == CHECK_CONTENT && predict_body_blocking())
+        {
+            return INLINE_DEFER;
+        }
+        if (m_tls != NULL && m_tls->pending())
+        {
+            return read() ? process_inline(adaptive) : INLINE_CLOSE;
+        }
+        arm(EPOLLIN);
+        return INLINE_DONE;
+    }
+    if (read_ret == GET_REQUEST)
+    {
+        if (adaptive && m_route != NULL && m_route->may_block && predict_blocking())
+        {
+            m_request_parsed = true;
+            return INLINE_DEFER;
+        }
+        read_ret = do_request();
+        if (read_ret == FILE_REQUEST)
+        {
+            remember_hot_file();
+        }
+    }
+    if (!process_write(read_ret))
+    {
+        return INLINE_CLOSE;
+    }
+    return write() ? INLINE_DONE : INLINE_CLOSE;
+}
+
 void http_conn::process()
 {
-    HTTP_CODE read_ret = process_read();
+    if (m_tls != NULL && !m_tls->established())
+    {
+        if (!continue_handshake())
+        {
+            close_conn();
+        }
+        return;
+    }
+    if (m_h2 != NULL)
+    {
+        if (!run_h2())
+        {
+            close_conn();
+        }
+        return;
+    }
+    HTTP_CODE read_ret = m_request_parsed ? GET_REQUEST : process_read();
+    if (read_ret == CLOSED_CONNECTION)
+    {
+        close_conn();
+        return;
+    }
+    if (read_ret == UPGRADE_H2)
+    {
+        if (!start_h2(m_check_state == CHECK_HEADER) || !run_h2())
+        {
+            close_conn();
+        }
+        return;
+    }
     //如果还没有解析出request继续读取完整请求
     if (read_ret == NO_REQUEST)
     {
+        //TLS库中缓存的已解密数据不会再触发EPOLLIN，要先读出来
+        if (m_tls != NULL && m_tls->pending())
+        {
+            if (read())
+            {
+                process();
+            }
+            else
+            {
+                close_conn();
+            }
+            return;
+        }
         //重置使得oneshot可重新触发
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+        arm(EPOLLIN);
         return;
     }
-    bool write_ret = process_write(read_ret);
+    if (read_ret == GET_REQUEST)
+    {
+        read_ret = do_request();
+        if (read_ret == FILE_REQUEST)
+        {
+            remember_hot_file();
+        }
+    }
+    process_write(read_ret);
+
+    /*
+        乐观写：发送缓冲区通常是空的，直接在工作线程上发送，
+        只有遇到EAGAIN时write()才注册EPOLLOUT交回reactor；
+        长连接写完后由write()在同一步重新注册EPOLLIN。
+        EPOLLONESHOT保证重新注册之前只有本线程持有该连接，
+        因此写失败时也由本线程关闭连接。
+    */
+    if (!write())
+    {
+        close_conn();
+    }
+}
+/*
+    推进TLS握手，按握手需要的方向重新注册事件；握手完成后等待第一个请求。
+    返回false表示握手失败，由调用者关闭连接。
+*/
+bool http_conn::continue_handshake()
+{
+    switch (m_tls->handshake())
+    {
+    case tls_conn::HANDSHAKE_WANT_WRITE:
+        arm(EPOLLOUT);
+        return true;
+    case tls_conn::HANDSHAKE_WANT_READ:
+    case tls_conn::HANDSHAKE_DONE:
+        arm(EPOLLIN);
+        return true;
+    default:
+        return false;
+    }
+}
+
+//TLS连接上套接字里是密文，请求体只能经过读缓冲区解密
+bool http_conn::can_splice_body() const
+{
+    //录制时请求体必须经过读缓冲区
+    return !m_chunked && m_tls == NULL && m_capture == NULL && m_body_sink->splice_fd() >= 0;
+}
+
+/*
+    把连接交给HTTP/2会话。upgrade为true时当前请求是带Upgrade: h2c的请求，
+    它成为流1，请求之后已读到的字节交给会话；否则读缓冲区从连接前言开始。
+*/
+bool http_conn::start_h2(bool upgrade)
+{
+    m_h2 = new h2_session(m_sockfd, m_tls, m_limit_key);
+    if (upgrade)
+    {
+        return m_h2->start_upgrade(*this, m_h2_settings, m_cold->read_buf + m_checked_idx, m_read_idx - m_checked_idx);
+    }
+    return m_h2->start(m_cold->read_buf, m_read_idx);
+}
+
+//处理已收到的帧并尽量发出输出，之后按是否还有待发数据重新注册事件
+bool http_conn::run_h2()
+{
+    bool ok = m_h2->process();
+    while (ok && m_tls != NULL && m_tls->pending())
+    {
+        ok = m_h2->read() && m_h2->process();
+    }
+    if (!ok || !m_h2->write())
+    {
+        return false;
+    }
+    arm(EPOLLIN | (m_h2->want_write() ? (int)EPOLLOUT : 0));
+    return true;
+}
+
+//在reactor上创建会话，请求头之后已经到达的数据是最早的帧
+bool http_conn::start_websocket()
+{
+    m_ws_pending = false;
+    m_ws = new ws_session(*this, m_sockfd, m_tls, *m_ws_hub, std::string(m_ws_topic, m_ws_topic_len),
+                          m_cold->read_buf + m_checked_idx, m_read_idx - m_checked_idx);
+    return m_ws->read();
+}
+
+/*
+    推进转发。应答头发出之前失败的以502应答；转发完成后与普通应答一样决定是否保持连接。
+*/
+bool http_conn::write_proxy()
+{
+    proxy_exchange::RESULT ret = m_proxy->drive();
+    if (ret == proxy_exchange::PROXY_PENDING)
+    {
+        return true;
+    }
+    delete m_proxy;
+    m_proxy = NULL;
+    if (ret == proxy_exchange::PROXY_DONE)
+    {
+        return finish_response();
+    }
+    if (ret == proxy_exchange::PROXY_BAD_GATEWAY && process_write(BAD_GATEWAY))
+    {
+        return write();
+    }
+    return false;
+}
+
+/*
+    准备下一批流式应答：把生产者的若干数据段合并成一个块，
+    块大小行和块尾放在数据段两侧的iovec里，第一批同时带上应答头。
+*/
+bool http_conn::fill_stream_batch()
+{
+    int cnt=0;
+    if(m_sent_idx<m_write_idx)
+    {
+        m_cold->stream_iov[cnt].iov_base=m_cold->write_buf+m_sent_idx;
+        m_cold->stream_iov[cnt++].iov_len=m_write_idx-m_sent_idx;
+        m_sent_idx=m_write_idx;
+    }
+    int head=cnt++;
+    size_t bytes=0;
+    while(!m_source_eof&&cnt<STREAM_IOV_MAX+2&&bytes<STREAM_FLUSH_BYTES)
+    {
+        int n=m_source->produce(m_cold->stream_iov+cnt,STREAM_IOV_MAX+2-cnt,m_source_eof);
+        if(n<0)
+        {
+            return false;
+        }
+        if(n==0)
+        {
+            break;
+        }
+        for(int i=0;i<n;++i)
+        {
+            bytes+=m_cold->stream_iov[cnt+i].iov_len;
+        }
+        cnt+=n;
+        m_stream_pending=true;
+    }
+    if(!m_stream_pending&&!m_source_eof)
+    {
+        return false;
+    }
+    if(bytes>0)
+    {
+        int len=snprintf(m_cold->chunk_head,sizeof(m_cold->chunk_head),"%zx\r\n",bytes);
+        m_cold->stream_iov[head].iov_base=m_cold->chunk_head;
+        m_cold->stream_iov[head].iov_len=len;
+        m_cold->stream_iov[cnt].iov_base=(void *)"\r\n";
+        m_cold->stream_iov[cnt++].iov_len=2;
+    }
+    else
+    {
+        m_cold->stream_iov[head].iov_len=0;
+    }
+    if(m_source_eof)
+    {
+        m_cold->stream_iov[cnt].iov_base=(void *)"0\r\n\r\n";
+        m_cold->stream_iov[cnt++].iov_len=5;
+    }
+    m_stream_iov_cnt=cnt;
+    m_stream_iov_idx=0;
+    return true;
+}
 
-    /*触发写事件*/
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+/*
+    发送流式应答。只有上一批完全发出后才向生产者要下一批数据，
+    遇到EAGAIN就停下等EPOLLOUT，对端接收慢时生产者也随之放慢。
+*/
+bool http_conn::write_stream()
+{
+    while(true)
+    {
+        if(m_stream_iov_idx==m_stream_iov_cnt)
+        {
+            if(m_stream_pending)
+            {
+                m_source->consumed();
+                m_stream_pending=false;
+            }
+            if(m_source_eof)
+            {
+                break;
+            }
+            if(!fill_stream_batch())
+            {
+                //应答头可能已经发出，只能断开连接让客户端发现应答不完整
+                return false;
+            }
+        }
+        int ret=sock_writev(m_sockfd,m_tls,m_cold->stream_iov+m_stream_iov_idx,m_stream_iov_cnt-m_stream_iov_idx);
+        if(ret==-1)
+        {
+            if(errno==EAGAIN||errno==EWOULDBLOCK)
+            {
+                arm(EPOLLOUT);
+                return true;
+            }
+            return false;
+        }
+        while(m_stream_iov_idx<m_stream_iov_cnt&&(size_t)ret>=m_cold->stream_iov[m_stream_iov_idx].iov_len)
+        {
+            ret-=m_cold->stream_iov[m_stream_iov_idx++].iov_len;
+        }
+        if(ret>0)
+        {
+            m_cold->stream_iov[m_stream_iov_idx].iov_base=(char *)m_cold->stream_iov[m_stream_iov_idx].iov_base+ret;
+            m_cold->stream_iov[m_stream_iov_idx].iov_len-=ret;
+        }
+    }
+    delete m_source;
+    m_source=NULL;
+    return finish_response();
 }
+
+//读缓冲区中开始了一个新的HTTP/1.1请求时返回true，每个请求只返回一次；
+//HTTP/2的流、转发中和TLS握手中的连接不算新请求
+bool http_conn::begin_request()
+{
+    if (m_request_begun || m_h2 != NULL || m_proxy != NULL || m_ws != NULL || m_check_state != CHECK_REQUESTLINE ||
+        (m_tls != NULL && !m_tls->established()))
+    {
+        return false;
+    }
+    m_request_begun = true;
+    return true;
+}
+
+bool http_conn::reject(const char *response, int len)
+{
+    if (len > WRITE_BUFFER_SIZE)
+    {
+        return false;
+    }
+    memcpy(m_cold->write_buf, response, len);
+    m_write_idx = len;
+    m_headers_len = len;
+    m_sent_idx = 0;
+    m_linger = false;
+    return write();
+}
+
+/*
+    请求还在读缓冲区中没有解析，只看请求行匹配路由：不会阻塞的处理器和最近服务过的小文件优先，
+    可能阻塞的处理器（冷文件）排在后面；看不出来的按普通优先级。
+*/
+TASK_PRIORITY http_conn::priority()
+{
+    if (m_request_parsed)
+    {
+        if (m_route != NULL && !m_route->may_block)
+        {
+            return PRIORITY_HIGH;
+        }
+        return predict_blocking() ? PRIORITY_LOW : PRIORITY_HIGH;
+    }
+    if (m_router == NULL || m_check_state != CHECK_REQUESTLINE || !can_shed())
+    {
+        return PRIORITY_NORMAL;
+    }
+    std::string_view line(m_cold->read_buf, m_read_idx);
+    size_t sp = line.find(' ');
+    if (sp == std::string_view::npos)
+    {
+        return PRIORITY_NORMAL;
+    }
+    int method = 0;
+    while (method < METHOD_NUM && line.substr(0, sp) != method_names[method])
+    {
+        ++method;
+    }
+    size_t end = line.find_first_of(" ?", sp + 1);
+    if (method == METHOD_NUM || end == std::string_view::npos || line[sp + 1] != '/')
+    {
+        return PRIORITY_NORMAL;
+    }
+    std::string_view path = line.substr(sp + 1, end - sp - 1);
+    const route *r = NULL;
+    route_params params;
+    if (m_router->match(method, path, r, params) != http_router::MATCH_OK)
+    {
+        return PRIORITY_NORMAL;
+    }
+    return !r->may_block || is_hot_file(path) ? PRIORITY_HIGH : PRIORITY_LOW;
+}
+
+bool http_conn::peer_ip(char *buf, size_t len) const
+{
+    if (m_cold == NULL)
+    {
+        return false;
+    }
+    const sockaddr_storage &peer = m_cold->peer;
+    if (peer.ss_family == AF_INET)
+    {
+        return inet_ntop(AF_INET, &((const sockaddr_in *)&peer)->sin_addr, buf, len) != NULL;
+    }
+    if (peer.ss_family == AF_INET6)
+    {
+        return inet_ntop(AF_INET6, &((const sockaddr_in6 *)&peer)->sin6_addr, buf, len) != NULL;
+    }
+    return false;
+}
+
+bool http_conn::can_shed() const
+{
+    if (m_h2 != NULL || m_proxy != NULL || m_ws != NULL || m_ws_pending || (m_tls != NULL && !m_tls->established()))
+    {
+        return false;
+    }
+    //请求体可能已经部分写进了上传文件，接收中的请求照常处理
+    return m_check_state != CHECK_CONTENT || m_request_parsed;
+}
+
+void http_conn::shed()
+{
+    ++m_shed_count;
+    if (!reject(SERVICE_UNAVAILABLE, sizeof(SERVICE_UNAVAILABLE) - 1))
+    {
+        close_conn();
+    }
+}
+
+//应答发送完毕：长连接重置状态等待下一个请求，否则返回false关闭连接
+bool http_conn::finish_response()
+{
+    //101可能是在工作线程上发完的，会话表只属于reactor，切换留给下一次EPOLLOUT
+    if(m_ws_pending)
+    {
+        arm(EPOLLOUT);
+        return true;
+    }
+    if(m_linger)
+    {
+        init();
+        return true;
+    }
+    return false;
+}
+
 //返回是否保持连接
 bool http_conn::write()
 {
+    if(m_tls!=NULL&&!m_tls->established())
+    {
+        return continue_handshake();
+    }
+    if(m_proxy!=NULL)
+    {
+        return write_proxy();
+    }
+    if(m_ws!=NULL)
+    {
+        return m_ws->write();
+    }
+    if(m_ws_pending&&m_sent_idx==m_write_idx)
+    {
+        return start_websocket();
+    }
+    if(m_h2!=NULL)
+    {
+        if(!m_h2->write())
+        {
+            return false;
+        }
+        arm(EPOLLIN|(m_h2->want_write()?(int)EPOLLOUT:0));
+        return true;
+    }
+    if(m_source!=NULL)
+    {
+        return write_stream();
+    }
+    //后面还有文件时应答头不单独成段：否则Nagle扣住文件数据，等客户端的延迟ACK
+    int more=m_file_fd>=0&&m_file_sent_sz<m_cold->file_stat.st_size?MSG_MORE:0;
     while(m_sent_idx<m_write_idx)
     {
-        int ret=send(m_sockfd,m_write_buf+m_sent_idx,m_write_idx-m_sent_idx,0);
+        int ret=sock_send(m_sockfd,m_tls,m_cold->write_buf+m_sent_idx,m_write_idx-m_sent_idx,more);
         if(ret==-1)
         {
             if(errno==EAGAIN||errno==EWOULDBLOCK)
             {
-                modfd(m_epollfd,m_sockfd,EPOLLOUT);
+                arm(EPOLLOUT);
                 return true;
             }
             else
             {
-                closefd(m_file_fd);
+                release_file();
                 return false;
             }
         }
@@ -510,20 +1883,44 @@ bool http_conn::write()
     #endif
     if(m_file_fd>=0)
     {
-        while(m_file_sent_sz<m_file_stat.st_size)
+        while(m_file_sent_sz<m_cold->file_stat.st_size)
         {
-            int ret=sendfile(m_sockfd,m_file_fd,NULL,
-                    m_file_stat.st_size-m_file_sent_sz);
+            size_t left=m_cold->file_stat.st_size-m_file_sent_sz;
+            if(m_io_pool!=NULL)
+            {
+                //下一段不在页缓存中时交给I/O线程读盘，读完重新注册EPOLLOUT，不在这里阻塞
+                if(m_file_offset>=m_file_ready)
+                {
+                    size_t len=left<io_pool::WINDOW?left:io_pool::WINDOW;
+                    //最近服务过的热文件和不到一页的文件不做探测，省掉mmap/munmap和TLB刷新
+                    if(m_cold->file_stat.st_size<=io_pool::page_size()||is_hot_file(m_url))
+                    {
+                        len=left;
+                    }
+                    else if(!io_pool::resident(m_file_fd,m_file_offset,len)&&
+                            m_io_pool->prefetch(this,m_file_fd,m_file_offset,len))
+                    {
+                        return true;
+                    }
+                    m_file_ready=m_file_offset+len;
+                }
+                if((size_t)(m_file_ready-m_file_offset)<left)
+                {
+                    left=m_file_ready-m_file_offset;
+                }
+            }
+            //内核TLS卸载发送时这里仍是零拷贝的sendfile
+            int ret=sock_sendfile(m_sockfd,m_tls,m_file_fd,&m_file_offset,left);
             if(ret==-1)
             {
                 if(errno==EAGAIN||errno==EWOULDBLOCK)
                 {
-                    modfd(m_epollfd,m_sockfd,EPOLLOUT);
+                    arm(EPOLLOUT);
                     return true;
                 }
                 else
                 {
-                    closefd(m_file_fd);
+                    release_file();
                     return false;
                 }
             }
@@ -532,29 +1929,58 @@ bool http_conn::write()
                 m_file_sent_sz+=ret;
             }
         }
-        closefd(m_file_fd);
+        release_file();
     }
     #ifdef DEBUG
     printf("write file successful\n");
     #endif
-    if(m_linger)
-    {
-        init();
-        return true;
-    }
-    else
-    {
-        return false;
-    }
+    return finish_response();
 }
 
+/*
+    close()必须是最后一步：fd关闭后reactor可能立即accept到同号fd并复用本对象，
+    所以先清理文件和本对象的状态，再关闭套接字。
+*/
 void http_conn::close_conn()
 {
+    release_file();
+    delete m_source;
+    m_source = NULL;
+    //从未使用过的槽位没有冷状态
+    if (m_cold != NULL)
+    {
+        m_cold->file.abort();
+        closefd(m_cold->pipe[0]);
+        closefd(m_cold->pipe[1]);
+        m_cold->pipe[0] = m_cold->pipe[1] = -1;
+    }
+    delete m_proxy;
+    m_proxy = NULL;
+    delete m_ws;
+    m_ws = NULL;
+    delete m_h2;
+    m_h2 = NULL;
+    if (m_tls != NULL)
+    {
+        m_tls->shutdown();
+        delete m_tls;
+        m_tls = NULL;
+    }
     if (m_sockfd >= 0)
     {
-        removefd(m_epollfd, m_sockfd);
-        --m_user_count;
+        int sockfd = m_sockfd;
         m_sockfd = -1;
+        //在fd关闭、可能被复用之前换代，遗留的事件和任务都带着旧的代数
+        m_generation.fetch_add(1, std::memory_order_release);
+        --m_user_count;
+        if (m_limiter != NULL)
+        {
+            m_limiter->close_connection(m_limit_key);
+        }
+        if (m_capture != NULL)
+        {
+            m_capture->close_connection(m_capture_id);
+        }
+        removefd(m_epollfd, sockfd);
     }
-    closefd(m_file_fd);
 }
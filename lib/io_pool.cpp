@@ -0,0 +1,168 @@
+#include "io_pool.h"
+#include "http_conn.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <stdexcept>
+
+io_pool::io_pool(int thread_num, int max_jobs)
+    : m_thread_num(thread_num), m_max_jobs(max_jobs), m_threads(NULL), m_stop(false)
+{
+    if (thread_num <= 0 || max_jobs <= 0)
+    {
+        throw std::runtime_error("io_pool::io_pool() error: thread_num<=0||max_jobs<=0.");
+    }
+    m_threads = new pthread_t[thread_num];
+    for (int i = 0; i < thread_num; ++i)
+    {
+        if (pthread_create(m_threads + i, NULL, worker, this) != 0)
+        {
+            join_threads(i);
+            throw std::runtime_error("io_pool::io_pool() error: pthread_create failed.");
+        }
+    }
+}
+
+io_pool::~io_pool()
+{
+    join_threads(m_thread_num);
+}
+
+//让前count个线程退出并回收，未处理的任务不再处理
+void io_pool::join_threads(int count)
+{
+    m_lock.lock();
+    m_stop = true;
+    m_lock.unlock();
+    for (int i = 0; i < count; ++i)
+    {
+        m_pending.post();
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        pthread_join(m_threads[i], NULL);
+    }
+    delete[] m_threads;
+    m_threads = NULL;
+}
+
+long io_pool::page_size()
+{
+    static const long page = sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+/*
+    把范围映射进来用mincore查看每一页是否驻留，映射只为查询，不访问内存，
+    不会触发缺页。比用preadv2(RWF_NOWAIT)试读更准确，也不用拷贝数据。
+*/
+bool io_pool::resident(int fd, off_t off, size_t len)
+{
+    const long page = page_size();
+    if (len == 0)
+    {
+        return true;
+    }
+    off_t start = off & ~(off_t)(page - 1);
+    size_t span = off - start + len;
+    size_t pages = (span + page - 1) / page;
+    unsigned char vec[WINDOW / 4096 + 2];
+    if (pages > sizeof(vec))
+    {
+        return true;
+    }
+    void *p = mmap(NULL, span, PROT_READ, MAP_SHARED, fd, start);
+    if (p == MAP_FAILED)
+    {
+        return true;
+    }
+    bool hot = mincore(p, span, vec) != 0;
+    if (!hot)
+    {
+        hot = true;
+        for (size_t i = 0; i < pages && hot; ++i)
+        {
+            hot = vec[i] & 1;
+        }
+    }
+    munmap(p, span);
+    return hot;
+}
+
+bool io_pool::prefetch(http_conn *conn, int fd, off_t off, size_t len)
+{
+    job j;
+    j.conn = conn;
+    j.generation = conn->generation();
+    j.fd = fd;
+    j.off = off;
+    j.len = len;
+    m_lock.lock();
+    if (m_stop || m_jobs.size() >= m_max_jobs)
+    {
+        m_lock.unlock();
+        return false;
+    }
+    m_jobs.push_back(j);
+    m_lock.unlock();
+    m_pending.post();
+    return true;
+}
+
+void *io_pool::worker(void *arg)
+{
+    static_cast<io_pool *>(arg)->run();
+    return NULL;
+}
+
+void io_pool::run()
+{
+    //读入页缓存用的缓冲区，内容直接丢弃
+    char *buf = new char[WINDOW];
+    while (true)
+    {
+        while (!m_pending.wait())
+            ;
+        m_lock.lock();
+        if (m_stop)
+        {
+            m_lock.unlock();
+            break;
+        }
+        if (m_jobs.empty())
+        {
+            m_lock.unlock();
+            continue;
+        }
+        job j = m_jobs.front();
+        m_jobs.pop_front();
+        m_lock.unlock();
+
+        //后面一段先交给内核异步预读，和这一段的同步读盘重叠
+        posix_fadvise(j.fd, j.off + j.len, WINDOW, POSIX_FADV_WILLNEED);
+        //同步读完这一段再交还连接；readahead只发起读盘就返回，之后的sendfile仍可能等磁盘
+        size_t done = 0;
+        while (done < j.len)
+        {
+            ssize_t n = pread(j.fd, buf, j.len - done, j.off + done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            //出错或者文件被截短时照样交还连接，由sendfile报告错误
+            if (n <= 0)
+            {
+                break;
+            }
+            done += n;
+        }
+        if (j.conn->generation() == j.generation)
+        {
+            j.conn->arm(EPOLLOUT);
+        }
+    }
+    delete[] buf;
+}
@@ -0,0 +1,236 @@
+#include "listener.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+
+//非负整数，整个字符串都要是数字
+static bool parse_int(const std::string &text, int base, int &value)
+{
+    if (text.empty())
+    {
+        return false;
+    }
+    char *end = NULL;
+    long v = strtol(text.c_str(), &end, base);
+    if (*end != '\0' || v < 0 || v > 0x7FFFFFFF)
+    {
+        return false;
+    }
+    value = (int)v;
+    return true;
+}
+
+static bool parse_option(const std::string &opt, listen_spec &spec)
+{
+    size_t eq = opt.find('=');
+    std::string name = opt.substr(0, eq);
+    std::string value = eq == std::string::npos ? std::string() : opt.substr(eq + 1);
+    if (name == "reuseport" && eq == std::string::npos)
+    {
+        spec.reuseport = true;
+        return true;
+    }
+    if (name == "nodelay" && eq == std::string::npos)
+    {
+        spec.nodelay = true;
+        return true;
+    }
+    if (name == "backlog")
+    {
+        return parse_int(value, 10, spec.backlog) && spec.backlog > 0;
+    }
+    if (name == "rcvbuf")
+    {
+        return parse_int(value, 10, spec.rcvbuf);
+    }
+    if (name == "sndbuf")
+    {
+        return parse_int(value, 10, spec.sndbuf);
+    }
+    if (name == "mode")
+    {
+        return spec.family == AF_UNIX && parse_int(value, 8, spec.mode) && spec.mode <= 0777;
+    }
+    return false;
+}
+
+bool parse_listen_spec(const char *text, listen_spec &spec)
+{
+    spec.family = AF_INET;
+    spec.host = "0.0.0.0";
+    spec.port = 0;
+    spec.path.clear();
+    spec.backlog = listen_spec::DEFAULT_BACKLOG;
+    spec.reuseport = false;
+    spec.nodelay = false;
+    spec.rcvbuf = 0;
+    spec.sndbuf = 0;
+    spec.mode = -1;
+
+    std::string s(text);
+    //unix套接字的路径里可能有逗号以外的任何字符，选项从第一个逗号开始
+    size_t comma = s.find(',');
+    std::string addr = s.substr(0, comma);
+    std::string port;
+    if (addr.compare(0, 5, "unix:") == 0)
+    {
+        spec.family = AF_UNIX;
+        spec.path = addr.substr(5);
+        if (spec.path.empty() || spec.path.size() >= sizeof(((sockaddr_un *)0)->sun_path))
+        {
+            return false;
+        }
+    }
+    else if (!addr.empty() && addr[0] == '[')
+    {
+        size_t close = addr.find("]:");
+        if (close == std::string::npos)
+        {
+            return false;
+        }
+        spec.family = AF_INET6;
+        spec.host = addr.substr(1, close - 1);
+        port = addr.substr(close + 2);
+        in6_addr a6;
+        if (inet_pton(AF_INET6, spec.host.c_str(), &a6) != 1)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        size_t colon = addr.rfind(':');
+        if (colon != std::string::npos)
+        {
+            spec.host = addr.substr(0, colon);
+            port = addr.substr(colon + 1);
+        }
+        else
+        {
+            port = addr;
+        }
+        in_addr a4;
+        if (inet_pton(AF_INET, spec.host.c_str(), &a4) != 1)
+        {
+            return false;
+        }
+    }
+    if (spec.family != AF_UNIX && (!parse_int(port, 10, spec.port) || spec.port > 65535))
+    {
+        return false;
+    }
+    while (comma != std::string::npos)
+    {
+        size_t next = s.find(',', comma + 1);
+        if (!parse_option(s.substr(comma + 1, next == std::string::npos ? std::string::npos : next - comma - 1), spec))
+        {
+            return false;
+        }
+        comma = next;
+    }
+    return true;
+}
+
+int open_listener(const listen_spec &spec)
+{
+    sockaddr_storage ss;
+    socklen_t len = 0;
+    memset(&ss, 0, sizeof(ss));
+    if (spec.family == AF_INET)
+    {
+        sockaddr_in *a = (sockaddr_in *)&ss;
+        a->sin_family = AF_INET;
+        a->sin_port = htons(spec.port);
+        inet_pton(AF_INET, spec.host.c_str(), &a->sin_addr);
+        len = sizeof(*a);
+    }
+    else if (spec.family == AF_INET6)
+    {
+        sockaddr_in6 *a = (sockaddr_in6 *)&ss;
+        a->sin6_family = AF_INET6;
+        a->sin6_port = htons(spec.port);
+        inet_pton(AF_INET6, spec.host.c_str(), &a->sin6_addr);
+        len = sizeof(*a);
+    }
+    else
+    {
+        sockaddr_un *a = (sockaddr_un *)&ss;
+        a->sun_family = AF_UNIX;
+        memcpy(a->sun_path, spec.path.c_str(), spec.path.size() + 1);
+        len = sizeof(*a);
+        //上次运行留下的套接字文件会让bind失败
+        struct stat st;
+        if (lstat(spec.path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        {
+            unlink(spec.path.c_str());
+        }
+    }
+
+    int fd = socket(spec.family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int on = 1;
+    bool ok = true;
+    if (spec.family != AF_UNIX)
+    {
+        //不再设置SO_LINGER{1,0}：它会让close()发RST并丢弃发送缓冲区中尚未发出的应答
+        ok = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0;
+        if (ok && spec.family == AF_INET6)
+        {
+            ok = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) == 0;
+        }
+        if (ok && spec.reuseport)
+        {
+            ok = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0;
+        }
+        if (ok && spec.nodelay)
+        {
+            ok = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == 0;
+        }
+    }
+    if (ok && spec.rcvbuf > 0)
+    {
+        ok = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &spec.rcvbuf, sizeof(spec.rcvbuf)) == 0;
+    }
+    if (ok && spec.sndbuf > 0)
+    {
+        ok = setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &spec.sndbuf, sizeof(spec.sndbuf)) == 0;
+    }
+    ok = ok && bind(fd, (sockaddr *)&ss, len) == 0;
+    if (ok && spec.family == AF_UNIX && spec.mode >= 0)
+    {
+        ok = chmod(spec.path.c_str(), spec.mode) == 0;
+    }
+    ok = ok && listen(fd, spec.backlog) == 0;
+    if (!ok)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+std::string listen_name(const listen_spec &spec)
+{
+    if (spec.family == AF_UNIX)
+    {
+        return "unix:" + spec.path;
+    }
+    if (spec.family == AF_INET6)
+    {
+        return "[" + spec.host + "]:" + std::to_string(spec.port);
+    }
+    return spec.host + ":" + std::to_string(spec.port);
+}
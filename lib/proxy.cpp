@@ -0,0 +1,642 @@
+#include "proxy.h"
+#include "http_conn.h"
+#include "upstream.h"
+#include "tls.h"
+
+#include <arpa/inet.h>
+#include <strings.h>
+
+extern void modfd(int epollfd, int fd, int ev, uint32_t generation = 0);
+
+http_conn *proxy_exchange::m_clients[MAX_UPSTREAM_FD];
+
+//逐跳头部只对一跳连接有意义，不转发；长度由代理重新给出
+static bool hop_by_hop(const char *line)
+{
+    static const char *const names[] = {
+        "Connection:", "Keep-Alive:", "Proxy-Connection:", "TE:", "Trailer:",
+        "Transfer-Encoding:", "Upgrade:", "Expect:", "Content-Length:"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+        if (strncasecmp(line, names[i], strlen(names[i])) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+proxy_exchange::proxy_exchange(http_conn &client, upstream_pool &pool)
+    : m_client(client), m_pool(pool), m_backend(-1), m_fd(-1), m_registered(false), m_reused(false),
+      m_retried(false), m_reusable(true), m_can_splice(false), m_state(SEND_REQUEST), m_request_sent(0),
+      m_head_len(0), m_out_sent(0), m_body_mode(BODY_NONE), m_body_left(0), m_chunk_state(CHUNK_SIZE),
+      m_chunk_left(0), m_pipe_bytes(0)
+{
+}
+
+proxy_exchange::~proxy_exchange()
+{
+    detach_upstream(false);
+}
+
+http_conn *proxy_exchange::client_of(int fd)
+{
+    return fd >= 0 && fd < MAX_UPSTREAM_FD ? m_clients[fd] : NULL;
+}
+
+bool proxy_exchange::prepare()
+{
+    http_conn &c = m_client;
+    const std::string &body = c.m_cold->memory.data();
+    m_request.reserve(512 + body.size());
+    m_request += http_conn::method_name(c.m_method);
+    m_request += ' ';
+    m_request += c.m_url;
+    if (c.m_query != NULL)
+    {
+        m_request += '?';
+        m_request += c.m_query;
+    }
+    m_request += " HTTP/1.1\r\n";
+    //请求头在读缓冲区中以'\0'分隔，原样转发除逐跳头部以外的行
+    int pos = c.m_headers_start;
+    while (pos < c.m_headers_end)
+    {
+        const char *line = c.m_cold->read_buf + pos;
+        if (*line == '\0')
+        {
+            ++pos;
+            continue;
+        }
+        if (!hop_by_hop(line))
+        {
+            m_request += line;
+            m_request += "\r\n";
+        }
+        pos += strlen(line);
+    }
+    //AF_UNIX上的本机前置代理没有IP，不加这个头部
+    char addr[INET6_ADDRSTRLEN];
+    if (c.peer_ip(addr, sizeof(addr)))
+    {
+        m_request += "X-Forwarded-For: ";
+        m_request += addr;
+        m_request += "\r\n";
+    }
+    if (!body.empty() || c.m_method == http_conn::POST || c.m_method == http_conn::PUT || c.m_method == http_conn::PATCH)
+    {
+        m_request += "Content-Length: ";
+        m_request += std::to_string(body.size());
+        m_request += "\r\n";
+    }
+    m_request += "Connection: keep-alive\r\n\r\n";
+    m_request += body;
+    c.m_cold->memory.abort();
+
+    m_can_splice = c.m_tls == NULL || c.m_tls->ktls_send();
+    return attach_upstream(false);
+}
+
+bool proxy_exchange::attach_upstream(bool fresh)
+{
+    bool connecting = false;
+    m_fd = m_pool.acquire(m_backend, m_reused, connecting, fresh);
+    if (m_fd < 0)
+    {
+        return false;
+    }
+    if (m_fd >= MAX_UPSTREAM_FD)
+    {
+        detach_upstream(false);
+        return false;
+    }
+    m_clients[m_fd] = &m_client;
+    m_registered = false;
+    m_request_sent = 0;
+    m_state = connecting ? CONNECTING : SEND_REQUEST;
+    return true;
+}
+
+//上游连接必须先移出epoll再归还：归还后其他线程可能立刻取走并重新注册
+void proxy_exchange::detach_upstream(bool reusable)
+{
+    if (m_fd < 0)
+    {
+        return;
+    }
+    if (m_registered)
+    {
+        epoll_ctl(http_conn::m_epollfd, EPOLL_CTL_DEL, m_fd, NULL);
+        m_registered = false;
+    }
+    m_clients[m_fd] = NULL;
+    m_pool.release(m_backend, m_fd, reusable);
+    m_fd = -1;
+}
+
+void proxy_exchange::arm_upstream(int ev)
+{
+    if (m_registered)
+    {
+        modfd(http_conn::m_epollfd, m_fd, ev);
+        return;
+    }
+    epoll_event event;
+    event.data.u64 = (uint32_t)m_fd;
+    event.events = ev | EPOLLET | EPOLLRDHUP | EPOLLONESHOT;
+    epoll_ctl(http_conn::m_epollfd, EPOLL_CTL_ADD, m_fd, &event);
+    m_registered = true;
+}
+
+void proxy_exchange::arm_client(int ev)
+{
+    m_client.arm(ev);
+}
+
+/*
+    上游连接出错。复用的空闲连接可能恰好被后端关闭，还没收到应答时换一个新连接重发一次；
+    新建连接失败说明后端不可用。
+*/
+proxy_exchange::RESULT proxy_exchange::upstream_failed()
+{
+    bool fresh_failed = !m_reused && m_state <= SEND_REQUEST;
+    int backend = m_backend;
+    detach_upstream(false);
+    if (fresh_failed)
+    {
+        m_pool.mark_down(backend);
+    }
+    if (m_state > READ_HEAD || m_head_len > 0)
+    {
+        return m_state > READ_HEAD ? PROXY_ABORT : PROXY_BAD_GATEWAY;
+    }
+    if (m_retried || !attach_upstream(!fresh_failed))
+    {
+        return PROXY_BAD_GATEWAY;
+    }
+    m_retried = true;
+    return drive();
+}
+
+proxy_exchange::RESULT proxy_exchange::drive()
+{
+    while (true)
+    {
+        switch (m_state)
+        {
+        case CONNECTING:
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0)
+            {
+                return upstream_failed();
+            }
+            m_state = SEND_REQUEST;
+            break;
+        }
+        case SEND_REQUEST:
+        {
+            ssize_t n = send(m_fd, m_request.data() + m_request_sent, m_request.size() - m_request_sent, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    arm_upstream(EPOLLOUT);
+                    return PROXY_PENDING;
+                }
+                if (errno == EINTR)
+                {
+                    break;
+                }
+                return upstream_failed();
+            }
+            m_request_sent += n;
+            if (m_request_sent == m_request.size())
+            {
+                m_state = READ_HEAD;
+            }
+            break;
+        }
+        case READ_HEAD:
+        {
+            ssize_t n = recv(m_fd, m_head + m_head_len, HEAD_BUFFER_SIZE - m_head_len, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                arm_upstream(EPOLLIN);
+                return PROXY_PENDING;
+            }
+            if (n < 0 && errno == EINTR)
+            {
+                break;
+            }
+            if (n <= 0)
+            {
+                return upstream_failed();
+            }
+            m_head_len += n;
+            const char *end = (const char *)memmem(m_head, m_head_len, "\r\n\r\n", 4);
+            if (end == NULL)
+            {
+                if (m_head_len == HEAD_BUFFER_SIZE)
+                {
+                    detach_upstream(false);
+                    return PROXY_BAD_GATEWAY;
+                }
+                break;
+            }
+            if (!parse_head(end + 4 - m_head))
+            {
+                detach_upstream(false);
+                return PROXY_BAD_GATEWAY;
+            }
+            break;
+        }
+        case SEND_HEAD:
+            while (m_out_sent < m_out.size())
+            {
+                ssize_t n = sock_send(m_client.m_sockfd, m_client.m_tls, m_out.data() + m_out_sent, m_out.size() - m_out_sent);
+                if (n < 0)
+                {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        arm_client(EPOLLOUT);
+                        return PROXY_PENDING;
+                    }
+                    return PROXY_ABORT;
+                }
+                m_out_sent += n;
+            }
+            m_out.clear();
+            m_out_sent = 0;
+            if (body_complete())
+            {
+                return finish();
+            }
+            m_state = RELAY_BODY;
+            break;
+        case RELAY_BODY:
+            if (m_can_splice && m_body_mode != BODY_CHUNKED)
+            {
+                return relay_splice();
+            }
+            return relay_copy();
+        }
+    }
+}
+
+/*
+    解析上游应答头并改写成发给客户端的应答头：去掉逐跳头部，按客户端连接重新给出Connection。
+    1xx中间应答直接丢弃；头部之后已经读到的应答体附在改写后的头部后面一起发出。
+*/
+bool proxy_exchange::parse_head(size_t head_len)
+{
+    int status = 0;
+    bool http10 = strncmp(m_head, "HTTP/1.0 ", 9) == 0;
+    if ((!http10 && strncmp(m_head, "HTTP/1.1 ", 9) != 0) || (status = atoi(m_head + 9)) < 100 || status > 999)
+    {
+        return false;
+    }
+    if (status < 200)
+    {
+        memmove(m_head, m_head + head_len, m_head_len - head_len);
+        m_head_len -= head_len;
+        const char *end = (const char *)memmem(m_head, m_head_len, "\r\n\r\n", 4);
+        return end == NULL || parse_head(end + 4 - m_head);
+    }
+
+    bool chunked = false;
+    long long length = -1;
+    m_reusable = !http10;
+    m_out.clear();
+    const char *line = m_head;
+    const char *head_end = m_head + head_len - 2;
+    while (line < head_end)
+    {
+        const char *eol = (const char *)memmem(line, head_end - line, "\r\n", 2);
+        const char *next = eol + 2;
+        if (line != m_head)
+        {
+            if (strncasecmp(line, "Content-Length:", 15) == 0)
+            {
+                length = strtoll(line + 15, NULL, 10);
+                if (length < 0)
+                {
+                    return false;
+                }
+            }
+            else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+            {
+                chunked = memmem(line, eol - line, "chunked", 7) != NULL;
+            }
+            else if (strncasecmp(line, "Connection:", 11) == 0 && memmem(line, eol - line, "close", 5) != NULL)
+            {
+                m_reusable = false;
+            }
+            if (hop_by_hop(line) && strncasecmp(line, "Content-Length:", 15) != 0 &&
+                strncasecmp(line, "Transfer-Encoding:", 18) != 0)
+            {
+                line = next;
+                continue;
+            }
+        }
+        m_out.append(line, next - line);
+        line = next;
+    }
+
+    if (m_client.m_method == http_conn::HEAD || status == 204 || status == 304)
+    {
+        m_body_mode = BODY_NONE;
+    }
+    else if (chunked)
+    {
+        m_body_mode = BODY_CHUNKED;
+    }
+    else if (length >= 0)
+    {
+        m_body_mode = length > 0 ? BODY_LENGTH : BODY_NONE;
+        m_body_left = length;
+    }
+    else
+    {
+        //应答体以上游关闭连接结束，客户端也只能靠关闭连接得知结束
+        m_body_mode = BODY_UNTIL_CLOSE;
+        m_reusable = false;
+        m_client.m_linger = false;
+    }
+    m_out += m_client.m_linger ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+    const char *extra = m_head + head_len;
+    size_t extra_len = m_head_len - head_len;
+    if (m_body_mode == BODY_NONE)
+    {
+        m_reusable = m_reusable && extra_len == 0;
+        extra_len = 0;
+    }
+    else if (m_body_mode == BODY_LENGTH)
+    {
+        if ((long long)extra_len > m_body_left)
+        {
+            m_reusable = false;
+            extra_len = m_body_left;
+        }
+        m_body_left -= extra_len;
+    }
+    else if (m_body_mode == BODY_CHUNKED)
+    {
+        ssize_t used = scan_chunked(extra, extra_len);
+        if (used < 0)
+        {
+            return false;
+        }
+        extra_len = used;
+    }
+    m_out.append(extra, extra_len);
+    m_out_sent = 0;
+    m_state = SEND_HEAD;
+    return true;
+}
+
+/*
+    跟踪分块编码的边界以判断应答何时结束，数据本身原样转发。
+    返回属于应答体的字节数，格式错误返回-1；结束之后的多余数据不转发给客户端，
+    上游连接也不再复用。
+*/
+ssize_t proxy_exchange::scan_chunked(const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        char c = data[i];
+        switch (m_chunk_state)
+        {
+        case CHUNK_SIZE:
+        {
+            int v = -1;
+            if (c >= '0' && c <= '9')
+                v = c - '0';
+            else if (c >= 'a' && c <= 'f')
+                v = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                v = c - 'A' + 10;
+            if (v >= 0)
+            {
+                if (m_chunk_left > (1LL << 40))
+                {
+                    return -1;
+                }
+                m_chunk_left = m_chunk_left * 16 + v;
+                break;
+            }
+            if (c == '\r')
+            {
+                break;
+            }
+            if (c != '\n')
+            {
+                m_chunk_state = CHUNK_EXT;
+                break;
+            }
+        }
+            // fall through
+        case CHUNK_EXT:
+            if (c == '\n')
+            {
+                m_chunk_state = m_chunk_left == 0 ? CHUNK_TRAILER_START : CHUNK_DATA;
+            }
+            break;
+        case CHUNK_DATA:
+        {
+            size_t n = len - i < (size_t)m_chunk_left ? len - i : (size_t)m_chunk_left;
+            m_chunk_left -= n;
+            i += n - 1;
+            if (m_chunk_left == 0)
+            {
+                m_chunk_state = CHUNK_DATA_END;
+            }
+            break;
+        }
+        case CHUNK_DATA_END:
+            if (c == '\n')
+            {
+                m_chunk_state = CHUNK_SIZE;
+            }
+            break;
+        case CHUNK_TRAILER_START:
+            if (c == '\n')
+            {
+                m_chunk_state = CHUNK_DONE;
+                if (i + 1 < len)
+                {
+                    m_reusable = false;
+                }
+                return i + 1;
+            }
+            else if (c != '\r')
+            {
+                m_chunk_state = CHUNK_TRAILER_LINE;
+            }
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\n')
+            {
+                m_chunk_state = CHUNK_TRAILER_START;
+            }
+            break;
+        case CHUNK_DONE:
+            m_reusable = false;
+            return 0;
+        }
+    }
+    return len;
+}
+
+bool proxy_exchange::body_complete() const
+{
+    switch (m_body_mode)
+    {
+    case BODY_NONE:
+        return true;
+    case BODY_LENGTH:
+        return m_body_left == 0 && m_pipe_bytes == 0;
+    case BODY_CHUNKED:
+        return m_chunk_state == CHUNK_DONE;
+    default:
+        return false;
+    }
+}
+
+//上游套接字 -> 管道 -> 客户端套接字，应答体不进入用户态
+proxy_exchange::RESULT proxy_exchange::relay_splice()
+{
+    int *pipefd = m_client.m_cold->pipe;
+    if (pipefd[0] < 0 && pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        pipefd[0] = pipefd[1] = -1;
+        return PROXY_ABORT;
+    }
+    while (true)
+    {
+        if (m_pipe_bytes > 0)
+        {
+            ssize_t n = splice(pipefd[0], NULL, m_client.m_sockfd, NULL, m_pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    arm_client(EPOLLOUT);
+                    return PROXY_PENDING;
+                }
+                return PROXY_ABORT;
+            }
+            m_pipe_bytes -= n;
+            continue;
+        }
+        if (body_complete())
+        {
+            return finish();
+        }
+        size_t want = SPLICE_CHUNK;
+        if (m_body_mode == BODY_LENGTH && m_body_left < (long long)want)
+        {
+            want = m_body_left;
+        }
+        ssize_t n = splice(m_fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                arm_upstream(EPOLLIN);
+                return PROXY_PENDING;
+            }
+            return PROXY_ABORT;
+        }
+        if (n == 0)
+        {
+            if (m_body_mode == BODY_UNTIL_CLOSE)
+            {
+                return finish();
+            }
+            return PROXY_ABORT;
+        }
+        m_pipe_bytes += n;
+        if (m_body_mode == BODY_LENGTH)
+        {
+            m_body_left -= n;
+        }
+    }
+}
+
+//经用户态缓冲区转发：分块编码的应答体，或者客户端在用户态TLS上
+proxy_exchange::RESULT proxy_exchange::relay_copy()
+{
+    while (true)
+    {
+        while (m_out_sent < m_out.size())
+        {
+            ssize_t n = sock_send(m_client.m_sockfd, m_client.m_tls, m_out.data() + m_out_sent, m_out.size() - m_out_sent);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    arm_client(EPOLLOUT);
+                    return PROXY_PENDING;
+                }
+                return PROXY_ABORT;
+            }
+            m_out_sent += n;
+        }
+        if (body_complete())
+        {
+            return finish();
+        }
+        size_t want = COPY_BUFFER_SIZE;
+        if (m_body_mode == BODY_LENGTH && m_body_left < (long long)want)
+        {
+            want = m_body_left;
+        }
+        m_out.resize(want);
+        ssize_t n = recv(m_fd, &m_out[0], want, 0);
+        if (n < 0)
+        {
+            m_out.clear();
+            m_out_sent = 0;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                arm_upstream(EPOLLIN);
+                return PROXY_PENDING;
+            }
+            return PROXY_ABORT;
+        }
+        if (n == 0)
+        {
+            m_out.clear();
+            m_out_sent = 0;
+            if (m_body_mode == BODY_UNTIL_CLOSE)
+            {
+                return finish();
+            }
+            return PROXY_ABORT;
+        }
+        m_out.resize(n);
+        m_out_sent = 0;
+        if (m_body_mode == BODY_LENGTH)
+        {
+            m_body_left -= n;
+        }
+        else if (m_body_mode == BODY_CHUNKED)
+        {
+            ssize_t used = scan_chunked(m_out.data(), n);
+            if (used < 0)
+            {
+                return PROXY_ABORT;
+            }
+            m_out.resize(used);
+        }
+    }
+}
+
+proxy_exchange::RESULT proxy_exchange::finish()
+{
+    detach_upstream(m_reusable && m_body_mode != BODY_UNTIL_CLOSE);
+    return PROXY_DONE;
+}
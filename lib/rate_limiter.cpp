@@ -0,0 +1,226 @@
+#include "rate_limiter.h"
+
+#include <netinet/in.h>
+#include <time.h>
+#include <cstring>
+#include <stdexcept>
+
+static constexpr uint64_t TOKEN_BITS = 24;
+static constexpr uint64_t TOKEN_MASK = (1ULL << TOKEN_BITS) - 1;
+static constexpr uint64_t ONE_TOKEN = 256;
+
+static inline uint64_t pack_bucket(uint64_t ms, uint64_t tokens)
+{
+    return (ms << TOKEN_BITS) | tokens;
+}
+
+//乘法哈希，高位决定分片，低位决定分片内的起始槽位
+static inline uint32_t hash_ip(uint64_t ip)
+{
+    return (uint32_t)((ip * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+uint64_t rate_limiter::key_of(const sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET)
+    {
+        return ((const sockaddr_in *)addr)->sin_addr.s_addr;
+    }
+    if (addr->sa_family != AF_INET6)
+    {
+        return 0;
+    }
+    const in6_addr &a6 = ((const sockaddr_in6 *)addr)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(&a6))
+    {
+        uint32_t ip;
+        memcpy(&ip, a6.s6_addr + 12, sizeof(ip));
+        return ip;
+    }
+    //一个客户端通常分到整个/64，按前缀计数才不会被换地址绕过；
+    //最高位标记IPv6，IPv4的键不超过32位，两者不会落到同一个桶
+    uint64_t prefix;
+    memcpy(&prefix, a6.s6_addr, sizeof(prefix));
+    return IPV6_KEY | ((prefix * 0x9E3779B97F4A7C15ULL) >> 1);
+}
+
+rate_limiter::rate_limiter(int max_conns, double rate, double burst)
+    : m_slots(NULL), m_max_conns(max_conns), m_rate_fp(0), m_burst_fp(0), m_start_ms(0)
+{
+    if (max_conns < 0 || rate < 0 || burst < 0 || burst > 65535 || (rate > 0 && burst < 1))
+    {
+        throw std::runtime_error("rate_limiter::rate_limiter() error: bad limits.");
+    }
+    m_rate_fp = (uint64_t)(rate * ONE_TOKEN);
+    m_burst_fp = (uint64_t)(burst * ONE_TOKEN);
+    if (rate > 0 && m_rate_fp == 0)
+    {
+        m_rate_fp = 1;
+    }
+    m_slots = new slot[(1 << SHARD_BITS) * SLOTS_PER_SHARD];
+    for (int i = 0; i < (1 << SHARD_BITS) * SLOTS_PER_SHARD; ++i)
+    {
+        m_slots[i].ip.store(0, std::memory_order_relaxed);
+        m_slots[i].conns.store(0, std::memory_order_relaxed);
+        m_slots[i].bucket.store(0, std::memory_order_relaxed);
+    }
+    //时间从1开始，0留给从未补充过的桶
+    m_start_ms = now_ms() - 1;
+}
+
+rate_limiter::~rate_limiter()
+{
+    delete[] m_slots;
+}
+
+//粗粒度时钟只读vDSO中的数据，毫秒精度对限速足够
+uint64_t rate_limiter::now_ms() const
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 - m_start_ms;
+}
+
+/*
+    在IP所在分片内线性探测。create为true时用CAS占用空槽，
+    探测窗口满时接管一个没有连接且已经空闲的槽位；都不行时返回NULL。
+*/
+rate_limiter::slot *rate_limiter::find(uint64_t ip, bool create)
+{
+    uint32_t h = hash_ip(ip);
+    slot *shard = m_slots + (size_t)(h >> (32 - SHARD_BITS)) * SLOTS_PER_SHARD;
+    uint32_t start = h & (SLOTS_PER_SHARD - 1);
+    slot *victim = NULL;
+    for (int i = 0; i < MAX_PROBE; ++i)
+    {
+        slot *s = shard + ((start + i) & (SLOTS_PER_SHARD - 1));
+        uint64_t cur = s->ip.load(std::memory_order_acquire);
+        if (cur == ip)
+        {
+            return s;
+        }
+        if (cur == 0)
+        {
+            if (!create)
+            {
+                return NULL;
+            }
+            if (s->ip.compare_exchange_strong(cur, ip, std::memory_order_acq_rel))
+            {
+                return s;
+            }
+            //被别的线程抢先占用，可能正是同一个IP
+            if (cur == ip)
+            {
+                return s;
+            }
+            continue;
+        }
+        if (create && victim == NULL && s->conns.load(std::memory_order_relaxed) == 0)
+        {
+            uint64_t last = s->bucket.load(std::memory_order_relaxed) >> TOKEN_BITS;
+            if (!limits_requests() || now_ms() - last > IDLE_MS)
+            {
+                victim = s;
+            }
+        }
+    }
+    if (victim != NULL)
+    {
+        uint64_t cur = victim->ip.load(std::memory_order_relaxed);
+        if (cur != 0 && victim->ip.compare_exchange_strong(cur, ip, std::memory_order_acq_rel))
+        {
+            victim->bucket.store(0, std::memory_order_relaxed);
+            return victim;
+        }
+    }
+    return NULL;
+}
+
+bool rate_limiter::open_connection(uint64_t ip)
+{
+    if (m_max_conns <= 0 || ip == 0)
+    {
+        return true;
+    }
+    slot *s = find(ip, true);
+    if (s == NULL)
+    {
+        return true;
+    }
+    if (s->conns.fetch_add(1, std::memory_order_relaxed) >= m_max_conns)
+    {
+        s->conns.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void rate_limiter::close_connection(uint64_t ip)
+{
+    if (m_max_conns <= 0 || ip == 0)
+    {
+        return;
+    }
+    slot *s = find(ip, false);
+    if (s == NULL)
+    {
+        return;
+    }
+    //表满时放行的连接没有计数，不能减到负数
+    int cur = s->conns.load(std::memory_order_relaxed);
+    while (cur > 0 && !s->conns.compare_exchange_weak(cur, cur - 1, std::memory_order_relaxed))
+    {
+    }
+}
+
+bool rate_limiter::allow_request(uint64_t ip)
+{
+    if (m_rate_fp == 0 || ip == 0)
+    {
+        return true;
+    }
+    slot *s = find(ip, true);
+    if (s == NULL)
+    {
+        return true;
+    }
+    uint64_t now = now_ms();
+    uint64_t old = s->bucket.load(std::memory_order_relaxed);
+    while (true)
+    {
+        uint64_t last = old >> TOKEN_BITS;
+        uint64_t tokens = old & TOKEN_MASK;
+        if (last == 0)
+        {
+            //新占用的槽位从满桶开始
+            last = now;
+            tokens = m_burst_fp;
+        }
+        else if (now > last)
+        {
+            uint64_t added = (now - last) * m_rate_fp / 1000;
+            if (tokens + added >= m_burst_fp)
+            {
+                tokens = m_burst_fp;
+                last = now;
+            }
+            else if (added > 0)
+            {
+                //不足1/256个令牌的时间不推进，留到下次累计；推进时丢掉的余量小于1/256个令牌
+                tokens += added;
+                last = now;
+            }
+        }
+        bool ok = tokens >= ONE_TOKEN;
+        if (ok)
+        {
+            tokens -= ONE_TOKEN;
+        }
+        uint64_t next = pack_bucket(last, tokens);
+        if (next == old || s->bucket.compare_exchange_weak(old, next, std::memory_order_relaxed))
+        {
+            return ok;
+        }
+    }
+}
@@ -0,0 +1,259 @@
+#include "tls.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <cstdio>
+#include <cstring>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+ssl_ctx_st *tls_conn::m_ctx = NULL;
+
+#ifdef HAVE_OPENSSL
+
+//客户端支持时优先选择h2，连接前言会把连接交给HTTP/2会话
+static int select_alpn(SSL *, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *)
+{
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos, sizeof(protos) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+bool tls_conn::init_context(const char *cert_file, const char *key_file, bool ktls)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL)
+    {
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+#ifdef SSL_OP_ENABLE_KTLS
+    //握手完成后由OpenSSL设置TCP_ULP "tls"并把密钥交给内核；OpenSSL 3.0之前没有这个选项
+    if (ktls)
+    {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+#else
+    (void)ktls;
+#endif
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    //内核TLS只支持AES-GCM和ChaCha20-Poly1305
+    SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    m_ctx = ctx;
+    return true;
+}
+
+tls_conn::~tls_conn()
+{
+    SSL_free(m_ssl);
+}
+
+bool tls_conn::start(int sockfd)
+{
+    m_sockfd = sockfd;
+    m_ssl = SSL_new(m_ctx);
+    return m_ssl != NULL && SSL_set_fd(m_ssl, sockfd) == 1;
+}
+
+tls_conn::HANDSHAKE_RESULT tls_conn::handshake()
+{
+    if (m_ssl == NULL)
+    {
+        return HANDSHAKE_ERROR;
+    }
+    ERR_clear_error();
+    int ret = SSL_accept(m_ssl);
+    if (ret == 1)
+    {
+        m_established = true;
+#ifdef SSL_OP_ENABLE_KTLS
+        m_ktls_send = BIO_get_ktls_send(SSL_get_wbio(m_ssl)) != 0;
+        m_ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(m_ssl)) != 0;
+#endif
+#ifdef DEBUG
+        printf("tls handshake done: %s, ktls send %d recv %d\n", SSL_get_version(m_ssl), m_ktls_send, m_ktls_recv);
+#endif
+        return HANDSHAKE_DONE;
+    }
+    switch (SSL_get_error(m_ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+        return HANDSHAKE_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return HANDSHAKE_WANT_WRITE;
+    default:
+        return HANDSHAKE_ERROR;
+    }
+}
+
+bool tls_conn::pending() const
+{
+    return m_ssl != NULL && SSL_pending(m_ssl) > 0;
+}
+
+//尽力发出close_notify，不等待对端的回应
+void tls_conn::shutdown()
+{
+    if (m_established)
+    {
+        ERR_clear_error();
+        SSL_shutdown(m_ssl);
+        m_established = false;
+    }
+}
+
+//把SSL_read/SSL_write的结果转换成系统调用的约定
+ssize_t tls_conn::ssl_result(int ret)
+{
+    if (ret > 0)
+    {
+        return ret;
+    }
+    switch (SSL_get_error(m_ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0)
+        {
+            errno = ECONNRESET;
+        }
+        return -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+ssize_t tls_conn::recv(void *buf, size_t len)
+{
+    ERR_clear_error();
+    errno = 0;
+    return ssl_result(SSL_read(m_ssl, buf, len));
+}
+
+ssize_t tls_conn::send(const void *buf, size_t len)
+{
+    if (m_ktls_send)
+    {
+        return ::send(m_sockfd, buf, len, MSG_NOSIGNAL);
+    }
+    ERR_clear_error();
+    errno = 0;
+    return ssl_result(SSL_write(m_ssl, buf, len));
+}
+
+ssize_t tls_conn::writev(const struct iovec *iov, int cnt)
+{
+    if (m_ktls_send)
+    {
+        return ::writev(m_sockfd, iov, cnt);
+    }
+    //SSL_write没有聚集写，拷贝成一个记录；重试时调用者给出同样的数据
+    char buf[COPY_BUFFER_SIZE];
+    size_t len = 0;
+    for (int i = 0; i < cnt && len < sizeof(buf); ++i)
+    {
+        size_t n = iov[i].iov_len < sizeof(buf) - len ? iov[i].iov_len : sizeof(buf) - len;
+        memcpy(buf + len, iov[i].iov_base, n);
+        len += n;
+    }
+    return send(buf, len);
+}
+
+ssize_t tls_conn::sendfile(int file_fd, off_t *offset, size_t len)
+{
+    if (m_ktls_send)
+    {
+        //内核在发送时加密页缓存中的文件数据，不经过用户态
+        return ::sendfile(m_sockfd, file_fd, offset, len);
+    }
+    off_t pos = offset != NULL ? *offset : lseek(file_fd, 0, SEEK_CUR);
+    if (pos < 0)
+    {
+        return -1;
+    }
+    char buf[COPY_BUFFER_SIZE];
+    ssize_t n = pread(file_fd, buf, len < sizeof(buf) ? len : sizeof(buf), pos);
+    if (n <= 0)
+    {
+        return n;
+    }
+    ssize_t ret = send(buf, n);
+    if (ret > 0)
+    {
+        if (offset != NULL)
+        {
+            *offset = pos + ret;
+        }
+        else
+        {
+            lseek(file_fd, pos + ret, SEEK_SET);
+        }
+    }
+    return ret;
+}
+
+#else
+
+bool tls_conn::init_context(const char *, const char *, bool)
+{
+    fprintf(stderr, "built without TLS support\n");
+    return false;
+}
+
+tls_conn::~tls_conn() {}
+bool tls_conn::start(int) { return false; }
+tls_conn::HANDSHAKE_RESULT tls_conn::handshake() { return HANDSHAKE_ERROR; }
+bool tls_conn::pending() const { return false; }
+void tls_conn::shutdown() {}
+ssize_t tls_conn::ssl_result(int) { errno = EPROTO; return -1; }
+ssize_t tls_conn::recv(void *, size_t) { errno = EPROTO; return -1; }
+ssize_t tls_conn::send(const void *, size_t) { errno = EPROTO; return -1; }
+ssize_t tls_conn::writev(const struct iovec *, int) { errno = EPROTO; return -1; }
+ssize_t tls_conn::sendfile(int, off_t *, size_t) { errno = EPROTO; return -1; }
+
+#endif
+
+ssize_t sock_recv(int sockfd, tls_conn *tls, void *buf, size_t len)
+{
+    return tls != NULL ? tls->recv(buf, len) : ::recv(sockfd, buf, len, 0);
+}
+
+ssize_t sock_send(int sockfd, tls_conn *tls, const void *buf, size_t len, int flags)
+{
+    return tls != NULL ? tls->send(buf, len) : ::send(sockfd, buf, len, MSG_NOSIGNAL | flags);
+}
+
+ssize_t sock_writev(int sockfd, tls_conn *tls, const struct iovec *iov, int cnt)
+{
+    return tls != NULL ? tls->writev(iov, cnt) : ::writev(sockfd, iov, cnt);
+}
+
+ssize_t sock_sendfile(int sockfd, tls_conn *tls, int file_fd, off_t *offset, size_t len)
+{
+    return tls != NULL ? tls->sendfile(file_fd, offset, len) : ::sendfile(sockfd, file_fd, offset, len);
+}
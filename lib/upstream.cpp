@@ -0,0 +1,275 @@
+#include "upstream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <cstring>
+#include <string>
+
+upstream_pool::upstream_pool() : m_count(0), m_rotate(0), m_stop(false), m_checking(false)
+{
+}
+
+upstream_pool::~upstream_pool()
+{
+    m_wakeup.lock();
+    m_stop = true;
+    m_wakeup.signal();
+    m_wakeup.unlock();
+    if (m_checking)
+    {
+        pthread_join(m_checker, NULL);
+    }
+    m_lock.lock();
+    for (int i = 0; i < m_count; ++i)
+    {
+        for (size_t j = 0; j < m_backends[i].idle.size(); ++j)
+        {
+            close(m_backends[i].idle[j].fd);
+        }
+        m_backends[i].idle.clear();
+    }
+    m_lock.unlock();
+}
+
+bool upstream_pool::add_backends(const char *list)
+{
+    std::string rest(list);
+    size_t pos = 0;
+    while (pos <= rest.size())
+    {
+        size_t end = rest.find(',', pos);
+        if (end == std::string::npos)
+        {
+            end = rest.size();
+        }
+        std::string item = rest.substr(pos, end - pos);
+        pos = end + 1;
+        size_t colon = item.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == item.size() || m_count >= MAX_BACKENDS)
+        {
+            return false;
+        }
+        std::string host = item.substr(0, colon);
+        std::string port = item.substr(colon + 1);
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *res = NULL;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || res == NULL)
+        {
+            return false;
+        }
+        backend &b = m_backends[m_count++];
+        memcpy(&b.addr, res->ai_addr, sizeof(b.addr));
+        b.outstanding = 0;
+        b.healthy = true;
+        freeaddrinfo(res);
+    }
+    return m_count > 0;
+}
+
+void upstream_pool::start_health_checks()
+{
+    if (pthread_create(&m_checker, NULL, checker, this) != 0)
+    {
+        throw std::runtime_error("upstream_pool::start_health_checks() error: pthread_create(&m_checker, NULL, checker, this) != 0.");
+    }
+    m_checking = true;
+}
+
+//在健康的后端中选未完成请求最少的，全部不健康时返回-1
+int upstream_pool::pick_backend()
+{
+    int best = -1;
+    int best_load = 0;
+    unsigned start = m_rotate++;
+    for (int i = 0; i < m_count; ++i)
+    {
+        int idx = (start + i) % m_count;
+        backend &b = m_backends[idx];
+        if (!b.healthy)
+        {
+            continue;
+        }
+        int load = b.outstanding.load(std::memory_order_relaxed);
+        if (best < 0 || load < best_load)
+        {
+            best = idx;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+/*
+    取出最近归还的空闲连接。空闲期间没有注册epoll，
+    用MSG_PEEK检查对端是否已经关闭或者发来了不该有的数据。
+*/
+int upstream_pool::take_idle(int idx)
+{
+    backend &b = m_backends[idx];
+    time_t now = time(NULL);
+    while (true)
+    {
+        m_lock.lock();
+        if (b.idle.empty())
+        {
+            m_lock.unlock();
+            return -1;
+        }
+        idle_conn c = b.idle.back();
+        b.idle.pop_back();
+        m_lock.unlock();
+
+        char byte;
+        if (now - c.since <= IDLE_TIMEOUT &&
+            recv(c.fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return c.fd;
+        }
+        close(c.fd);
+    }
+}
+
+int upstream_pool::connect_backend(int idx, bool &connecting)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    connecting = false;
+    if (connect(fd, (const sockaddr *)&m_backends[idx].addr, sizeof(sockaddr_in)) != 0)
+    {
+        if (errno != EINPROGRESS)
+        {
+            close(fd);
+            mark_down(idx);
+            return -1;
+        }
+        connecting = true;
+    }
+    return fd;
+}
+
+int upstream_pool::acquire(int &idx, bool &reused, bool &connecting, bool fresh)
+{
+    idx = pick_backend();
+    if (idx < 0)
+    {
+        return -1;
+    }
+    connecting = false;
+    int fd = fresh ? -1 : take_idle(idx);
+    reused = fd >= 0;
+    if (fd < 0)
+    {
+        fd = connect_backend(idx, connecting);
+        if (fd < 0)
+        {
+            //这个后端刚被标记为不可用，换一个再试一次
+            idx = pick_backend();
+            if (idx < 0 || (fd = connect_backend(idx, connecting)) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    ++m_backends[idx].outstanding;
+    return fd;
+}
+
+void upstream_pool::release(int idx, int fd, bool reusable)
+{
+    backend &b = m_backends[idx];
+    --b.outstanding;
+    if (reusable && b.healthy)
+    {
+        m_lock.lock();
+        if ((int)b.idle.size() < MAX_IDLE)
+        {
+            idle_conn c = {fd, time(NULL)};
+            b.idle.push_back(c);
+            fd = -1;
+        }
+        m_lock.unlock();
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+void upstream_pool::mark_down(int idx)
+{
+    m_backends[idx].healthy = false;
+    drop_idle(idx);
+}
+
+void upstream_pool::drop_idle(int idx)
+{
+    std::vector<idle_conn> idle;
+    m_lock.lock();
+    idle.swap(m_backends[idx].idle);
+    m_lock.unlock();
+    for (size_t i = 0; i < idle.size(); ++i)
+    {
+        close(idle[i].fd);
+    }
+}
+
+//带超时的TCP连接探测
+bool upstream_pool::probe(int idx)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = connect(fd, (const sockaddr *)&m_backends[idx].addr, sizeof(sockaddr_in)) == 0;
+    if (!ok && errno == EINPROGRESS)
+    {
+        pollfd pfd = {fd, POLLOUT, 0};
+        int err = 0;
+        socklen_t len = sizeof(err);
+        ok = poll(&pfd, 1, CHECK_CONNECT_TIMEOUT) == 1 &&
+             getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+    }
+    close(fd);
+    return ok;
+}
+
+void *upstream_pool::checker(void *arg)
+{
+    upstream_pool *pool = static_cast<upstream_pool *>(arg);
+    while (!pool->m_stop)
+    {
+        for (int i = 0; i < pool->m_count && !pool->m_stop; ++i)
+        {
+            bool up = pool->probe(i);
+            if (!up && pool->m_backends[i].healthy)
+            {
+                pool->mark_down(i);
+            }
+            pool->m_backends[i].healthy = up;
+        }
+        timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += CHECK_INTERVAL;
+        pool->m_wakeup.lock();
+        if (!pool->m_stop)
+        {
+            pool->m_wakeup.timewait(until);
+        }
+        pool->m_wakeup.unlock();
+    }
+    return NULL;
+}
@@ -0,0 +1,601 @@
+#include "websocket.h"
+#include "http_conn.h"
+#include "tls.h"
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <new>
+#include <stdexcept>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+extern void addfd(int epollfd, int fd, bool one_shot, uint32_t generation = 0);
+
+static const char ws_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+//握手只需要对60字节左右的输入做一次SHA-1，不值得为此依赖加密库
+static void sha1(const unsigned char *data, size_t len, unsigned char out[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::string msg((const char *)data, len);
+    msg += (char)0x80;
+    while (msg.size() % 64 != 56)
+    {
+        msg += (char)0;
+    }
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 7; i >= 0; --i)
+    {
+        msg += (char)(bits >> (i * 8));
+    }
+    for (size_t off = 0; off < msg.size(); off += 64)
+    {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i)
+        {
+            const unsigned char *p = (const unsigned char *)msg.data() + off + i * 4;
+            w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        }
+        for (int i = 16; i < 80; ++i)
+        {
+            uint32_t v = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = v << 1 | v >> 31;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i)
+        {
+            uint32_t f, k;
+            if (i < 20)
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if (i < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = b << 30 | b >> 2;
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for (int i = 0; i < 5; ++i)
+    {
+        out[i * 4] = h[i] >> 24;
+        out[i * 4 + 1] = h[i] >> 16;
+        out[i * 4 + 2] = h[i] >> 8;
+        out[i * 4 + 3] = h[i];
+    }
+}
+
+static std::string base64_encode(const unsigned char *data, size_t len)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < len; i += 3)
+    {
+        uint32_t v = (uint32_t)data[i] << 16;
+        if (i + 1 < len)
+            v |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < len)
+            v |= data[i + 2];
+        out += table[v >> 18 & 63];
+        out += table[v >> 12 & 63];
+        out += i + 1 < len ? table[v >> 6 & 63] : '=';
+        out += i + 2 < len ? table[v & 63] : '=';
+    }
+    return out;
+}
+
+/*
+    客户端帧的载荷按4字节掩码循环异或。掩码复制成16字节后每次处理一个SSE2寄存器，
+    余下部分按8字节和单字节处理；载荷从掩码的第0字节开始对齐。
+*/
+static void unmask(char *p, size_t len, const unsigned char mask[4])
+{
+    size_t i = 0;
+    uint32_t m32;
+    memcpy(&m32, mask, 4);
+#if defined(__SSE2__)
+    __m128i m128 = _mm_set1_epi32((int)m32);
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(v, m128));
+    }
+#endif
+    uint64_t m64 = (uint64_t)m32 << 32 | m32;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        v ^= m64;
+        memcpy(p + i, &v, 8);
+    }
+    for (; i < len; ++i)
+    {
+        p[i] ^= mask[i & 3];
+    }
+}
+
+ws_frame *ws_frame::encode(int opcode, const void *payload, size_t len)
+{
+    size_t head = len < 126 ? 2 : len <= 0xFFFF ? 4 : 10;
+    void *mem = malloc(sizeof(ws_frame) + head + len);
+    if (mem == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    ws_frame *f = new (mem) ws_frame(head + len);
+    unsigned char *p = (unsigned char *)(f + 1);
+    p[0] = 0x80 | (opcode & 0x0F);
+    if (head == 2)
+    {
+        p[1] = len;
+    }
+    else if (head == 4)
+    {
+        p[1] = 126;
+        p[2] = len >> 8;
+        p[3] = len;
+    }
+    else
+    {
+        p[1] = 127;
+        for (int i = 0; i < 8; ++i)
+        {
+            p[2 + i] = (uint64_t)len >> ((7 - i) * 8);
+        }
+    }
+    memcpy(p + head, payload, len);
+    return f;
+}
+
+void ws_frame::unref()
+{
+    if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        this->~ws_frame();
+        free(this);
+    }
+}
+
+std::string ws_session::accept_key(const char *client_key)
+{
+    std::string s(client_key);
+    s += ws_guid;
+    unsigned char digest[20];
+    sha1((const unsigned char *)s.data(), s.size(), digest);
+    return base64_encode(digest, sizeof(digest));
+}
+
+ws_session::ws_session(http_conn &conn, int sockfd, tls_conn *tls, ws_hub &hub, const std::string &topic,
+                       const char *initial, size_t initial_len)
+    : m_conn(conn), m_sockfd(sockfd), m_tls(tls), m_hub(hub), m_topic(topic), m_topic_slot(0), m_session_slot(0),
+      m_in(initial, initial_len), m_message_len(0), m_message_opcode(0), m_head_off(0), m_queued_bytes(0), m_last_seen(time(NULL)),
+      m_closing(false), m_dead(false)
+{
+    m_hub.attach(this);
+}
+
+ws_session::~ws_session()
+{
+    m_hub.detach(this);
+    while (!m_queue.empty())
+    {
+        m_queue.front()->unref();
+        m_queue.pop_front();
+    }
+}
+
+bool ws_session::enqueue(ws_frame *frame)
+{
+    if (m_dead)
+    {
+        return false;
+    }
+    //队列为空时总能放入一帧，否则超大的单条消息永远发不出去
+    if (!m_queue.empty() && m_queued_bytes + frame->size() > MAX_QUEUE_BYTES)
+    {
+        return false;
+    }
+    frame->ref();
+    m_queue.push_back(frame);
+    m_queued_bytes += frame->size();
+    return true;
+}
+
+bool ws_session::send_control(int opcode, const char *payload, size_t len)
+{
+    ws_frame *f = ws_frame::encode(opcode, payload, len);
+    bool ok = enqueue(f);
+    f->unref();
+    return ok;
+}
+
+bool ws_session::read()
+{
+    char buf[READ_CHUNK];
+    process_input();
+    while (!m_closing && !m_dead)
+    {
+        ssize_t n = sock_recv(m_sockfd, m_tls, buf, sizeof(buf));
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0)
+        {
+            return false;
+        }
+        m_last_seen = time(NULL);
+        m_in.append(buf, n);
+        process_input();
+    }
+    if (m_dead)
+    {
+        return false;
+    }
+    return write();
+}
+
+//处理输入缓冲区中全部完整的帧，不完整的帧留到下次；输入缓冲区最多保留一帧
+void ws_session::process_input()
+{
+    size_t pos = 0;
+    while (!m_closing && !m_dead && m_in.size() - pos >= 2)
+    {
+        const unsigned char *p = (const unsigned char *)m_in.data() + pos;
+        size_t avail = m_in.size() - pos;
+        bool fin = p[0] & 0x80;
+        int opcode = p[0] & 0x0F;
+        uint64_t len = p[1] & 0x7F;
+        size_t head = 2;
+        //没有协商扩展，RSV位必须为0；客户端的帧必须带掩码
+        if ((p[0] & 0x70) != 0 || !(p[1] & 0x80))
+        {
+            send_control(ws_frame::CLOSE, "\x03\xEA", 2); // 1002 协议错误
+            m_closing = true;
+            break;
+        }
+        if (len == 126)
+        {
+            if (avail < 4)
+                break;
+            len = (uint64_t)p[2] << 8 | p[3];
+            head = 4;
+        }
+        else if (len == 127)
+        {
+            if (avail < 10)
+                break;
+            len = 0;
+            for (int i = 0; i < 8; ++i)
+            {
+                len = len << 8 | p[2 + i];
+            }
+            head = 10;
+        }
+        //控制帧不能分片，载荷不超过125字节
+        if ((opcode & 0x08) && (len > 125 || !fin))
+        {
+            send_control(ws_frame::CLOSE, "\x03\xEA", 2);
+            m_closing = true;
+            break;
+        }
+        if (len > MAX_MESSAGE)
+        {
+            send_control(ws_frame::CLOSE, "\x03\xF1", 2); // 1009 消息过大
+            m_closing = true;
+            break;
+        }
+        if (avail < head + 4 + len)
+        {
+            break;
+        }
+        char *payload = &m_in[pos + head + 4];
+        unmask(payload, len, p + head);
+        pos += head + 4 + len;
+        if (!handle_frame(opcode, fin, payload, len))
+        {
+            break;
+        }
+    }
+    m_in.erase(0, pos);
+}
+
+bool ws_session::handle_frame(int opcode, bool fin, char *payload, size_t len)
+{
+    switch (opcode)
+    {
+    case ws_frame::CONTINUATION:
+        if (m_message_opcode == 0 || m_message_len + len > MAX_MESSAGE)
+        {
+            send_control(ws_frame::CLOSE, "\x03\xEA", 2);
+            m_closing = true;
+            return false;
+        }
+        m_message_len += len;
+        if (fin)
+        {
+            m_message_len = 0;
+            m_message_opcode = 0;
+        }
+        return true;
+    case ws_frame::TEXT:
+    case ws_frame::BINARY:
+        if (m_message_opcode != 0)
+        {
+            send_control(ws_frame::CLOSE, "\x03\xEA", 2);
+            m_closing = true;
+            return false;
+        }
+        //客户端只是订阅者，数据消息只检查格式后丢弃，不转发给主题
+        if (!fin)
+        {
+            m_message_len = len;
+            m_message_opcode = opcode;
+        }
+        return true;
+    case ws_frame::PING:
+        if (!send_control(ws_frame::PONG, payload, len))
+        {
+            m_dead = true;
+        }
+        return !m_dead;
+    case ws_frame::PONG:
+        return true;
+    case ws_frame::CLOSE:
+        //回应对端的关闭帧，只带回状态码；发送队列清空后关闭连接
+        send_control(ws_frame::CLOSE, payload, len >= 2 ? 2 : 0);
+        m_closing = true;
+        return false;
+    default:
+        send_control(ws_frame::CLOSE, "\x03\xEA", 2);
+        m_closing = true;
+        return false;
+    }
+}
+
+bool ws_session::write()
+{
+    while (!m_queue.empty())
+    {
+        struct iovec iov[IOV_BATCH];
+        int cnt = 0;
+        size_t off = m_head_off;
+        for (std::deque<ws_frame *>::iterator it = m_queue.begin(); it != m_queue.end() && cnt < IOV_BATCH; ++it)
+        {
+            iov[cnt].iov_base = const_cast<char *>((*it)->data()) + off;
+            iov[cnt].iov_len = (*it)->size() - off;
+            off = 0;
+            ++cnt;
+        }
+        ssize_t n = sock_writev(m_sockfd, m_tls, iov, cnt);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                m_conn.arm(EPOLLIN | EPOLLOUT);
+                return true;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            m_dead = true;
+            return false;
+        }
+        m_queued_bytes -= n;
+        size_t left = n;
+        while (left > 0)
+        {
+            ws_frame *f = m_queue.front();
+            size_t rest = f->size() - m_head_off;
+            if (left < rest)
+            {
+                m_head_off += left;
+                break;
+            }
+            left -= rest;
+            m_head_off = 0;
+            m_queue.pop_front();
+            f->unref();
+        }
+    }
+    if (m_closing)
+    {
+        return false;
+    }
+    m_conn.arm(EPOLLIN);
+    return true;
+}
+
+ws_hub::ws_hub() : m_event_fd(-1), m_timer_fd(-1)
+{
+    m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_event_fd < 0)
+    {
+        throw std::runtime_error("ws_hub::ws_hub() error: eventfd() failed.");
+    }
+    m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = PING_INTERVAL;
+    its.it_interval.tv_sec = PING_INTERVAL;
+    if (m_timer_fd < 0 || timerfd_settime(m_timer_fd, 0, &its, NULL) < 0)
+    {
+        close(m_event_fd);
+        if (m_timer_fd >= 0)
+        {
+            close(m_timer_fd);
+        }
+        throw std::runtime_error("ws_hub::ws_hub() error: timerfd failed.");
+    }
+}
+
+ws_hub::~ws_hub()
+{
+    for (size_t i = 0; i < m_inbox.size(); ++i)
+    {
+        m_inbox[i].second->unref();
+    }
+    close(m_event_fd);
+    close(m_timer_fd);
+}
+
+void ws_hub::register_events(int epollfd)
+{
+    addfd(epollfd, m_event_fd, false);
+    addfd(epollfd, m_timer_fd, false);
+}
+
+void ws_hub::handle(int fd)
+{
+    uint64_t count;
+    //边沿触发，读掉计数后才会再次通知
+    while (::read(fd, &count, sizeof(count)) == sizeof(count))
+    {
+    }
+    if (fd == m_event_fd)
+    {
+        drain();
+    }
+    else
+    {
+        keepalive();
+    }
+}
+
+void ws_hub::publish(const std::string &topic, const char *data, size_t len, bool binary)
+{
+    ws_frame *f = ws_frame::encode(binary ? ws_frame::BINARY : ws_frame::TEXT, data, len);
+    m_lock.lock();
+    m_inbox.push_back(std::make_pair(topic, f));
+    m_lock.unlock();
+    uint64_t one = 1;
+    ::write(m_event_fd, &one, sizeof(one));
+}
+
+void ws_hub::drain()
+{
+    std::vector<std::pair<std::string, ws_frame *> > inbox;
+    m_lock.lock();
+    inbox.swap(m_inbox);
+    m_lock.unlock();
+    for (size_t i = 0; i < inbox.size(); ++i)
+    {
+        deliver(inbox[i].first, inbox[i].second);
+        inbox[i].second->unref();
+    }
+}
+
+void ws_hub::attach(ws_session *session)
+{
+    std::vector<ws_session *> &subs = m_topics[session->m_topic];
+    session->m_topic_slot = subs.size();
+    subs.push_back(session);
+    session->m_session_slot = m_sessions.size();
+    m_sessions.push_back(session);
+}
+
+//用末尾元素填补空位，O(1)移除
+void ws_hub::detach(ws_session *session)
+{
+    std::unordered_map<std::string, std::vector<ws_session *> >::iterator it = m_topics.find(session->m_topic);
+    if (it != m_topics.end())
+    {
+        std::vector<ws_session *> &subs = it->second;
+        subs[session->m_topic_slot] = subs.back();
+        subs[session->m_topic_slot]->m_topic_slot = session->m_topic_slot;
+        subs.pop_back();
+        if (subs.empty())
+        {
+            m_topics.erase(it);
+        }
+    }
+    m_sessions[session->m_session_slot] = m_sessions.back();
+    m_sessions[session->m_session_slot]->m_session_slot = session->m_session_slot;
+    m_sessions.pop_back();
+}
+
+void ws_hub::deliver(const std::string &topic, ws_frame *frame)
+{
+    std::unordered_map<std::string, std::vector<ws_session *> >::iterator it = m_topics.find(topic);
+    if (it == m_topics.end())
+    {
+        return;
+    }
+    std::vector<ws_session *> dead;
+    std::vector<ws_session *> &subs = it->second;
+    for (size_t i = 0; i < subs.size(); ++i)
+    {
+        ws_session *s = subs[i];
+        if (!s->enqueue(frame) || !s->write())
+        {
+            s->kill();
+            dead.push_back(s);
+        }
+    }
+    close_dead(dead);
+}
+
+//向空闲的连接发送共享的ping帧，两个周期内都没有数据的连接视为已断开
+void ws_hub::keepalive()
+{
+    time_t now = time(NULL);
+    ws_frame *ping = ws_frame::encode(ws_frame::PING, NULL, 0);
+    std::vector<ws_session *> dead;
+    for (size_t i = 0; i < m_sessions.size(); ++i)
+    {
+        ws_session *s = m_sessions[i];
+        time_t idle = now - s->last_seen();
+        if (idle < PING_INTERVAL)
+        {
+            continue;
+        }
+        if (idle >= 2 * PING_INTERVAL || !s->enqueue(ping) || !s->write())
+        {
+            s->kill();
+            dead.push_back(s);
+        }
+    }
+    ping->unref();
+    close_dead(dead);
+}
+
+void ws_hub::close_dead(std::vector<ws_session *> &dead)
+{
+    for (size_t i = 0; i < dead.size(); ++i)
+    {
+        dead[i]->conn().close_conn();
+    }
+}
@@ -2,12 +2,30 @@
 
 #include "threadpool.h"
 #include "http_conn.h"
+#include "cpu_affinity.h"
+#include "handlers.h"
+#include "tls.h"
+#include "proxy.h"
+#include "upstream.h"
+#include "content_pack.h"
+#include "rate_limiter.h"
+#include "websocket.h"
+#include "capture.h"
+#include "io_pool.h"
+#include "listener.h"
 #include <assert.h>
 #include <arpa/inet.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <sched.h>
+#include <signal.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #define MAX_FD 1000
 #define MAX_EVENT_NUMBER 10000
-extern void addfd(int epollfd, int fd, bool one_shot);
+extern void addfd(int epollfd, int fd, bool one_shot, uint32_t generation = 0);
 
 void show_error( int connfd, const char* info )
 {
@@ -16,49 +34,371 @@ void show_error( int connfd, const char* info )
     close( connfd );
 }
 
-void run_http_server(int port)
+//请求处理方式
+enum DISPATCH_MODE
 {
-    threadpool<http_conn> *pool = NULL;
+    DISPATCH_POOL,    //全部交给线程池
+    DISPATCH_INLINE,  //全部在reactor上就地处理
+    DISPATCH_ADAPTIVE //就地处理，预测会阻塞的交给线程池
+};
+
+//路由表，启动时一次性建成基数树，之后各线程只读
+struct route_entry
+{
+    http_conn::METHOD method;
+    const char *pattern;
+    route target;
+};
+
+static const route_entry builtin_routes[] = {
+    {http_conn::GET, "/healthz", {serve_health, NULL, false}},
+    {http_conn::HEAD, "/healthz", {serve_health, NULL, false}},
+};
+
+static const route_entry static_routes[] = {
+    {http_conn::GET, "/*path", {serve_static, NULL, true}},
+    {http_conn::HEAD, "/*path", {serve_static, NULL, true}},
+};
+
+//包中没有的url回退到文件系统，仍可能阻塞
+static const route_entry packed_routes[] = {
+    {http_conn::GET, "/*path", {serve_packed, NULL, true}},
+    {http_conn::HEAD, "/*path", {serve_packed, NULL, true}},
+};
+
+static const route_entry upload_routes[] = {
+    {http_conn::PUT, "/*path", {finish_upload, accept_upload, true}},
+};
+
+//反向代理转发的方法，挂在"-x"给出的路径前缀下
+static const http_conn::METHOD proxy_methods[] = {
+    http_conn::GET, http_conn::HEAD, http_conn::POST, http_conn::PUT,
+    http_conn::DELETE, http_conn::PATCH, http_conn::OPTIONS,
+};
+
+struct server_options
+{
+    std::vector<listen_spec> listeners; // 同一个事件循环服务的全部监听地址
+    int thread_num;           // 0表示按可用CPU数
+    int max_requests;         // 0表示按线程数
+    int queue_target_ms;      // 线程池排队时延的CoDel目标，0表示不做CoDel丢弃
+    int queue_deadline_ms;    // 排队超过这个时间的请求以503放弃，0表示不限制
+    std::vector<int> worker_cpus; // 工作线程绑定的CPU，空表示不绑定
+    std::vector<int> reactor_cpus;// 主线程绑定的CPU，空表示不绑定
+    bool numa_groups;         // 每个NUMA节点一个工作线程组
+    bool incoming_cpu;        // 按SO_INCOMING_CPU选择工作线程组并回写到连接
+    DISPATCH_MODE dispatch;   // 请求处理方式
+    std::string proxy_prefix; // 转发到上游的路径前缀，空表示不做反向代理
+    std::string ws_prefix;    // WebSocket订阅和发布的路径前缀，空表示不接受升级
+    const char *capture_file; // 录制请求流量的文件，NULL表示不录制
+    int io_threads;           // 冷文件读盘线程数，0表示sendfile直接读盘
+    int max_conns_per_ip;     // 0表示不限制
+    double request_rate;      // 每个IP每秒的请求数，0表示不限制
+    double request_burst;
+};
+
+/*
+    工作线程组：每个NUMA节点一个线程池，线程绑定在该节点的CPU上。
+    连接按接收它的CPU所在节点归组，本组队列满时才借用其他组。
+*/
+struct worker_group
+{
+    int node;
+    std::vector<int> cpus;
+    threadpool<http_conn> *pool;
+};
+
+//启动时为每个CPU查好所属的组，接受连接时只查表，不在事件循环里读/sys
+std::vector<int> map_cpu_groups(const std::vector<worker_group> &groups)
+{
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+    std::vector<int> cpu_group(count > 0 ? count : 0, 0);
+    for (size_t cpu = 0; cpu < cpu_group.size(); ++cpu)
+    {
+        int node = cpu_numa_node((int)cpu);
+        for (size_t i = 0; i < groups.size(); ++i)
+        {
+            if (groups[i].node == node)
+            {
+                cpu_group[cpu] = (int)i;
+                break;
+            }
+        }
+    }
+    return cpu_group;
+}
+
+int find_group(const std::vector<int> &cpu_group, int cpu)
+{
+    return cpu >= 0 && cpu < (int)cpu_group.size() ? cpu_group[cpu] : 0;
+}
+
+//所有组的队列都满时以503放弃请求，不能放弃的连接直接关闭，不会挂起没有人处理
+void dispatch(std::vector<worker_group> &groups, int group, http_conn *conn)
+{
+    TASK_PRIORITY priority = conn->priority();
+    if (groups[group].pool->push(conn, priority))
+    {
+        return;
+    }
+    for (size_t i = 0; i < groups.size(); ++i)
+    {
+        if ((int)i != group && groups[i].pool->push(conn, priority))
+        {
+            return;
+        }
+    }
+    if (conn->can_shed())
+    {
+        conn->shed();
+    }
+    else
+    {
+        conn->close_conn();
+    }
+}
+
+bool is_listener(const std::vector<int> &listenfds, int fd)
+{
+    return std::find(listenfds.begin(), listenfds.end(), fd) != listenfds.end();
+}
+
+//收到SIGINT/SIGTERM时退出事件循环，让录制器写完缓冲区、删除AF_UNIX监听的套接字文件
+static volatile sig_atomic_t stop_server = 0;
+
+static void on_stop_signal(int)
+{
+    stop_server = 1;
+}
+
+void run_http_server(const server_options &opt)
+{
+    //对端关闭后的sendfile/send以错误返回，而不是终止进程
+    signal(SIGPIPE, SIG_IGN);
+    bool unix_listener = false;
+    for (size_t i = 0; i < opt.listeners.size(); ++i)
+    {
+        unix_listener = unix_listener || opt.listeners[i].family == AF_UNIX;
+    }
+    /*
+        其余情况保持默认处理，信号直接终止进程。
+        在创建任何线程之前屏蔽SIGINT/SIGTERM，之后的线程都继承这个屏蔽字，
+        信号只在reactor的epoll_pwait中递送：不会落到工作线程上而让reactor一直等下去，
+        检查stop_server和进入等待之间到达的信号也不会丢失。
+    */
+    bool stop_signals = opt.capture_file != NULL || unix_listener;
+    sigset_t wait_mask;
+    if (stop_signals)
+    {
+        sigset_t stop_set;
+        sigemptyset(&stop_set);
+        sigaddset(&stop_set, SIGINT);
+        sigaddset(&stop_set, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stop_set, &wait_mask);
+        signal(SIGINT, on_stop_signal);
+        signal(SIGTERM, on_stop_signal);
+    }
+
+    if (!pin_thread(pthread_self(), opt.reactor_cpus))
+    {
+        fprintf(stderr, "pin reactor thread failed\n");
+    }
+
+    std::vector<worker_group> groups;
     try
     {
-        pool = new threadpool<http_conn>();
+        if (opt.numa_groups)
+        {
+            std::vector<int> cpus = opt.worker_cpus.empty() ? online_cpus() : opt.worker_cpus;
+            std::vector<int> nodes;
+            std::vector<std::vector<int> > node_cpus;
+            group_cpus_by_node(cpus, nodes, node_cpus);
+            for (size_t i = 0; i < nodes.size(); ++i)
+            {
+                worker_group g;
+                g.node = nodes[i];
+                g.cpus = node_cpus[i];
+                // 指定了总线程数时按各节点CPU数比例分配，每组至少一个线程
+                int threads = 0;
+                if (opt.thread_num > 0)
+                {
+                    threads = opt.thread_num * (int)g.cpus.size() / (int)cpus.size();
+                    threads = threads > 0 ? threads : 1;
+                }
+                g.pool = new threadpool<http_conn>(threads, opt.max_requests, g.cpus);
+                groups.push_back(g);
+            }
+        }
+        else
+        {
+            worker_group g;
+            g.node = 0;
+            g.cpus = opt.worker_cpus;
+            g.pool = new threadpool<http_conn>(opt.thread_num, opt.max_requests, g.cpus);
+            groups.push_back(g);
+        }
+        for (size_t i = 0; i < groups.size(); ++i)
+        {
+            groups[i].pool->set_queue_delay(opt.queue_target_ms, threadpool<http_conn>::DEFAULT_INTERVAL_MS,
+                                            opt.queue_deadline_ms);
+        }
     }
     catch (const std::exception &e)
     {
         fprintf(stderr, "%s\n", e.what());
         exit(1);
     }
-    http_conn *users = new http_conn[MAX_FD];
-    assert(users);
+    std::vector<int> cpu_group;
+    if (opt.incoming_cpu && groups.size() > 1)
+    {
+        cpu_group = map_cpu_groups(groups);
+    }
+    http_router router;
+    try
+    {
+        for (size_t i = 0; i < sizeof(builtin_routes) / sizeof(builtin_routes[0]); ++i)
+        {
+            router.add(builtin_routes[i].method, builtin_routes[i].pattern, builtin_routes[i].target);
+        }
+        const route_entry *files = site_pack != NULL ? packed_routes : static_routes;
+        for (size_t i = 0; i < sizeof(static_routes) / sizeof(static_routes[0]); ++i)
+        {
+            router.add(files[i].method, files[i].pattern, files[i].target);
+        }
+        for (size_t i = 0; http_conn::m_upload_root != NULL && i < sizeof(upload_routes) / sizeof(upload_routes[0]); ++i)
+        {
+            router.add(upload_routes[i].method, upload_routes[i].pattern, upload_routes[i].target);
+        }
+        if (proxy_upstream != NULL)
+        {
+            std::string pattern = opt.proxy_prefix;
+            if (pattern.empty() || pattern[pattern.size() - 1] != '/')
+            {
+                pattern += '/';
+            }
+            pattern += "*path";
+            route target = {proxy_pass, accept_proxy_body, false};
+            for (size_t i = 0; i < sizeof(proxy_methods) / sizeof(proxy_methods[0]); ++i)
+            {
+                router.add(proxy_methods[i], pattern.c_str(), target);
+            }
+            proxy_upstream->start_health_checks();
+        }
+        if (!opt.ws_prefix.empty())
+        {
+            //GET升级并订阅，POST向主题发布一条消息
+            std::string pattern = opt.ws_prefix;
+            if (pattern[pattern.size() - 1] != '/')
+            {
+                pattern += '/';
+            }
+            pattern += ":topic";
+            route subscribe = {serve_websocket, NULL, false};
+            route publish = {publish_message, accept_publish, false};
+            router.add(http_conn::GET, pattern.c_str(), subscribe);
+            router.add(http_conn::POST, pattern.c_str(), publish);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        exit(1);
+    }
+    http_conn::m_router = &router;
 
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    assert(listenfd >= 0);
+    rate_limiter *limiter = NULL;
+    if (opt.max_conns_per_ip > 0 || opt.request_rate > 0)
+    {
+        try
+        {
+            limiter = new rate_limiter(opt.max_conns_per_ip, opt.request_rate, opt.request_burst);
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+    }
+    http_conn::m_limiter = limiter;
+
+    ws_hub *hub = NULL;
+    if (!opt.ws_prefix.empty())
+    {
+        try
+        {
+            hub = new ws_hub;
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+    }
+    http_conn::m_ws_hub = hub;
+
+    io_pool *io = NULL;
+    if (opt.io_threads > 0)
+    {
+        try
+        {
+            io = new io_pool(opt.io_threads, io_pool::DEFAULT_JOBS);
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+    }
+    http_conn::m_io_pool = io;
 
-    struct linger tmp = {1, 0};
-    setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+    traffic_capture *capture = NULL;
+    if (opt.capture_file != NULL)
+    {
+        try
+        {
+            capture = new traffic_capture(opt.capture_file);
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+    }
+    http_conn::m_capture = capture;
 
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero(&address, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr=INADDR_ANY;
-    //inet_pton(AF_INET, INADDR_ANY, &address.sin_addr);
-    address.sin_port = htons(port);
+    http_conn *users = new http_conn[MAX_FD];
+    assert(users);
+    // 每个连接所属的工作线程组
+    int *user_group = new int[MAX_FD]();
 
-    ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
-    assert(ret >= 0);
-    ret = listen(listenfd, 5);
-    assert(ret >= 0);
+    std::vector<int> listenfds;
+    for (size_t i = 0; i < opt.listeners.size(); ++i)
+    {
+        int fd = open_listener(opt.listeners[i]);
+        if (fd < 0)
+        {
+            fprintf(stderr, "cannot listen on %s: %s\n", listen_name(opt.listeners[i]).c_str(), strerror(errno));
+            exit(1);
+        }
+        listenfds.push_back(fd);
+    }
 
     epoll_event *events = new epoll_event[MAX_EVENT_NUMBER];
     int epollfd = epoll_create(5);
     assert(epollfd != -1);
-    addfd(epollfd, listenfd, false);
+    for (size_t i = 0; i < listenfds.size(); ++i)
+    {
+        addfd(epollfd, listenfds[i], false);
+    }
     http_conn::m_epollfd = epollfd;
+    if (hub != NULL)
+    {
+        hub->register_events(epollfd);
+    }
 
-    while(true)
+    while(!stop_server)
     {
-        int num=epoll_wait(epollfd,events,MAX_EVENT_NUMBER,-1);
+        int num=epoll_pwait(epollfd,events,MAX_EVENT_NUMBER,-1,stop_signals?&wait_mask:NULL);
         if((num<0)&&(errno!=EINTR))
         {
             fprintf(stderr,"epoll failure\n");
@@ -67,14 +407,14 @@ void run_http_server(int port)
 
         for(int i=0;i<num;++i)
         {
-            int sockfd=events[i].data.fd;
-            if(sockfd==listenfd)
+            int sockfd=(int)(uint32_t)events[i].data.u64;
+            if(is_listener(listenfds,sockfd))
             {
                 while(true)
                 {
-                    struct sockaddr_in client_address;
+                    struct sockaddr_storage client_address;
                     socklen_t client_addrlength = sizeof( client_address );
-                    int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
+                    int connfd = accept( sockfd, ( struct sockaddr* )&client_address, &client_addrlength );
                     if(connfd<0)
                     {
                         if(errno==EAGAIN||errno==EWOULDBLOCK)
@@ -87,28 +427,97 @@ void run_http_server(int port)
                             continue;
                         }
                     }
-                    if(http_conn::m_user_count>=MAX_FD-3)
+                    if(http_conn::m_user_count>=MAX_FD-3||connfd>=MAX_FD)
                     {
                         show_error( connfd, "Internal server busy" );
                         continue;
                     }
-                    users[connfd].init( connfd, client_address );
+                    if( limiter != NULL && !limiter->open_connection( rate_limiter::key_of( ( struct sockaddr* )&client_address ) ) )
+                    {
+                        //TLS连接还没有握手，只能直接关闭
+                        if( !tls_conn::enabled() )
+                        {
+                            send( connfd, http_conn::TOO_MANY_REQUESTS, sizeof( http_conn::TOO_MANY_REQUESTS ) - 1, MSG_NOSIGNAL );
+                        }
+                        close( connfd );
+                        continue;
+                    }
+                    user_group[connfd] = 0;
+                    if( opt.incoming_cpu && groups.size() > 1 )
+                    {
+                        int cpu = -1;
+                        socklen_t len = sizeof( cpu );
+                        if( getsockopt( connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len ) == 0 )
+                        {
+                            user_group[connfd] = find_group( cpu_group, cpu );
+                        }
+                    }
+                    if( opt.incoming_cpu && !groups[user_group[connfd]].cpus.empty() )
+                    {
+                        // 提示内核把该连接的后续处理放到本组CPU上
+                        const std::vector<int> &cpus = groups[user_group[connfd]].cpus;
+                        int cpu = cpus[connfd % cpus.size()];
+                        setsockopt( connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof( cpu ) );
+                    }
+                    users[connfd].init( connfd, ( struct sockaddr* )&client_address, client_addrlength );
                 }
                 
             }
+            else if( hub != NULL && hub->owns( sockfd ) )
+            {
+                //跨线程发布的消息和定时ping
+                hub->handle( sockfd );
+            }
+            else if( http_conn *client = proxy_exchange::client_of( sockfd ) )
+            {
+                //上游连接的事件，推进它所属客户端连接上的转发
+                if( !client->write() )
+                {
+                    client->close_conn();
+                }
+            }
+            else if( users[sockfd].generation() != (uint32_t)( events[i].data.u64 >> 32 ) )
+            {
+                //同一批事件中前面的处理已经关闭了这个连接，fd可能已被新连接复用
+            }
             else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
             {
                 users[sockfd].close_conn();
             }
             else if( events[i].events & EPOLLIN )
             {
-                if( users[sockfd].read() )
+                if( !users[sockfd].read() )
+                {
+                    users[sockfd].close_conn();
+                }
+                else if( users[sockfd].websocket_session() != NULL )
                 {
-                    pool->push( users + sockfd );
+                    //WebSocket的帧在read()中已经处理完
+                }
+                else if( limiter != NULL && limiter->limits_requests() && users[sockfd].begin_request() &&
+                         !limiter->allow_request( users[sockfd].limit_key() ) )
+                {
+                    //在交给线程池之前拒绝，超速的客户端不占用工作线程
+                    if( !users[sockfd].reject( http_conn::TOO_MANY_REQUESTS, sizeof( http_conn::TOO_MANY_REQUESTS ) - 1 ) )
+                    {
+                        users[sockfd].close_conn();
+                    }
+                }
+                else if( opt.dispatch == DISPATCH_POOL )
+                {
+                    dispatch( groups, user_group[sockfd], users + sockfd );
                 }
                 else
                 {
-                    users[sockfd].close_conn();
+                    http_conn::INLINE_RESULT ret = users[sockfd].process_inline( opt.dispatch == DISPATCH_ADAPTIVE );
+                    if( ret == http_conn::INLINE_DEFER )
+                    {
+                        dispatch( groups, user_group[sockfd], users + sockfd );
+                    }
+                    else if( ret == http_conn::INLINE_CLOSE )
+                    {
+                        users[sockfd].close_conn();
+                    }
                 }
             }
             else if( events[i].events & EPOLLOUT )
@@ -121,21 +530,266 @@ void run_http_server(int port)
         }
     }
 
+    //先回收工作线程，再回收I/O线程（工作线程会向它提交任务），之后才能释放它们访问的连接
+    for( size_t i = 0; i < groups.size(); ++i )
+    {
+        delete groups[i].pool;
+    }
+    delete io;
+    //录制器不释放，http_conn::m_capture仍指向它，只写完并关闭文件
+    if (capture != NULL)
+    {
+        capture->stop();
+    }
     close( epollfd );
-    close( listenfd );
+    for( size_t i = 0; i < listenfds.size(); ++i )
+    {
+        close( listenfds[i] );
+        if( opt.listeners[i].family == AF_UNIX )
+        {
+            unlink( opt.listeners[i].path.c_str() );
+        }
+    }
     delete[] users;
-    delete pool;
+    delete[] user_group;
+    delete limiter;
+    delete hub;
+    //停下健康检查线程
+    delete proxy_upstream;
+    proxy_upstream = NULL;
     delete[] events;
 }
 
+void usage(const char *prog)
+{
+    printf("usage: %s [-t threads] [-q queue_size] [-D target_ms[:deadline_ms]] [-c worker_cpus] [-r reactor_cpus] [-n] [-i] [-m mode] [-u upload_dir] [-l] [-s cert_file -k key_file [-K]] [-x /prefix=host:port,...] [-p pack_file [-L]] [-C conns_per_ip] [-R rate[:burst]] [-w /prefix] [-T capture_file] [-I io_threads] [-b listen_addr[,option...]]... [port_number]\n"
+           "  -t  worker thread count, default: number of online CPUs\n"
+           "  -q  request queue size, default: derived from thread count; requests beyond it get 503\n"
+           "  -D  keep worker queueing delay near target_ms with CoDel and answer 503 to requests\n"
+           "      queued longer than deadline_ms, default: 10:1000, 0 disables either\n"
+           "  -c  pin worker threads to a CPU list, e.g. 0-3,8\n"
+           "  -r  pin the reactor thread to a CPU list\n"
+           "  -n  one worker group per NUMA node\n"
+           "  -i  place connections by SO_INCOMING_CPU and set it on accepted sockets\n"
+           "  -m  request dispatch: pool (default), inline (run to completion on the reactor)\n"
+           "      or adaptive (inline unless the request is predicted to block)\n"
+           "  -u  accept PUT uploads into this directory\n"
+           "  -l  serve directory listings as chunked streamed responses\n"
+           "  -s  serve TLS with this PEM certificate chain, offloaded to kernel TLS when available\n"
+           "  -k  PEM private key for -s\n"
+           "  -K  keep TLS in userspace instead of offloading it to the kernel\n"
+           "  -x  reverse-proxy requests under /prefix to these backends over pooled keep-alive connections;\n"
+           "      may be given once\n"
+           "  -p  serve static files from a content pack built by pack_site, falling back to the doc root\n"
+           "  -L  prefault the content pack and lock it in memory\n"
+           "  -C  limit concurrent connections per client IP\n"
+           "  -R  limit requests per second per client IP with a token bucket, burst defaults to the rate\n"
+           "  -w  accept WebSocket subscriptions with GET /prefix/topic and publish to a topic with POST /prefix/topic\n"
+           "  -T  record raw request bytes, connection boundaries and timing for tools/replay;\n"
+           "      SIGINT/SIGTERM then stop the server after flushing the capture\n"
+           "  -I  threads that read file data missing from the page cache before it is sent,\n"
+           "      so sendfile never blocks on disk, default: 4, 0 disables\n"
+           "  -b  also listen on port, host:port, [ipv6]:port or unix:/path; may be repeated,\n"
+           "      options: backlog=N, reuseport, nodelay, rcvbuf=N, sndbuf=N, mode=0660 (unix only);\n"
+           "      unix socket files are removed on SIGINT/SIGTERM; port_number alone listens on 0.0.0.0:port_number\n",
+           prog);
+}
+
 int main(int argc, char **argv)
 {
-    if (argc < 2)
+    server_options opt;
+    opt.thread_num = 0;
+    opt.max_requests = 0;
+    opt.queue_target_ms = threadpool<http_conn>::DEFAULT_TARGET_MS;
+    opt.queue_deadline_ms = threadpool<http_conn>::DEFAULT_DEADLINE_MS;
+    opt.numa_groups = false;
+    opt.incoming_cpu = false;
+    opt.dispatch = DISPATCH_POOL;
+    opt.max_conns_per_ip = 0;
+    opt.request_rate = 0;
+    opt.request_burst = 0;
+    opt.capture_file = NULL;
+    opt.io_threads = io_pool::DEFAULT_THREADS;
+
+    const char *cert_file = NULL;
+    const char *key_file = NULL;
+    bool ktls = true;
+    const char *pack_file = NULL;
+    bool lock_pack = false;
+    int c;
+    while ((c = getopt(argc, argv, "t:q:D:c:r:nim:u:ls:k:Kx:p:LC:R:w:T:I:b:")) != -1)
     {
-        printf("usage: %s port_number\n", basename(argv[0]));
+        switch (c)
+        {
+        case 't':
+            opt.thread_num = atoi(optarg);
+            break;
+        case 'q':
+            opt.max_requests = atoi(optarg);
+            break;
+        case 'D':
+        {
+            char *end = NULL;
+            opt.queue_target_ms = (int)strtol(optarg, &end, 10);
+            if (*end == ':')
+            {
+                opt.queue_deadline_ms = (int)strtol(end + 1, NULL, 10);
+            }
+            break;
+        }
+        case 'c':
+            if (!parse_cpu_list(optarg, opt.worker_cpus))
+            {
+                fprintf(stderr, "bad cpu list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            if (!parse_cpu_list(optarg, opt.reactor_cpus))
+            {
+                fprintf(stderr, "bad cpu list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            opt.numa_groups = true;
+            break;
+        case 'i':
+            opt.incoming_cpu = true;
+            break;
+        case 'm':
+            if (strcmp(optarg, "pool") == 0)
+            {
+                opt.dispatch = DISPATCH_POOL;
+            }
+            else if (strcmp(optarg, "inline") == 0)
+            {
+                opt.dispatch = DISPATCH_INLINE;
+            }
+            else if (strcmp(optarg, "adaptive") == 0)
+            {
+                opt.dispatch = DISPATCH_ADAPTIVE;
+            }
+            else
+            {
+                fprintf(stderr, "bad dispatch mode: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'u':
+            http_conn::m_upload_root = optarg;
+            break;
+        case 'l':
+            http_conn::m_dir_listing = true;
+            break;
+        case 's':
+            cert_file = optarg;
+            break;
+        case 'k':
+            key_file = optarg;
+            break;
+        case 'K':
+            ktls = false;
+            break;
+        case 'p':
+            pack_file = optarg;
+            break;
+        case 'C':
+            opt.max_conns_per_ip = atoi(optarg);
+            break;
+        case 'R':
+        {
+            char *end = NULL;
+            opt.request_rate = strtod(optarg, &end);
+            opt.request_burst = *end == ':' ? strtod(end + 1, NULL) : opt.request_rate;
+            break;
+        }
+        case 'L':
+            lock_pack = true;
+            break;
+        case 'w':
+            if (optarg[0] != '/')
+            {
+                fprintf(stderr, "bad websocket prefix: %s\n", optarg);
+                return 1;
+            }
+            opt.ws_prefix = optarg;
+            break;
+        case 'T':
+            opt.capture_file = optarg;
+            break;
+        case 'I':
+            opt.io_threads = atoi(optarg);
+            break;
+        case 'b':
+        {
+            listen_spec spec;
+            if (!parse_listen_spec(optarg, spec))
+            {
+                fprintf(stderr, "bad listen address: %s\n", optarg);
+                return 1;
+            }
+            opt.listeners.push_back(spec);
+            break;
+        }
+        case 'x':
+        {
+            //只有一个上游连接池和一个前缀
+            if (proxy_upstream != NULL)
+            {
+                fprintf(stderr, "only one -x is supported\n");
+                return 1;
+            }
+            const char *eq = strchr(optarg, '=');
+            proxy_upstream = new upstream_pool;
+            if (optarg[0] != '/' || eq == NULL || !proxy_upstream->add_backends(eq + 1))
+            {
+                fprintf(stderr, "bad proxy spec: %s\n", optarg);
+                return 1;
+            }
+            opt.proxy_prefix.assign(optarg, eq - optarg);
+            break;
+        }
+        default:
+            usage(basename(argv[0]));
+            return 1;
+        }
+    }
+    if (optind < argc)
+    {
+        listen_spec spec;
+        if (!parse_listen_spec(argv[optind], spec))
+        {
+            usage(basename(argv[0]));
+            return 1;
+        }
+        opt.listeners.insert(opt.listeners.begin(), spec);
+    }
+    if (opt.listeners.empty() || opt.thread_num < 0 || opt.max_requests < 0 || opt.queue_target_ms < 0 || opt.queue_deadline_ms < 0 ||
+        opt.io_threads < 0)
+    {
+        usage(basename(argv[0]));
+        return 1;
+    }
+    if ((cert_file == NULL) != (key_file == NULL))
+    {
+        usage(basename(argv[0]));
         return 1;
     }
-    int port = atoi(argv[1]);
-    run_http_server(port);
+    if (cert_file != NULL && !tls_conn::init_context(cert_file, key_file, ktls))
+    {
+        fprintf(stderr, "cannot load certificate %s or key %s\n", cert_file, key_file);
+        return 1;
+    }
+    if (pack_file != NULL)
+    {
+        site_pack = new content_pack;
+        if (!site_pack->open(pack_file, lock_pack))
+        {
+            fprintf(stderr, "cannot load content pack %s\n", pack_file);
+            return 1;
+        }
+    }
+    run_http_server(opt);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,133 @@
+/*
+    测量rate_limiter的判定吞吐。每个线程在ips个客户端IP上循环调用
+    allow_request()，或者成对调用open_connection()/close_connection()。
+    用法: bench_limiter [-t threads] [-n ips] [-d seconds] [-r rate] [-c]
+*/
+#include "rate_limiter.h"
+
+#include <getopt.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+struct bench_args
+{
+    rate_limiter *limiter;
+    int ips;
+    bool connections;
+    unsigned seed;
+    std::atomic<bool> *stop;
+    unsigned long long decisions;
+    unsigned long long allowed;
+};
+
+static void *run(void *arg)
+{
+    bench_args *a = static_cast<bench_args *>(arg);
+    unsigned long long decisions = 0, allowed = 0;
+    unsigned x = a->seed;
+    while (!a->stop->load(std::memory_order_relaxed))
+    {
+        //每批检查一次停止标志，避免它成为测量对象
+        for (int i = 0; i < 1024; ++i)
+        {
+            x = x * 1103515245 + 12345;
+            uint32_t ip = 0x0A000000 + (x >> 8) % a->ips + 1;
+            if (a->connections)
+            {
+                if (a->limiter->open_connection(ip))
+                {
+                    ++allowed;
+                    a->limiter->close_connection(ip);
+                }
+            }
+            else if (a->limiter->allow_request(ip))
+            {
+                ++allowed;
+            }
+        }
+        decisions += 1024;
+    }
+    a->decisions = decisions;
+    a->allowed = allowed;
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int threads = 4;
+    int ips = 10000;
+    int seconds = 3;
+    double rate = 100;
+    bool connections = false;
+    int c;
+    while ((c = getopt(argc, argv, "t:n:d:r:c")) != -1)
+    {
+        switch (c)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            ips = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'c':
+            connections = true;
+            break;
+        default:
+            printf("usage: %s [-t threads] [-n ips] [-d seconds] [-r rate] [-c]\n"
+                   "  -c  measure open/close connection pairs instead of request decisions\n",
+                   basename(argv[0]));
+            return 1;
+        }
+    }
+    if (threads <= 0 || ips <= 0 || seconds <= 0)
+    {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+
+    rate_limiter limiter(connections ? 64 : 0, connections ? 0 : rate, connections ? 0 : rate);
+    std::atomic<bool> stop(false);
+    std::vector<bench_args> args(threads);
+    std::vector<pthread_t> tids(threads);
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < threads; ++i)
+    {
+        args[i].limiter = &limiter;
+        args[i].ips = ips;
+        args[i].connections = connections;
+        args[i].seed = 2654435761u * (i + 1);
+        args[i].stop = &stop;
+        if (pthread_create(&tids[i], NULL, run, &args[i]) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            return 1;
+        }
+    }
+    sleep(seconds);
+    stop = true;
+    unsigned long long decisions = 0, allowed = 0;
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_join(tids[i], NULL);
+        decisions += args[i].decisions;
+        allowed += args[i].allowed;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    printf("%s: %d threads, %d ips, %.2f s\n", connections ? "connections" : "requests", threads, ips, elapsed);
+    printf("%llu decisions, %.2f M/s, %.1f%% allowed\n", decisions, decisions / elapsed / 1e6,
+           decisions > 0 ? 100.0 * allowed / decisions : 0.0);
+    return 0;
+}
@@ -0,0 +1,320 @@
+/*
+    比较同一个http_server在不同监听地址上的吞吐，比如AF_UNIX和TCP回环。
+    对每个目标依次建立conns个长连接，每个连接发一个请求、收完整应答后再发下一个，
+    持续seconds秒，全部在一个epoll线程上驱动。报告每秒请求数、应答字节吞吐和平均延迟。
+
+    用法: bench_transport [-c conns] [-d seconds] [-p path] target...
+      target的写法和http_server的-b相同：port、host:port、[ipv6]:port或者unix:/path，
+      选项部分被忽略
+*/
+#include "listener.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct bench_conn
+{
+    int fd;
+    size_t sent;              // 请求已发出的字节数
+    std::string in;           // 还没有解析完的应答头
+    long long body_left;      // 应答体还差的字节数，-1表示还在读应答头
+    bench_clock::time_point start;
+};
+
+struct bench_result
+{
+    unsigned long long requests;
+    unsigned long long bytes;
+    unsigned long long errors;
+    double latency_sum;       // 秒
+    double elapsed;
+};
+
+static int connect_target(const listen_spec &spec)
+{
+    sockaddr_storage ss;
+    socklen_t len;
+    memset(&ss, 0, sizeof(ss));
+    if (spec.family == AF_UNIX)
+    {
+        sockaddr_un *a = (sockaddr_un *)&ss;
+        a->sun_family = AF_UNIX;
+        memcpy(a->sun_path, spec.path.c_str(), spec.path.size() + 1);
+        len = sizeof(*a);
+    }
+    else if (spec.family == AF_INET6)
+    {
+        sockaddr_in6 *a = (sockaddr_in6 *)&ss;
+        a->sin6_family = AF_INET6;
+        a->sin6_port = htons(spec.port);
+        inet_pton(AF_INET6, spec.host.c_str(), &a->sin6_addr);
+        len = sizeof(*a);
+    }
+    else
+    {
+        sockaddr_in *a = (sockaddr_in *)&ss;
+        a->sin_family = AF_INET;
+        a->sin_port = htons(spec.port);
+        //监听在0.0.0.0时连本机
+        inet_pton(AF_INET, spec.host == "0.0.0.0" ? "127.0.0.1" : spec.host.c_str(), &a->sin_addr);
+        len = sizeof(*a);
+    }
+    int fd = socket(spec.family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    //阻塞地连接，连上之后再切换为非阻塞
+    if (connect(fd, (sockaddr *)&ss, len) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (spec.family != AF_UNIX)
+    {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    return fd;
+}
+
+//读到完整的应答头后取出Content-Length，格式不对返回-2
+static long long parse_head(const std::string &in, size_t head_end)
+{
+    if (in.compare(0, 5, "HTTP/") != 0)
+    {
+        return -2;
+    }
+    size_t pos = in.find("\r\n");
+    while (pos < head_end)
+    {
+        size_t next = in.find("\r\n", pos + 2);
+        if (strncasecmp(in.c_str() + pos + 2, "Content-Length:", 15) == 0)
+        {
+            return atoll(in.c_str() + pos + 17);
+        }
+        pos = next;
+    }
+    return -2;
+}
+
+//发出剩余的请求，返回false表示连接出错
+static bool send_request(bench_conn &c, const std::string &request)
+{
+    while (c.sent < request.size())
+    {
+        ssize_t n = send(c.fd, request.data() + c.sent, request.size() - c.sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c.sent += n;
+    }
+    return true;
+}
+
+static bool run_target(const listen_spec &spec, int conns, int seconds, const std::string &request, bench_result &r)
+{
+    memset(&r, 0, sizeof(r));
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<bench_conn> pool(conns);
+    for (int i = 0; i < conns; ++i)
+    {
+        pool[i].fd = connect_target(spec);
+        if (pool[i].fd < 0)
+        {
+            fprintf(stderr, "cannot connect to %s: %s\n", listen_name(spec).c_str(), strerror(errno));
+            for (int j = 0; j < i; ++j)
+            {
+                close(pool[j].fd);
+            }
+            close(epollfd);
+            return false;
+        }
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, pool[i].fd, &ev);
+    }
+
+    bench_clock::time_point begin = bench_clock::now();
+    bench_clock::time_point end = begin + std::chrono::seconds(seconds);
+    for (int i = 0; i < conns; ++i)
+    {
+        pool[i].sent = 0;
+        pool[i].body_left = -1;
+        pool[i].start = begin;
+        send_request(pool[i], request);
+    }
+    std::vector<epoll_event> events(conns);
+    static char buf[256 * 1024];
+    int active = conns;
+    while (active > 0)
+    {
+        int n = epoll_wait(epollfd, events.data(), conns, 100);
+        bench_clock::time_point now = bench_clock::now();
+        for (int e = 0; e < n; ++e)
+        {
+            bench_conn &c = pool[events[e].data.u32];
+            bool ok = send_request(c, request);
+            while (ok)
+            {
+                ssize_t got = recv(c.fd, buf, sizeof(buf), 0);
+                if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    break;
+                }
+                if (got <= 0)
+                {
+                    ok = false;
+                    break;
+                }
+                size_t off = 0;
+                while (off < (size_t)got)
+                {
+                    if (c.body_left < 0)
+                    {
+                        size_t old = c.in.size();
+                        c.in.append(buf + off, got - off);
+                        size_t head_end = c.in.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+                        if (head_end == std::string::npos)
+                        {
+                            off = got;
+                            break;
+                        }
+                        c.body_left = parse_head(c.in, head_end);
+                        if (c.body_left < 0)
+                        {
+                            ok = false;
+                            break;
+                        }
+                        off += head_end + 4 - old;
+                        r.bytes += head_end + 4;
+                        c.in.clear();
+                    }
+                    size_t take = (size_t)c.body_left < got - off ? (size_t)c.body_left : got - off;
+                    c.body_left -= take;
+                    r.bytes += take;
+                    off += take;
+                    if (c.body_left == 0)
+                    {
+                        //一个应答收完，计时后发下一个请求
+                        ++r.requests;
+                        r.latency_sum += std::chrono::duration<double>(now - c.start).count();
+                        c.body_left = -1;
+                        if (now >= end)
+                        {
+                            ok = false;
+                            break;
+                        }
+                        c.sent = 0;
+                        c.start = now;
+                        ok = send_request(c, request);
+                    }
+                }
+            }
+            if (!ok && c.fd >= 0)
+            {
+                if (now < end)
+                {
+                    ++r.errors;
+                }
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, c.fd, NULL);
+                close(c.fd);
+                c.fd = -1;
+                --active;
+            }
+        }
+        //到时间后不再等待没有应答的连接
+        if (now >= end + std::chrono::seconds(1))
+        {
+            break;
+        }
+    }
+    r.elapsed = std::chrono::duration<double>(bench_clock::now() - begin).count();
+    if (r.elapsed > seconds)
+    {
+        r.elapsed = seconds;
+    }
+    for (int i = 0; i < conns; ++i)
+    {
+        if (pool[i].fd >= 0)
+        {
+            close(pool[i].fd);
+        }
+    }
+    close(epollfd);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int conns = 16;
+    int seconds = 5;
+    const char *path = "/index.html";
+    int c;
+    while ((c = getopt(argc, argv, "c:d:p:")) != -1)
+    {
+        switch (c)
+        {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'p':
+            path = optarg;
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind >= argc || conns <= 0 || seconds <= 0)
+    {
+        printf("usage: %s [-c conns] [-d seconds] [-p path] target...\n"
+               "  target: port, host:port, [ipv6]:port or unix:/path, as for http_server -b\n",
+               basename(argv[0]));
+        return 1;
+    }
+    std::string request = "GET " + std::string(path) + " HTTP/1.1\r\nHost: bench\r\nConnection: keep-alive\r\n\r\n";
+    printf("%-24s %12s %12s %12s %8s\n", "target", "requests/s", "MB/s", "avg us", "errors");
+    for (int i = optind; i < argc; ++i)
+    {
+        listen_spec spec;
+        bench_result r;
+        if (!parse_listen_spec(argv[i], spec))
+        {
+            fprintf(stderr, "bad target: %s\n", argv[i]);
+            return 1;
+        }
+        if (!run_target(spec, conns, seconds, request, r))
+        {
+            return 1;
+        }
+        printf("%-24s %12.0f %12.1f %12.1f %8llu\n", listen_name(spec).c_str(), r.requests / r.elapsed,
+               r.bytes / r.elapsed / 1e6, r.requests > 0 ? r.latency_sum / r.requests * 1e6 : 0.0, r.errors);
+    }
+    return 0;
+}
@@ -0,0 +1,447 @@
+/*
+    把静态站点目录打成content_pack格式的单个文件，供服务器以-p加载。
+    用法: pack_site [-z] [-m min_gzip_size] doc_root out_file
+*/
+#include "content_pack.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+struct mime_type
+{
+    const char *ext;
+    const char *type;
+    bool compressible;
+};
+
+static const mime_type mime_types[] = {
+    {"html", "text/html", true},
+    {"htm", "text/html", true},
+    {"css", "text/css", true},
+    {"js", "application/javascript", true},
+    {"mjs", "application/javascript", true},
+    {"json", "application/json", true},
+    {"txt", "text/plain", true},
+    {"xml", "application/xml", true},
+    {"svg", "image/svg+xml", true},
+    {"csv", "text/csv", true},
+    {"md", "text/markdown", true},
+    {"wasm", "application/wasm", true},
+    {"png", "image/png", false},
+    {"jpg", "image/jpeg", false},
+    {"jpeg", "image/jpeg", false},
+    {"gif", "image/gif", false},
+    {"webp", "image/webp", false},
+    {"ico", "image/x-icon", false},
+    {"woff", "font/woff", false},
+    {"woff2", "font/woff2", false},
+    {"pdf", "application/pdf", false},
+    {"gz", "application/gzip", false},
+    {"zip", "application/zip", false},
+};
+
+static const mime_type *lookup_type(const std::string &path)
+{
+    static const mime_type fallback = {"", "application/octet-stream", false};
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    {
+        return &fallback;
+    }
+    std::string ext = path.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); ++i)
+    {
+        ext[i] = (char)tolower((unsigned char)ext[i]);
+    }
+    for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); ++i)
+    {
+        if (ext == mime_types[i].ext)
+        {
+            return &mime_types[i];
+        }
+    }
+    return &fallback;
+}
+
+struct variant_src
+{
+    std::string body;
+    std::string head;
+    std::string etag;
+};
+
+struct entry_src
+{
+    std::string url;
+    int file;    // 在files中的下标，目录url和它的index.html共用同一个文件
+};
+
+struct file_src
+{
+    std::vector<variant_src> variants;
+};
+
+static bool read_file(const std::string &path, std::string &out)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+    {
+        return false;
+    }
+    char buf[65536];
+    size_t n;
+    out.clear();
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        out.append(buf, n);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+//按字节序遍历，同样的目录总是打出同样的包
+static bool walk(const std::string &dir, const std::string &url, std::vector<std::pair<std::string, std::string> > &out)
+{
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL)
+    {
+        fprintf(stderr, "cannot open %s: %s\n", dir.c_str(), strerror(errno));
+        return false;
+    }
+    std::vector<std::string> names;
+    while (dirent *ent = readdir(d))
+    {
+        if (ent->d_name[0] != '.')
+        {
+            names.push_back(ent->d_name);
+        }
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        std::string path = dir + "/" + names[i];
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            if (!walk(path, url + names[i] + "/", out))
+            {
+                return false;
+            }
+        }
+        else if (S_ISREG(st.st_mode) && (st.st_mode & S_IROTH))
+        {
+            out.push_back(std::make_pair(url + names[i], path));
+        }
+    }
+    return true;
+}
+
+#ifdef HAVE_ZLIB
+static bool gzip(const std::string &in, std::string &out)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    //windowBits加16输出gzip封装
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return false;
+    }
+    out.resize(deflateBound(&zs, in.size()));
+    zs.next_in = (Bytef *)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef *)&out[0];
+    zs.avail_out = out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+#endif
+
+static std::string make_etag(const std::string &body, const char *suffix)
+{
+    char buf[48];
+    snprintf(buf, sizeof(buf), "\"%016llx%s\"", (unsigned long long)pack_hash(body.data(), body.size(), 0), suffix);
+    return buf;
+}
+
+static void make_head(variant_src &v, const mime_type *type, bool gzipped, bool vary)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "Content-Length: %zu\r\nContent-Type: %s\r\nETag: %s\r\n%s%s",
+             v.body.size(), type->type, v.etag.c_str(),
+             gzipped ? "Content-Encoding: gzip\r\n" : "",
+             vary ? "Vary: Accept-Encoding\r\n" : "");
+    v.head = buf;
+}
+
+/*
+    hash-and-displace：键按种子0分到n/4个桶里，从大桶开始为每个桶找一个种子，
+    使桶内所有键落到互不相同的空槽位上。槽位数等于键数，构造出的是最小完美哈希。
+*/
+static bool build_index(const std::vector<entry_src> &entries, std::vector<uint32_t> &seeds, std::vector<int> &slot_of)
+{
+    uint32_t n = entries.size();
+    uint32_t nb = (n + 3) / 4;
+    seeds.assign(nb, 0);
+    slot_of.assign(n, -1);
+    if (n == 0)
+    {
+        return true;
+    }
+    std::vector<std::vector<int> > buckets(nb);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        const std::string &u = entries[i].url;
+        buckets[pack_hash(u.data(), u.size(), 0) % nb].push_back(i);
+    }
+    std::vector<uint32_t> order(nb);
+    for (uint32_t i = 0; i < nb; ++i)
+    {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+
+    std::vector<bool> taken(n, false);
+    std::vector<uint32_t> slots;
+    for (uint32_t k = 0; k < nb; ++k)
+    {
+        const std::vector<int> &b = buckets[order[k]];
+        if (b.empty())
+        {
+            break;
+        }
+        bool placed = false;
+        for (uint32_t seed = 1; seed < 100000000 && !placed; ++seed)
+        {
+            slots.clear();
+            placed = true;
+            for (size_t j = 0; j < b.size() && placed; ++j)
+            {
+                const std::string &u = entries[b[j]].url;
+                uint32_t s = pack_hash(u.data(), u.size(), seed) % n;
+                placed = !taken[s] && std::find(slots.begin(), slots.end(), s) == slots.end();
+                slots.push_back(s);
+            }
+            if (placed)
+            {
+                seeds[order[k]] = seed;
+                for (size_t j = 0; j < b.size(); ++j)
+                {
+                    taken[slots[j]] = true;
+                    slot_of[b[j]] = slots[j];
+                }
+            }
+        }
+        if (!placed)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-z] [-m min_gzip_size] doc_root out_file\n"
+           "  -z  add a gzip variant for compressible types when it saves at least 10%%\n"
+           "  -m  smallest body worth compressing, default 256 bytes\n",
+           prog);
+}
+
+int main(int argc, char **argv)
+{
+    bool compress = false;
+    size_t min_gzip = 256;
+    int c;
+    while ((c = getopt(argc, argv, "zm:")) != -1)
+    {
+        switch (c)
+        {
+        case 'z':
+            compress = true;
+            break;
+        case 'm':
+            min_gzip = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(basename(argv[0]));
+            return 1;
+        }
+    }
+    if (argc - optind != 2)
+    {
+        usage(basename(argv[0]));
+        return 1;
+    }
+#ifndef HAVE_ZLIB
+    if (compress)
+    {
+        fprintf(stderr, "built without zlib, -z ignored\n");
+        compress = false;
+    }
+#endif
+    std::string root = argv[optind];
+    while (root.size() > 1 && root[root.size() - 1] == '/')
+    {
+        root.erase(root.size() - 1);
+    }
+
+    std::vector<std::pair<std::string, std::string> > paths;
+    if (!walk(root, "/", paths))
+    {
+        return 1;
+    }
+    std::vector<file_src> files(paths.size());
+    std::vector<entry_src> entries;
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        const std::string &url = paths[i].first;
+        const mime_type *type = lookup_type(url);
+        variant_src plain;
+        if (!read_file(paths[i].second, plain.body))
+        {
+            fprintf(stderr, "cannot read %s\n", paths[i].second.c_str());
+            return 1;
+        }
+        plain.etag = make_etag(plain.body, "");
+        variant_src gz;
+        bool has_gz = false;
+#ifdef HAVE_ZLIB
+        if (compress && type->compressible && plain.body.size() >= min_gzip && gzip(plain.body, gz.body))
+        {
+            has_gz = gz.body.size() * 10 <= plain.body.size() * 9;
+            gz.etag = make_etag(plain.body, "-gz");
+        }
+#endif
+        make_head(plain, type, false, has_gz);
+        files[i].variants.push_back(plain);
+        if (has_gz)
+        {
+            make_head(gz, type, true, true);
+            files[i].variants.push_back(gz);
+        }
+        entry_src e = {url, (int)i};
+        entries.push_back(e);
+        //目录url指向它的index.html，和serve_static对根目录的处理一致
+        static const char index_name[] = "index.html";
+        if (url.size() >= sizeof(index_name) - 1 &&
+            url.compare(url.size() - (sizeof(index_name) - 1), std::string::npos, index_name) == 0)
+        {
+            entry_src dir = {url.substr(0, url.size() - (sizeof(index_name) - 1)), (int)i};
+            entries.push_back(dir);
+        }
+    }
+
+    std::vector<uint32_t> seeds;
+    std::vector<int> slot_of;
+    if (!build_index(entries, seeds, slot_of))
+    {
+        fprintf(stderr, "cannot build a perfect hash for %zu urls\n", entries.size());
+        return 1;
+    }
+
+    //字符串区紧跟在种子表之后，应答体最后；相同内容的文件共用一份应答体
+    pack_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version = PACK_VERSION;
+    header.entry_count = entries.size();
+    header.bucket_count = seeds.size();
+    header.entries_off = sizeof(pack_header);
+    header.seeds_off = header.entries_off + entries.size() * sizeof(pack_entry);
+    uint64_t strings_off = header.seeds_off + seeds.size() * sizeof(uint32_t);
+
+    std::string strings;
+    std::string bodies;
+    std::map<std::pair<uint64_t, size_t>, uint64_t> body_at;
+    std::vector<pack_entry> table(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        pack_entry &e = table[slot_of[i]];
+        memset(&e, 0, sizeof(e));
+        e.url_off = strings_off + strings.size();
+        e.url_len = entries[i].url.size();
+        strings += entries[i].url;
+        const file_src &f = files[entries[i].file];
+        e.variant_count = f.variants.size();
+        for (size_t j = 0; j < f.variants.size(); ++j)
+        {
+            const variant_src &src = f.variants[j];
+            pack_variant &v = e.variants[j];
+            v.head_off = strings_off + strings.size();
+            v.head_len = src.head.size();
+            strings += src.head;
+            v.etag_off = strings_off + strings.size();
+            v.etag_len = src.etag.size();
+            strings += src.etag;
+            std::pair<uint64_t, size_t> key(pack_hash(src.body.data(), src.body.size(), 0), src.body.size());
+            std::map<std::pair<uint64_t, size_t>, uint64_t>::iterator it = body_at.find(key);
+            if (it != body_at.end() && bodies.compare(it->second, src.body.size(), src.body) == 0)
+            {
+                v.body_off = it->second;
+            }
+            else
+            {
+                v.body_off = bodies.size();
+                body_at[key] = v.body_off;
+                bodies += src.body;
+            }
+            v.body_len = src.body.size();
+        }
+    }
+    uint64_t bodies_off = strings_off + strings.size();
+    for (size_t i = 0; i < table.size(); ++i)
+    {
+        for (uint32_t j = 0; j < table[i].variant_count; ++j)
+        {
+            table[i].variants[j].body_off += bodies_off;
+        }
+    }
+    header.file_size = bodies_off + bodies.size();
+
+    std::string tmp = std::string(argv[optind + 1]) + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "cannot create %s: %s\n", tmp.c_str(), strerror(errno));
+        return 1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              (table.empty() || fwrite(table.data(), sizeof(pack_entry), table.size(), out) == table.size()) &&
+              (seeds.empty() || fwrite(seeds.data(), sizeof(uint32_t), seeds.size(), out) == seeds.size()) &&
+              fwrite(strings.data(), 1, strings.size(), out) == strings.size() &&
+              fwrite(bodies.data(), 1, bodies.size(), out) == bodies.size();
+    ok = fclose(out) == 0 && ok;
+    //先写临时文件再改名，正在运行的服务器映射的旧包不受影响
+    if (!ok || rename(tmp.c_str(), argv[optind + 1]) != 0)
+    {
+        fprintf(stderr, "cannot write %s: %s\n", argv[optind + 1], strerror(errno));
+        unlink(tmp.c_str());
+        return 1;
+    }
+    printf("packed %zu files as %zu urls, %llu bytes\n", files.size(), entries.size(), (unsigned long long)header.file_size);
+    return 0;
+}
@@ -0,0 +1,893 @@
+/*
+    回放http_server -T录制的流量。每个录制的连接对应一个回放连接，在原来的相对时间建立，
+    其中的请求按原来的时间间隔逐个发出，收到完整应答后才发下一个；
+    服务器关闭了连接而后面还有请求时重新连接。全部在一个epoll线程上驱动。
+    结束后报告吞吐、延迟分布和状态码分布。
+
+    用法: replay [-s speed] [-a address] [-t timeout] capture_file port
+      -s  回放速度倍数，默认1；0表示不等待，所有连接立即建立，请求背靠背发出
+      -a  服务器IPv4地址，默认127.0.0.1
+      -t  单个请求的超时秒数，默认10
+
+    录制中使用HTTP/2、升级为WebSocket或者数据不完整的连接，只回放升级之前的请求。
+    请求体按一次发出，不重现客户端上传时的节奏。
+*/
+#include "capture.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <queue>
+#include <string>
+#include <strings.h>
+#include <unordered_map>
+#include <vector>
+
+struct replay_request
+{
+    std::string bytes;
+    uint64_t time_us; // 请求第一个字节被读到的时间
+    bool head;
+};
+
+//应答的解析状态
+enum RESPONSE_STATE
+{
+    RESP_HEAD,
+    RESP_BODY,        // 剩余remaining字节
+    RESP_CHUNK_SIZE,
+    RESP_CHUNK_DATA,  // 当前块剩余remaining字节
+    RESP_CHUNK_CRLF,
+    RESP_TRAILER,
+    RESP_UNTIL_CLOSE
+};
+
+enum CONN_STATE
+{
+    CONN_WAIT_OPEN,  // 等待录制中的建立时间
+    CONN_CONNECTING,
+    CONN_WAIT_SEND,  // 等待下一个请求的时间
+    CONN_SENDING,
+    CONN_RECEIVING,
+    CONN_LINGER,     // 请求都已完成，等待录制中的关闭时间
+    CONN_DONE
+};
+
+struct replay_conn
+{
+    uint64_t open_us;
+    uint64_t close_us;
+    bool lost;
+    bool truncated; // 录制中后面还有无法回放的数据
+    std::string stream;
+    std::vector<std::pair<size_t, uint64_t> > arrivals; // 每段数据在stream中的起点和时间
+    std::vector<replay_request> requests;
+
+    int fd;
+    CONN_STATE state;
+    size_t next;    // 下一个要发出的请求
+    size_t sent;    // 当前请求已发出的字节数
+    uint64_t started_ns;
+    uint64_t deadline_ns;
+    std::string in;
+    RESPONSE_STATE resp;
+    unsigned long long remaining;
+    int status;
+    bool server_close;
+};
+
+struct replay_stats
+{
+    std::vector<uint64_t> latency_us;
+    unsigned long long bytes_in = 0;
+    unsigned long long status_class[6] = {0, 0, 0, 0, 0, 0};
+    unsigned long long errors = 0;
+    unsigned long long timeouts = 0;
+    unsigned long long reconnects = 0;
+    unsigned long long late = 0;   // 发出时已落后于计划超过1ms的请求
+    uint64_t max_lag_us = 0;
+};
+
+static uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool load_capture(const char *path, std::vector<replay_conn> &conns)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(capture_header))
+    {
+        close(fd);
+        return false;
+    }
+    std::string file(st.st_size, '\0');
+    size_t off = 0;
+    while (off < file.size())
+    {
+        ssize_t n = read(fd, &file[off], file.size() - off);
+        if (n <= 0)
+        {
+            close(fd);
+            return false;
+        }
+        off += n;
+    }
+    close(fd);
+    if (memcmp(file.data(), CAPTURE_MAGIC, 8) != 0)
+    {
+        return false;
+    }
+
+    std::unordered_map<uint64_t, size_t> index;
+    const char *p = file.data() + sizeof(capture_header);
+    const char *end = file.data() + file.size();
+    capture_record r;
+    r.time_us = 0;
+    //服务器被强行终止时最后一条记录可能不完整，之前的记录仍然可用
+    while (capture_next(p, end, r))
+    {
+        std::unordered_map<uint64_t, size_t>::iterator it = index.find(r.conn);
+        if (r.type == CAP_OPEN)
+        {
+            if (it != index.end())
+            {
+                continue;
+            }
+            replay_conn c;
+            c.open_us = r.time_us;
+            c.close_us = 0;
+            c.lost = false;
+            c.truncated = false;
+            index[r.conn] = conns.size();
+            conns.push_back(c);
+            continue;
+        }
+        if (it == index.end())
+        {
+            continue;
+        }
+        replay_conn &c = conns[it->second];
+        if (r.type == CAP_DATA)
+        {
+            c.arrivals.push_back(std::make_pair(c.stream.size(), r.time_us));
+            c.stream.append(r.data, r.len);
+        }
+        else if (r.type == CAP_CLOSE)
+        {
+            c.close_us = r.time_us;
+        }
+        else
+        {
+            c.lost = true;
+        }
+    }
+    //录制结束时仍未关闭的连接在最后一条记录时关闭
+    for (size_t i = 0; i < conns.size(); ++i)
+    {
+        if (conns[i].close_us == 0)
+        {
+            conns[i].close_us = r.time_us;
+        }
+    }
+    return true;
+}
+
+static const char *find_header(const std::string &head, const char *name)
+{
+    size_t len = strlen(name);
+    size_t pos = head.find("\r\n");
+    while (pos != std::string::npos && pos + 2 < head.size())
+    {
+        const char *line = head.data() + pos + 2;
+        if (strncasecmp(line, name, len) == 0 && line[len] == ':')
+        {
+            return line + len + 1 + strspn(line + len + 1, " \t");
+        }
+        pos = head.find("\r\n", pos + 2);
+    }
+    return NULL;
+}
+
+//跳过分块编码的请求体，返回请求体之后的位置，数据不完整时返回npos
+static size_t skip_chunked(const std::string &s, size_t pos)
+{
+    while (true)
+    {
+        size_t eol = s.find("\r\n", pos);
+        if (eol == std::string::npos)
+        {
+            return std::string::npos;
+        }
+        unsigned long long size = strtoull(s.c_str() + pos, NULL, 16);
+        pos = eol + 2;
+        if (size == 0)
+        {
+            break;
+        }
+        if (s.size() - pos < size + 2)
+        {
+            return std::string::npos;
+        }
+        pos += size + 2;
+    }
+    //trailer直到空行
+    while (true)
+    {
+        size_t eol = s.find("\r\n", pos);
+        if (eol == std::string::npos)
+        {
+            return std::string::npos;
+        }
+        bool blank = eol == pos;
+        pos = eol + 2;
+        if (blank)
+        {
+            return pos;
+        }
+    }
+}
+
+//把连接的字节流切成请求，遇到无法按HTTP/1.1回放的内容时停止
+static void split_requests(replay_conn &c)
+{
+    size_t pos = 0;
+    while (pos < c.stream.size())
+    {
+        if (c.stream.compare(pos, 14, "PRI * HTTP/2.0") == 0)
+        {
+            break;
+        }
+        size_t head_end = c.stream.find("\r\n\r\n", pos);
+        if (head_end == std::string::npos)
+        {
+            break;
+        }
+        head_end += 4;
+        std::string head = c.stream.substr(pos, head_end - pos);
+        if (find_header(head, "Upgrade") != NULL)
+        {
+            break;
+        }
+        size_t end = head_end;
+        const char *te = find_header(head, "Transfer-Encoding");
+        const char *cl = find_header(head, "Content-Length");
+        if (te != NULL && strncasecmp(te, "chunked", 7) == 0)
+        {
+            end = skip_chunked(c.stream, head_end);
+        }
+        else if (cl != NULL)
+        {
+            unsigned long long len = strtoull(cl, NULL, 10);
+            end = c.stream.size() - head_end >= len ? head_end + len : std::string::npos;
+        }
+        if (end == std::string::npos)
+        {
+            break;
+        }
+        replay_request req;
+        req.bytes = c.stream.substr(pos, end - pos);
+        req.head = head.compare(0, 5, "HEAD ") == 0;
+        //请求开始于哪一段数据
+        std::vector<std::pair<size_t, uint64_t> >::iterator it =
+            std::upper_bound(c.arrivals.begin(), c.arrivals.end(), std::make_pair(pos, UINT64_MAX));
+        req.time_us = it == c.arrivals.begin() ? c.open_us : (it - 1)->second;
+        c.requests.push_back(req);
+        pos = end;
+    }
+    c.truncated = pos < c.stream.size();
+    std::string().swap(c.stream);
+    std::vector<std::pair<size_t, uint64_t> >().swap(c.arrivals);
+}
+
+/*
+    增量解析应答，已解析的字节从in中移除。
+    返回1表示应答完整，0表示需要更多数据，-1表示应答无效。
+*/
+static int parse_response(replay_conn &c, bool head_request)
+{
+    while (true)
+    {
+        switch (c.resp)
+        {
+        case RESP_HEAD:
+        {
+            size_t end = c.in.find("\r\n\r\n");
+            if (end == std::string::npos)
+            {
+                return c.in.size() > 65536 ? -1 : 0;
+            }
+            std::string head = c.in.substr(0, end + 4);
+            c.in.erase(0, end + 4);
+            if (head.compare(0, 5, "HTTP/") != 0 || head.size() < 12)
+            {
+                return -1;
+            }
+            c.status = atoi(head.c_str() + 9);
+            if (c.status >= 100 && c.status < 200)
+            {
+                continue; // 100 Continue等中间应答
+            }
+            const char *conn = find_header(head, "Connection");
+            c.server_close = conn != NULL && strncasecmp(conn, "close", 5) == 0;
+            const char *te = find_header(head, "Transfer-Encoding");
+            const char *cl = find_header(head, "Content-Length");
+            if (head_request || c.status == 204 || c.status == 304)
+            {
+                return 1;
+            }
+            if (te != NULL && strncasecmp(te, "chunked", 7) == 0)
+            {
+                c.resp = RESP_CHUNK_SIZE;
+            }
+            else if (cl != NULL)
+            {
+                c.remaining = strtoull(cl, NULL, 10);
+                c.resp = RESP_BODY;
+            }
+            else
+            {
+                c.server_close = true;
+                c.resp = RESP_UNTIL_CLOSE;
+            }
+            break;
+        }
+        case RESP_BODY:
+        {
+            size_t n = std::min<unsigned long long>(c.remaining, c.in.size());
+            c.in.erase(0, n);
+            c.remaining -= n;
+            if (c.remaining > 0)
+            {
+                return 0;
+            }
+            return 1;
+        }
+        case RESP_CHUNK_SIZE:
+        {
+            size_t eol = c.in.find("\r\n");
+            if (eol == std::string::npos)
+            {
+                return c.in.size() > 1024 ? -1 : 0;
+            }
+            c.remaining = strtoull(c.in.c_str(), NULL, 16);
+            c.in.erase(0, eol + 2);
+            c.resp = c.remaining == 0 ? RESP_TRAILER : RESP_CHUNK_DATA;
+            break;
+        }
+        case RESP_CHUNK_DATA:
+        {
+            size_t n = std::min<unsigned long long>(c.remaining, c.in.size());
+            c.in.erase(0, n);
+            c.remaining -= n;
+            if (c.remaining > 0)
+            {
+                return 0;
+            }
+            c.resp = RESP_CHUNK_CRLF;
+            break;
+        }
+        case RESP_CHUNK_CRLF:
+            if (c.in.size() < 2)
+            {
+                return 0;
+            }
+            c.in.erase(0, 2);
+            c.resp = RESP_CHUNK_SIZE;
+            break;
+        case RESP_TRAILER:
+        {
+            size_t eol = c.in.find("\r\n");
+            if (eol == std::string::npos)
+            {
+                return 0;
+            }
+            c.in.erase(0, eol + 2);
+            if (eol == 0)
+            {
+                return 1;
+            }
+            break;
+        }
+        case RESP_UNTIL_CLOSE:
+            c.in.clear();
+            return 0;
+        }
+    }
+}
+
+class replayer
+{
+public:
+    replayer(std::vector<replay_conn> &conns, double speed, const sockaddr_in &addr, int timeout)
+        : m_conns(conns), m_speed(speed), m_addr(addr), m_timeout_ns((uint64_t)timeout * 1000000000ULL),
+          m_active(0), m_start_ns(0)
+    {
+        m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    ~replayer() { close(m_epollfd); }
+
+    void run();
+    replay_stats &stats() { return m_stats; }
+
+private:
+    typedef std::pair<uint64_t, size_t> timer; // (时刻, 连接下标)
+
+    uint64_t scheduled(uint64_t time_us) const
+    {
+        return m_speed == 0 ? 0 : m_start_ns + (uint64_t)(time_us * 1000 / m_speed);
+    }
+    void schedule(size_t i, CONN_STATE state, uint64_t at);
+    void on_timer(size_t i, uint64_t now);
+    void on_event(size_t i, uint64_t now);
+    bool start_connect(replay_conn &c, size_t i);
+    void start_send(replay_conn &c, size_t i, uint64_t now);
+    void send_more(replay_conn &c, size_t i);
+    void receive(replay_conn &c, size_t i);
+    void finish_request(replay_conn &c, size_t i, uint64_t now);
+    void fail(replay_conn &c, bool timeout);
+    void drop_socket(replay_conn &c);
+    void finish(replay_conn &c);
+    void watch(replay_conn &c, size_t i, uint32_t events);
+
+    std::vector<replay_conn> &m_conns;
+    double m_speed;
+    sockaddr_in m_addr;
+    uint64_t m_timeout_ns;
+    int m_epollfd;
+    size_t m_active;
+    uint64_t m_start_ns;
+    std::priority_queue<timer, std::vector<timer>, std::greater<timer> > m_timers;
+    replay_stats m_stats;
+};
+
+void replayer::watch(replay_conn &c, size_t i, uint32_t events)
+{
+    epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = i;
+    epoll_ctl(m_epollfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+void replayer::schedule(size_t i, CONN_STATE state, uint64_t at)
+{
+    m_conns[i].state = state;
+    m_timers.push(std::make_pair(at, i));
+}
+
+bool replayer::start_connect(replay_conn &c, size_t i)
+{
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd < 0)
+    {
+        return false;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c.fd, (const sockaddr *)&m_addr, sizeof(m_addr)) < 0 && errno != EINPROGRESS)
+    {
+        close(c.fd);
+        c.fd = -1;
+        return false;
+    }
+    epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.u64 = i;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+    c.state = CONN_CONNECTING;
+    c.deadline_ns = now_ns() + m_timeout_ns;
+    return true;
+}
+
+void replayer::drop_socket(replay_conn &c)
+{
+    if (c.fd >= 0)
+    {
+        close(c.fd);
+        c.fd = -1;
+    }
+}
+
+void replayer::finish(replay_conn &c)
+{
+    drop_socket(c);
+    c.state = CONN_DONE;
+    --m_active;
+}
+
+void replayer::fail(replay_conn &c, bool timeout)
+{
+    //当前和之后的请求都不再回放
+    unsigned long long lost = c.requests.size() - c.next;
+    m_stats.errors += lost;
+    if (timeout)
+    {
+        ++m_stats.timeouts;
+    }
+    c.next = c.requests.size();
+    finish(c);
+}
+
+void replayer::start_send(replay_conn &c, size_t i, uint64_t now)
+{
+    if (c.fd < 0)
+    {
+        //服务器关闭了上一个连接，像真实客户端一样重新连接
+        ++m_stats.reconnects;
+        if (!start_connect(c, i))
+        {
+            fail(c, false);
+        }
+        return;
+    }
+    uint64_t due = scheduled(c.requests[c.next].time_us);
+    if (m_speed != 0 && now > due)
+    {
+        uint64_t lag = (now - due) / 1000;
+        m_stats.max_lag_us = std::max(m_stats.max_lag_us, lag);
+        if (lag > 1000)
+        {
+            ++m_stats.late;
+        }
+    }
+    c.state = CONN_SENDING;
+    c.sent = 0;
+    c.started_ns = now;
+    c.deadline_ns = now + m_timeout_ns;
+    c.in.clear();
+    c.resp = RESP_HEAD;
+    c.server_close = false;
+    send_more(c, i);
+}
+
+void replayer::send_more(replay_conn &c, size_t i)
+{
+    const std::string &bytes = c.requests[c.next].bytes;
+    while (c.sent < bytes.size())
+    {
+        ssize_t n = send(c.fd, bytes.data() + c.sent, bytes.size() - c.sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                watch(c, i, EPOLLOUT);
+                return;
+            }
+            fail(c, false);
+            return;
+        }
+        c.sent += n;
+    }
+    c.state = CONN_RECEIVING;
+    watch(c, i, EPOLLIN);
+}
+
+void replayer::receive(replay_conn &c, size_t i)
+{
+    char buf[65536];
+    while (true)
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            fail(c, false);
+            return;
+        }
+        if (n == 0)
+        {
+            //没有长度的应答以关闭结束
+            if (c.resp == RESP_UNTIL_CLOSE)
+            {
+                drop_socket(c);
+                finish_request(c, i, now_ns());
+            }
+            else
+            {
+                fail(c, false);
+            }
+            return;
+        }
+        m_stats.bytes_in += n;
+        c.in.append(buf, n);
+        int ret = parse_response(c, c.requests[c.next].head);
+        if (ret < 0)
+        {
+            fail(c, false);
+            return;
+        }
+        if (ret > 0)
+        {
+            finish_request(c, i, now_ns());
+            return;
+        }
+        c.deadline_ns = now_ns() + m_timeout_ns;
+    }
+}
+
+void replayer::finish_request(replay_conn &c, size_t i, uint64_t now)
+{
+    m_stats.latency_us.push_back((now - c.started_ns) / 1000);
+    int cls = c.status / 100;
+    ++m_stats.status_class[cls >= 1 && cls <= 5 ? cls : 0];
+    ++c.next;
+    if (c.server_close)
+    {
+        drop_socket(c);
+    }
+    else
+    {
+        watch(c, i, EPOLLIN);
+    }
+    if (c.next < c.requests.size())
+    {
+        schedule(i, CONN_WAIT_SEND, std::max(now, scheduled(c.requests[c.next].time_us)));
+    }
+    else if (m_speed == 0 || c.fd < 0)
+    {
+        finish(c);
+    }
+    else
+    {
+        schedule(i, CONN_LINGER, scheduled(c.close_us));
+    }
+}
+
+void replayer::on_timer(size_t i, uint64_t now)
+{
+    replay_conn &c = m_conns[i];
+    switch (c.state)
+    {
+    case CONN_WAIT_OPEN:
+        if (!start_connect(c, i))
+        {
+            fail(c, false);
+        }
+        break;
+    case CONN_WAIT_SEND:
+        start_send(c, i, now);
+        break;
+    case CONN_LINGER:
+        finish(c);
+        break;
+    default:
+        break;
+    }
+}
+
+void replayer::on_event(size_t i, uint64_t now)
+{
+    replay_conn &c = m_conns[i];
+    switch (c.state)
+    {
+    case CONN_CONNECTING:
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+        {
+            fail(c, false);
+            return;
+        }
+        watch(c, i, EPOLLIN);
+        //首次连接在录制的建立时间，之后的请求按各自的时间发出
+        schedule(i, CONN_WAIT_SEND, std::max(now, scheduled(c.requests[c.next].time_us)));
+        break;
+    }
+    case CONN_SENDING:
+        send_more(c, i);
+        break;
+    case CONN_RECEIVING:
+        receive(c, i);
+        break;
+    case CONN_WAIT_SEND:
+    case CONN_LINGER:
+    {
+        //空闲时服务器关闭连接（例如长连接超时），下一个请求重新连接
+        char buf[256];
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            drop_socket(c);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void replayer::run()
+{
+    m_start_ns = now_ns();
+    for (size_t i = 0; i < m_conns.size(); ++i)
+    {
+        replay_conn &c = m_conns[i];
+        c.fd = -1;
+        c.next = 0;
+        c.state = CONN_DONE;
+        if (c.requests.empty())
+        {
+            continue;
+        }
+        ++m_active;
+        schedule(i, CONN_WAIT_OPEN, scheduled(c.open_us));
+    }
+    epoll_event events[1024];
+    uint64_t next_sweep = 0;
+    while (m_active > 0)
+    {
+        uint64_t now = now_ns();
+        while (!m_timers.empty() && m_timers.top().first <= now)
+        {
+            timer t = m_timers.top();
+            m_timers.pop();
+            on_timer(t.second, now);
+        }
+        //超时检查不需要很精确，每100毫秒扫一遍
+        if (now >= next_sweep)
+        {
+            for (size_t i = 0; i < m_conns.size(); ++i)
+            {
+                replay_conn &c = m_conns[i];
+                if ((c.state == CONN_CONNECTING || c.state == CONN_SENDING || c.state == CONN_RECEIVING) &&
+                    now > c.deadline_ns)
+                {
+                    fail(c, true);
+                }
+            }
+            next_sweep = now + 100000000ULL;
+        }
+        if (m_active == 0)
+        {
+            break;
+        }
+        uint64_t wake = next_sweep;
+        if (!m_timers.empty())
+        {
+            wake = std::min(wake, m_timers.top().first);
+        }
+        int timeout_ms = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+        int num = epoll_wait(m_epollfd, events, 1024, timeout_ms);
+        now = now_ns();
+        for (int k = 0; k < num; ++k)
+        {
+            on_event(events[k].data.u64, now);
+        }
+    }
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t idx = (size_t)(p / 100 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s speed] [-a address] [-t timeout] capture_file port\n"
+                    "  -s  replay speed multiplier, default 1; 0 opens every connection at once and sends back to back\n"
+                    "  -a  server IPv4 address, default 127.0.0.1\n"
+                    "  -t  per-request timeout in seconds, default 10\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 1;
+    const char *address = "127.0.0.1";
+    int timeout = 10;
+    int c;
+    while ((c = getopt(argc, argv, "s:a:t:")) != -1)
+    {
+        switch (c)
+        {
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'a':
+            address = optarg;
+            break;
+        case 't':
+            timeout = atoi(optarg);
+            break;
+        default:
+            usage(basename(argv[0]));
+            return 1;
+        }
+    }
+    if (optind + 2 != argc || speed < 0 || timeout <= 0)
+    {
+        usage(basename(argv[0]));
+        return 1;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address: %s\n", address);
+        return 1;
+    }
+
+    std::vector<replay_conn> conns;
+    if (!load_capture(argv[optind], conns))
+    {
+        fprintf(stderr, "cannot read capture %s\n", argv[optind]);
+        return 1;
+    }
+    size_t requests = 0, skipped = 0, truncated = 0;
+    uint64_t span_us = 0;
+    for (size_t i = 0; i < conns.size(); ++i)
+    {
+        if (conns[i].lost)
+        {
+            ++skipped;
+            std::string().swap(conns[i].stream);
+            continue;
+        }
+        split_requests(conns[i]);
+        requests += conns[i].requests.size();
+        truncated += conns[i].truncated;
+        span_us = std::max(span_us, conns[i].close_us);
+    }
+    printf("capture: %zu connections, %zu requests over %.2fs", conns.size(), requests, span_us / 1e6);
+    if (skipped > 0 || truncated > 0)
+    {
+        printf(" (%zu connections lost in capture, %zu cut short by upgrades or partial data)", skipped, truncated);
+    }
+    printf("\n");
+
+    replayer r(conns, speed, addr, timeout);
+    uint64_t begin = now_ns();
+    r.run();
+    double seconds = (now_ns() - begin) / 1e9;
+
+    replay_stats &st = r.stats();
+    std::sort(st.latency_us.begin(), st.latency_us.end());
+    size_t done = st.latency_us.size();
+    printf("replayed %zu requests in %.2fs at %gx: %.0f req/s, %.2f MB/s received\n", done, seconds, speed,
+           done / seconds, st.bytes_in / seconds / 1e6);
+    printf("latency us: p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+           (unsigned long long)percentile(st.latency_us, 50), (unsigned long long)percentile(st.latency_us, 90),
+           (unsigned long long)percentile(st.latency_us, 99), (unsigned long long)percentile(st.latency_us, 99.9),
+           (unsigned long long)(done > 0 ? st.latency_us.back() : 0));
+    printf("status: 1xx %llu  2xx %llu  3xx %llu  4xx %llu  5xx %llu  other %llu\n", st.status_class[1],
+           st.status_class[2], st.status_class[3], st.status_class[4], st.status_class[5], st.status_class[0]);
+    printf("errors %llu (timeouts %llu), reconnects %llu", st.errors, st.timeouts, st.reconnects);
+    if (speed != 0)
+    {
+        printf(", sent late %llu (max lag %.1f ms)", st.late, st.max_lag_us / 1e3);
+    }
+    printf("\n");
+    return st.errors > 0 ? 2 : 0;
+}